@@ -52,6 +52,13 @@
 #define USBTMC_IOCTL_NAME_GET_ATTRIBUTE				"getattr"
 #define USBTMC_IOCTL_NAME_RESET_CONF				"reset"
 
+// Session commands of usbtmc_ioctl, handled in user space
+#define USBTMC_IOCTL_NAME_SHELL						"shell"
+#define USBTMC_IOCTL_NAME_WRITE						"write"
+#define USBTMC_IOCTL_NAME_READ						"read"
+#define USBTMC_IOCTL_NAME_QUERY						"query"
+#define USBTMC_IOCTL_NAME_BENCH						"bench"
+
 // This structure is used with USBTMC_IOCTL_GET_CAPABILITIES.
 // See section 4.2.1.8 of the USBTMC specification for details.
 struct usbtmc_dev_capabilities {
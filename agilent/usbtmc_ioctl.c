@@ -14,64 +14,260 @@
 // but WITHOUT ANY WARRANTY; without even the implied warranty of
 // MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 // GNU General Public License for more details.
-// 
+//
 // The GNU General Public License is available at
 // http://www.gnu.org/copyleft/gpl.html.
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include "usbtmc.h"
 
+// Longest command line accepted in shell mode
+#define MAX_LINE 4096
+
+// Largest response accepted by read and query
+#define MAX_RESPONSE (1024*1024)
+
+// Most words on a command line (request and its parameters)
+#define MAX_WORDS 8
+
 int minor_number=0;
 char devfile[100];
-int request=-1;
 int myfile;
 int rv;
+int fread_mode=1; // Read mode of the device, the driver starts in fread mode
 struct usbtmc_dev_capabilities devcaps;
 struct usbtmc_attribute attr;
+char response[MAX_RESPONSE];
 
-int main(int argc,char *argv[])
+// Convert a request name to the request value (-1 if unknown)
+int request_code(const char *name)
 {
-	if(argc<3) goto print_usage;
-	
-	// Convert parameter #1 (minor number)
-	sscanf(argv[1],"%d",&minor_number);
-	if((minor_number<1)||(minor_number>USBTMC_MINOR_NUMBERS)) {
-		printf("Error: Bad minor number.\n");
-		goto print_usage;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_GET_CAPABILITIES))
+		return USBTMC_IOCTL_GET_CAPABILITIES;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_INDICATOR_PULSE))
+		return USBTMC_IOCTL_INDICATOR_PULSE;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_CLEAR))
+		return USBTMC_IOCTL_CLEAR;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_ABORT_BULK_OUT))
+		return USBTMC_IOCTL_ABORT_BULK_OUT;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_ABORT_BULK_IN))
+		return USBTMC_IOCTL_ABORT_BULK_IN;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_SET_ATTRIBUTE))
+		return USBTMC_IOCTL_SET_ATTRIBUTE;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_CLEAR_OUT_HALT))
+		return USBTMC_IOCTL_CLEAR_OUT_HALT;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_CLEAR_IN_HALT))
+		return USBTMC_IOCTL_CLEAR_IN_HALT;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_GET_ATTRIBUTE))
+		return USBTMC_IOCTL_GET_ATTRIBUTE;
+	if(!strcmp(name,USBTMC_IOCTL_NAME_RESET_CONF))
+		return USBTMC_IOCTL_RESET_CONF;
+	return -1;
+}
+
+// Convert an attribute name to the attribute value (-1 if unknown)
+int attribute_code(const char *name)
+{
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_AUTO_ABORT_ON_ERROR))
+		return USBTMC_ATTRIB_AUTO_ABORT_ON_ERROR;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_READ_MODE))
+		return USBTMC_ATTRIB_READ_MODE;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_TIMEOUT))
+		return USBTMC_ATTRIB_TIMEOUT;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_NUM_INSTRUMENTS))
+		return USBTMC_ATTRIB_NUM_INSTRUMENTS;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_MINOR_NUMBERS))
+		return USBTMC_ATTRIB_MINOR_NUMBERS;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_SIZE_IO_BUFFER))
+		return USBTMC_ATTRIB_SIZE_IO_BUFFER;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_DEFAULT_TIMEOUT))
+		return USBTMC_ATTRIB_DEFAULT_TIMEOUT;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_DEBUG_MODE))
+		return USBTMC_ATTRIB_DEBUG_MODE;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_VERSION))
+		return USBTMC_ATTRIB_VERSION;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_TERM_CHAR_ENABLED))
+		return USBTMC_ATTRIB_TERM_CHAR_ENABLED;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_TERM_CHAR))
+		return USBTMC_ATTRIB_TERM_CHAR;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_ADD_NL_ON_READ))
+		return USBTMC_ATTRIB_ADD_NL_ON_READ;
+	if(!strcmp(name,USBTMC_ATTRIB_NAME_REM_NL_ON_WRITE))
+		return USBTMC_ATTRIB_REM_NL_ON_WRITE;
+	return -1;
+}
+
+// Print the value of an attribute read with USBTMC_IOCTL_GET_ATTRIBUTE
+void print_attribute(void)
+{
+	switch(attr.attribute) {
+		case USBTMC_ATTRIB_AUTO_ABORT_ON_ERROR:
+		case USBTMC_ATTRIB_DEBUG_MODE:
+		case USBTMC_ATTRIB_TERM_CHAR_ENABLED:
+		case USBTMC_ATTRIB_ADD_NL_ON_READ:
+		case USBTMC_ATTRIB_REM_NL_ON_WRITE:
+			if(attr.value==USBTMC_ATTRIB_VAL_OFF)
+				printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_OFF);
+			else
+				printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_ON);
+			break;
+		case USBTMC_ATTRIB_READ_MODE:
+			if(attr.value==USBTMC_ATTRIB_VAL_FREAD)
+				printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_FREAD);
+			else
+				printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_READ);
+			break;
+		default:
+			printf("Value: %d\n",attr.value);
+			break;
 	}
-	sprintf(devfile,"/dev/usbtmc%d",minor_number);
-	
-	// Convert parameter #2 (request name)
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_GET_CAPABILITIES))
-		request=USBTMC_IOCTL_GET_CAPABILITIES;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_INDICATOR_PULSE))
-		request=USBTMC_IOCTL_INDICATOR_PULSE;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_CLEAR))
-		request=USBTMC_IOCTL_CLEAR;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_ABORT_BULK_OUT))
-		request=USBTMC_IOCTL_ABORT_BULK_OUT;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_ABORT_BULK_IN))
-		request=USBTMC_IOCTL_ABORT_BULK_IN;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_SET_ATTRIBUTE))
-		request=USBTMC_IOCTL_SET_ATTRIBUTE;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_CLEAR_OUT_HALT))
-		request=USBTMC_IOCTL_CLEAR_OUT_HALT;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_CLEAR_IN_HALT))
-		request=USBTMC_IOCTL_CLEAR_IN_HALT;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_GET_ATTRIBUTE))
-		request=USBTMC_IOCTL_GET_ATTRIBUTE;
-	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_RESET_CONF))
-		request=USBTMC_IOCTL_RESET_CONF;
-	
-	// Open device file
-	myfile=open(devfile,O_RDWR);
-	if(myfile==-1) {
-		printf("Error: Can't open device file %s.\n",devfile);
-		exit(-1);
+}
+
+// Read one response into the response buffer. Returns its length or -1.
+// The driver returns the whole response with one short read. In fread
+// mode it then returns 0 once (end of file); this is consumed here so
+// that a following read request gets the next response.
+int read_response(void)
+{
+	int n;
+
+	n=read(myfile,response,MAX_RESPONSE);
+	if(n<0) {
+		printf("Error: read returned %d.\n",n);
+		return -1;
+	}
+	if(fread_mode&&n<MAX_RESPONSE) read(myfile,response+n,1);
+	return n;
+}
+
+// Send one message. The newline terminates the command for the instrument.
+int write_message(const char *text)
+{
+	char message[MAX_LINE+1];
+	int len;
+
+	len=snprintf(message,sizeof(message),"%s\n",text);
+	if(len>=(int)sizeof(message)) {
+		printf("Error: Message too long.\n");
+		return -1;
+	}
+	rv=write(myfile,message,len);
+	if(rv!=len) {
+		printf("Error: write returned %d.\n",rv);
+		return -1;
+	}
+	return 0;
+}
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int compare_double(const void *a,const void *b)
+{
+	double x=*(const double *)a;
+	double y=*(const double *)b;
+
+	return x<y?-1:x>y;
+}
+
+// Send a message count times and report latency and throughput. A query
+// (a message with a question mark) is timed until its response is read,
+// anything else until write returns.
+int bench(int count,const char *text)
+{
+	double *times;
+	double start;
+	double total;
+	double bytes=0;
+	int query=strchr(text,'?')!=NULL;
+	int n;
+	int i;
+
+	if(count<1) {
+		printf("Error: Bad count.\n");
+		return -1;
+	}
+	times=malloc(count*sizeof(double));
+	if(!times) {
+		printf("Error: Out of memory.\n");
+		return -1;
+	}
+
+	total=now();
+	for(i=0;i<count;i++) {
+		start=now();
+		if(write_message(text)) break;
+		bytes+=strlen(text)+1;
+		if(query) {
+			n=read_response();
+			if(n<0) break;
+			bytes+=n;
+		}
+		times[i]=now()-start;
+	}
+	total=now()-total;
+
+	if(i<count) {
+		printf("Error: Bench stopped after %d of %d messages.\n",i,count);
+		free(times);
+		return -1;
+	}
+
+	qsort(times,count,sizeof(double),compare_double);
+	printf("Messages: %d\n",count);
+	printf("Round trip (us): min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+		times[0]*1e6,times[count/2]*1e6,times[count*9/10]*1e6,
+		times[count*99/100]*1e6,times[count-1]*1e6);
+	printf("Throughput: %.1f messages/s, %.1f kB/s\n",count/total,
+		bytes/total/1000);
+	free(times);
+	return 0;
+}
+
+// Execute one request on the open device. words[0] is the request name,
+// followed by its parameters. text is the rest of the command line after
+// the request name (for write, query and bench). Returns 0 on success.
+int do_request(int nwords,char *words[],const char *text)
+{
+	int request;
+	int n;
+
+	if(!strcmp(words[0],USBTMC_IOCTL_NAME_WRITE)) {
+		return write_message(text);
+	}
+	if(!strcmp(words[0],USBTMC_IOCTL_NAME_READ)||
+		!strcmp(words[0],USBTMC_IOCTL_NAME_QUERY)) {
+		if(words[0][0]=='q'&&write_message(text)) return -1;
+		n=read_response();
+		if(n<0) return -1;
+		fwrite(response,1,n,stdout);
+		if(n&&response[n-1]!='\n') printf("\n");
+		return 0;
 	}
-	
+	if(!strcmp(words[0],USBTMC_IOCTL_NAME_BENCH)) {
+		if(nwords<3) {
+			printf("Error: bench needs a count and a message.\n");
+			return -1;
+		}
+		// The message follows the count
+		text+=strspn(text," \t");
+		text+=strcspn(text," \t");
+		text+=strspn(text," \t");
+		return bench(atoi(words[1]),text);
+	}
+
+	request=request_code(words[0]);
 	switch(request) {
 		case USBTMC_IOCTL_INDICATOR_PULSE:
 		case USBTMC_IOCTL_CLEAR:
@@ -80,13 +276,14 @@ int main(int argc,char *argv[])
 		case USBTMC_IOCTL_CLEAR_OUT_HALT:
 		case USBTMC_IOCTL_CLEAR_IN_HALT:
 		case USBTMC_IOCTL_RESET_CONF:
-			
+
 			rv=ioctl(myfile,request,0);
 			if(rv==-1) {
 				printf("Error: ioctl returned %d.\n",rv);
+				return -1;
 			}
-			break;
-			
+			return 0;
+
 		case USBTMC_IOCTL_GET_CAPABILITIES:
 			rv=ioctl(myfile,request,&devcaps);
 			printf("Interface capabilities: %u\n",
@@ -96,108 +293,175 @@ int main(int argc,char *argv[])
 			printf("USB488 interface capabilities: %u\n",
 				devcaps.usb488_interface_capabilities);
 			printf("USB488 device capabilities: %u\n",
-				devcaps.usb488_device_capabilities);	
-			break;
-		
+				devcaps.usb488_device_capabilities);
+			return 0;
+
 		case USBTMC_IOCTL_SET_ATTRIBUTE:
 		case USBTMC_IOCTL_GET_ATTRIBUTE:
-			// Convert parameter #3 (attribute name)
-			attr.attribute=-1;
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_AUTO_ABORT_ON_ERROR))
-				attr.attribute=USBTMC_ATTRIB_AUTO_ABORT_ON_ERROR;
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_READ_MODE))
-				attr.attribute=USBTMC_ATTRIB_READ_MODE;
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_TIMEOUT))
-				attr.attribute=USBTMC_ATTRIB_TIMEOUT;
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_NUM_INSTRUMENTS))
-				attr.attribute=USBTMC_ATTRIB_NUM_INSTRUMENTS;
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_MINOR_NUMBERS))
-				attr.attribute=USBTMC_ATTRIB_MINOR_NUMBERS;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_SIZE_IO_BUFFER))
-				attr.attribute=USBTMC_ATTRIB_SIZE_IO_BUFFER;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_DEFAULT_TIMEOUT))
-				attr.attribute=USBTMC_ATTRIB_DEFAULT_TIMEOUT;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_DEBUG_MODE))
-				attr.attribute=USBTMC_ATTRIB_DEBUG_MODE;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_VERSION))
-				attr.attribute=USBTMC_ATTRIB_VERSION;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_TERM_CHAR_ENABLED))
-				attr.attribute=USBTMC_ATTRIB_TERM_CHAR_ENABLED;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_TERM_CHAR))
-				attr.attribute=USBTMC_ATTRIB_TERM_CHAR;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_ADD_NL_ON_READ))
-				attr.attribute=USBTMC_ATTRIB_ADD_NL_ON_READ;			
-			if(!strcmp(argv[3],USBTMC_ATTRIB_NAME_REM_NL_ON_WRITE))
-				attr.attribute=USBTMC_ATTRIB_REM_NL_ON_WRITE;			
+			// Convert parameter #1 (attribute name)
+			attr.attribute=nwords>1?attribute_code(words[1]):-1;
 			if(attr.attribute==-1) {
 				printf("Error: Bad attribute name\n");
-				close(myfile);
-				goto print_usage;
+				return -1;
 			}
 			if(request==USBTMC_IOCTL_SET_ATTRIBUTE) {
+				if(nwords<3) {
+					printf("Error: Missing attribute value\n");
+					return -1;
+				}
 				attr.value=-1;
-				if(!strcmp(argv[4],USBTMC_ATTRIB_NAME_VAL_OFF))
+				if(!strcmp(words[2],USBTMC_ATTRIB_NAME_VAL_OFF))
 					attr.value=USBTMC_ATTRIB_VAL_OFF;
-				if(!strcmp(argv[4],USBTMC_ATTRIB_NAME_VAL_ON))
+				if(!strcmp(words[2],USBTMC_ATTRIB_NAME_VAL_ON))
 					attr.value=USBTMC_ATTRIB_VAL_ON;
-				if(!strcmp(argv[4],USBTMC_ATTRIB_NAME_VAL_FREAD))
+				if(!strcmp(words[2],USBTMC_ATTRIB_NAME_VAL_FREAD))
 					attr.value=USBTMC_ATTRIB_VAL_FREAD;
-				if(!strcmp(argv[4],USBTMC_ATTRIB_NAME_VAL_READ))
+				if(!strcmp(words[2],USBTMC_ATTRIB_NAME_VAL_READ))
 					attr.value=USBTMC_ATTRIB_VAL_READ;
-				if(attr.value==-1) sscanf(argv[4],"%d",&attr.value);
+				if(attr.value==-1) sscanf(words[2],"%d",&attr.value);
 			}
 			rv=ioctl(myfile,request,&attr);
-			if(request==USBTMC_IOCTL_GET_ATTRIBUTE) {
-				if((attr.attribute==USBTMC_ATTRIB_AUTO_ABORT_ON_ERROR)||
-					(attr.attribute==USBTMC_ATTRIB_DEBUG_MODE)||
-					(attr.attribute==USBTMC_ATTRIB_TERM_CHAR_ENABLED)||
-					(attr.attribute==USBTMC_ATTRIB_ADD_NL_ON_READ)||
-					(attr.attribute==USBTMC_ATTRIB_REM_NL_ON_WRITE))
-					if(attr.value==USBTMC_ATTRIB_VAL_OFF)
-						printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_OFF);
-					else
-						printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_ON);
-				if(attr.attribute==USBTMC_ATTRIB_READ_MODE)
-					if(attr.value==USBTMC_ATTRIB_VAL_FREAD)
-						printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_FREAD);
-					else
-						printf("Value: %s\n",USBTMC_ATTRIB_NAME_VAL_READ);
-				if(attr.attribute==USBTMC_ATTRIB_TIMEOUT)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_NUM_INSTRUMENTS)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_MINOR_NUMBERS)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_SIZE_IO_BUFFER)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_DEFAULT_TIMEOUT)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_VERSION)
-					printf("Value: %d\n",attr.value);
-				if(attr.attribute==USBTMC_ATTRIB_TERM_CHAR)
-					printf("Value: %d\n",attr.value);					
+			if(rv==-1) {
+				printf("Error: ioctl returned %d.\n",rv);
+				return -1;
 			}
-			break;
-			
-			default:
-				printf("Error: Bad request name.\n");
-				close(myfile);
-				goto print_usage;
-	}		
-		
+			if(attr.attribute==USBTMC_ATTRIB_READ_MODE)
+				fread_mode=attr.value==USBTMC_ATTRIB_VAL_FREAD;
+			if(request==USBTMC_IOCTL_GET_ATTRIBUTE) print_attribute();
+			return 0;
+
+		default:
+			printf("Error: Bad request name.\n");
+			return -1;
+	}
+}
+
+// Split a command line into words. Returns the number of words.
+int split_words(char *line,char *words[])
+{
+	int n=0;
+	char *p;
+
+	for(p=strtok(line," \t\r\n");p&&n<MAX_WORDS;p=strtok(NULL," \t\r\n"))
+		words[n++]=p;
+	return n;
+}
+
+// Shell mode: execute one request per line from stdin, with the device
+// file kept open. Empty lines and lines starting with # are ignored.
+// Returns the number of requests that failed.
+int shell(void)
+{
+	char line[MAX_LINE];
+	char copy[MAX_LINE];
+	char *words[MAX_WORDS];
+	char *text;
+	int interactive=isatty(0);
+	int errors=0;
+	int nwords;
+
+	for(;;) {
+		if(interactive) {
+			printf("usbtmc%d> ",minor_number);
+			fflush(stdout);
+		}
+		if(!fgets(line,sizeof(line),stdin)) break;
+		line[strcspn(line,"\r\n")]=0;
+		strcpy(copy,line);
+		nwords=split_words(copy,words);
+		if(!nwords||words[0][0]=='#') continue;
+		if(!strcmp(words[0],"quit")||!strcmp(words[0],"exit")) break;
+
+		// Message text: the rest of the line after the request name
+		text=line+strspn(line," \t");
+		text+=strcspn(text," \t");
+		text+=strspn(text," \t");
+
+		if(do_request(nwords,words,text)) errors++;
+		fflush(stdout);
+	}
+	return errors;
+}
+
+int main(int argc,char *argv[])
+{
+	char text[MAX_LINE];
+	int i;
+
+	if(argc<3) goto print_usage;
+
+	// Convert parameter #1 (minor number)
+	sscanf(argv[1],"%d",&minor_number);
+	if((minor_number<1)||(minor_number>USBTMC_MINOR_NUMBERS)) {
+		printf("Error: Bad minor number.\n");
+		goto print_usage;
+	}
+	sprintf(devfile,"/dev/usbtmc%d",minor_number);
+
+	// Check parameter #2 (request name) before opening the device
+	if(request_code(argv[2])==-1&&
+		strcmp(argv[2],USBTMC_IOCTL_NAME_SHELL)&&
+		strcmp(argv[2],USBTMC_IOCTL_NAME_WRITE)&&
+		strcmp(argv[2],USBTMC_IOCTL_NAME_READ)&&
+		strcmp(argv[2],USBTMC_IOCTL_NAME_QUERY)&&
+		strcmp(argv[2],USBTMC_IOCTL_NAME_BENCH)) {
+		printf("Error: Bad request name.\n");
+		goto print_usage;
+	}
+
+	// Open device file
+	myfile=open(devfile,O_RDWR);
+	if(myfile==-1) {
+		printf("Error: Can't open device file %s.\n",devfile);
+		exit(-1);
+	}
+
+	// The driver's read mode decides how responses end, it may have
+	// been changed by an earlier setattr
+	attr.attribute=USBTMC_ATTRIB_READ_MODE;
+	if(ioctl(myfile,USBTMC_IOCTL_GET_ATTRIBUTE,&attr)!=-1)
+		fread_mode=attr.value==USBTMC_ATTRIB_VAL_FREAD;
+
+	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_SHELL)) {
+		rv=shell();
+		close(myfile);
+		exit(rv?-1:0);
+	}
+
+	// Message text for write, query and bench: the remaining parameters
+	text[0]=0;
+	for(i=3;i<argc;i++) {
+		if(i>3) strncat(text," ",sizeof(text)-strlen(text)-1);
+		strncat(text,argv[i],sizeof(text)-strlen(text)-1);
+	}
+	if(!strcmp(argv[2],USBTMC_IOCTL_NAME_BENCH)&&argc>3) {
+		// bench takes the count as its first parameter
+		rv=argc>4?bench(atoi(argv[3]),text+strlen(argv[3])+1):-1;
+		if(argc<=4) printf("Error: bench needs a count and a message.\n");
+	}
+	else rv=do_request(argc-2,argv+2,text);
+
 	// Close device file
 	close(myfile);
-	
-	exit(0);
-	
+
+	exit(rv?-1:0);
+
 print_usage:
-	
+
 	printf("Usage:\n");
 	printf("usbtmc_ioctl n request [ attribute [ value ] ]\n");
+	printf("usbtmc_ioctl n { write | query } message\n");
+	printf("usbtmc_ioctl n read\n");
+	printf("usbtmc_ioctl n bench count message\n");
+	printf("usbtmc_ioctl n shell\n");
 	printf("where\n");
 	printf("m = minor number, e. g. 1 for /dev/usbtmc1\n");
 	printf("request = { clear , setattr , getattr , reset etc}\n");
 	printf("attribute = { autoabort , readmode , timeout etc }\n");
+	printf("shell reads one request per line from stdin, keeping the\n");
+	printf("device file open, e. g. \"setattr readmode read\" or\n");
+	printf("\"query *IDN?\". bench times count messages, queries until\n");
+	printf("their response is read.\n");
 	printf("See html documentation for details!\n");
 	printf("Example:\n");
 	printf("usbtmc_ioctl 1 clear\n");
@@ -214,3 +478,4 @@ print_usage:
 // 1.0.3	13.11.2007	Automatic ABORT on error in FREAD (shell) mode.
 // 1.0.4	02.12.2007	Added a whole bunch of attributes.
 // 1.1		08.12.2007	Clean-up.
+// 1.2		17.10.2026	Shell mode, write/read/query and bench requests.
@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# Run the same workloads against the kernel driver and the agilent driver.
+#
+#   compare.sh [output directory]
+#
+# Each driver is loaded in turn and bound to the same emulated instruments
+# (../emulator, two of them on dummy_hcd). The workloads are:
+#
+#	query	round trip latency of *IDN?
+#	block	10 MB block reads (DATA?) with several read() sizes
+#	upload	10 MB of AWG style block uploads (DATA) per write() size
+#	mixed	queries on one instrument while the other one streams blocks
+#
+# The JSON of every run is kept in the output directory (default
+# ./compare-<date>), a table of throughput, latency and CPU cost is printed
+# at the end. Both modules have to be built beforehand and no other usbtmc
+# module may be in use.
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+TOP=$(dirname "$DIR")
+OUT=${1:-compare-$(date +%Y%m%d-%H%M%S)}
+BENCH=$DIR/usbtmc_bench
+GADGET=$TOP/emulator/usbtmc_gadget.sh
+
+QUERIES=${QUERIES:-2000}
+TOTAL=${TOTAL:-10M}
+
+export USBTMC_EMU_COUNT=2
+
+mkdir -p "$OUT" || exit 1
+
+load() {
+	sudo rmmod usbtmc 2> /dev/null
+	case $1 in
+	kernel)
+		sudo insmod "$TOP"/kernel/usbtmc.ko || exit 1
+		;;
+	agilent)
+		(cd "$TOP"/agilent && sudo ./usbtmc_load) > /dev/null || exit 1
+		;;
+	esac
+	"$GADGET" start
+}
+
+unload() {
+	"$GADGET" stop
+	sudo rmmod usbtmc
+}
+
+# The kernel driver numbers its devices from 0, the agilent driver keeps
+# minor 0 for itself and starts at 1.
+devices() {
+	case $1 in
+	kernel)
+		DEV0=/dev/usbtmc0
+		DEV1=/dev/usbtmc1
+		;;
+	agilent)
+		DEV0=/dev/usbtmc1
+		DEV1=/dev/usbtmc2
+		# fread mode ends every message with an extra read() returning
+		# 0, which plain read() users do not expect
+		"$TOP"/agilent/usbtmc_ioctl 1 setattr readmode read > /dev/null
+		"$TOP"/agilent/usbtmc_ioctl 2 setattr readmode read > /dev/null
+		;;
+	esac
+}
+
+run() {
+	local driver=$1
+
+	load $driver
+	devices $driver
+
+	"$BENCH" -t latency -i $QUERIES $DEV0 > "$OUT"/$driver-query.json
+	"$BENCH" -t read -n $TOTAL -s 4k,64k,1M $DEV0 > "$OUT"/$driver-block.json
+	"$BENCH" -t write -n $TOTAL -s 4k,64k,1M $DEV0 > "$OUT"/$driver-upload.json
+
+	"$BENCH" -t read -n $TOTAL -s 64k $DEV1 > "$OUT"/$driver-mixed-block.json &
+	"$BENCH" -t latency -i $QUERIES $DEV0 > "$OUT"/$driver-mixed-query.json
+	wait
+
+	unload
+}
+
+# One line per result: driver, workload, test, size, and either MB/s and
+# ns of CPU per byte or p50/p99 in us and us of CPU per query
+summary() {
+	local f driver workload
+
+	printf "%-8s %-12s %-8s %8s %10s %10s %10s\n" driver workload test \
+		size "MB/s|p50" "-|p99" "cpu"
+	for f in "$OUT"/*.json; do
+		driver=$(basename "$f" .json)
+		workload=${driver#*-}
+		driver=${driver%%-*}
+		awk -v driver=$driver -v workload=$workload '
+		function field(name,    value) {
+			if (!match($0, "\"" name "\": \"?[^,\"}]*"))
+				return "-"
+			value = substr($0, RSTART, RLENGTH)
+			sub(/^[^:]*: "?/, "", value)
+			return value
+		}
+		/"test"/ {
+			size = field("read_size")
+			if (size == "-")
+				size = field("write_size")
+			if (field("test") == "latency")
+				printf "%-8s %-12s %-8s %8s %10s %10s %10s\n",
+				       driver, workload, "latency", "-",
+				       field("p50_us"), field("p99_us"),
+				       field("cpu_us_per_query")
+			else
+				printf "%-8s %-12s %-8s %8s %10s %10s %10s\n",
+				       driver, workload, field("test"), size,
+				       field("mb_per_s"), "-",
+				       field("cpu_ns_per_byte")
+		}' "$f"
+	done
+}
+
+if [ ! -x "$BENCH" ] || [ ! -x "$TOP"/emulator/usbtmc_emu ] ||
+   [ ! -x "$TOP"/agilent/usbtmc_ioctl ]; then
+	echo "Build bench/usbtmc_bench, emulator/usbtmc_emu and" \
+	     "agilent/usbtmc_ioctl first"
+	exit 1
+fi
+
+run kernel
+run agilent
+summary | tee "$OUT"/summary.txt
@@ -0,0 +1,398 @@
+/**
+ * usbtmc_bench.c - Throughput and latency benchmark for usbtmc devices
+ *
+ * Measures, against a /dev/usbtmcN character device:
+ *
+ *	read	sustained read throughput for a range of read() sizes
+ *	write	sustained write throughput for a range of write() sizes
+ *	latency	round trip time of a small query, as percentiles
+ *	sweep	read throughput for a range of bulk in transfer sizes
+ *
+ * The read and write tests use the DATA? and DATA commands of the
+ * emulator in ../emulator, the sweep sets its EMU:MAXTRANSFER. Any
+ * instrument that answers the latency query (*IDN? by default) can be
+ * used for the latency test. Results are written to stdout as JSON.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_SIZES	32
+
+struct bench {
+	const char *device;
+	int fd;
+	size_t total;			/* bytes per throughput measurement */
+	unsigned int iterations;	/* queries for the latency test */
+	const char *query;
+	size_t sizes[BENCH_MAX_SIZES];
+	unsigned int n_sizes;
+	size_t transfers[BENCH_MAX_SIZES];
+	unsigned int n_transfers;
+	unsigned int results;		/* JSON objects written so far */
+};
+
+/* Wall clock and CPU time of the process */
+struct bench_time {
+	double wall;
+	double cpu;
+};
+
+static void bench_now(struct bench_time *t)
+{
+	struct timespec ts;
+	struct rusage ru;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	getrusage(RUSAGE_SELF, &ru);
+	t->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		 ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void bench_write(struct bench *b, const void *buf, size_t len)
+{
+	ssize_t n = write(b->fd, buf, len);
+
+	if (n < 0)
+		die("write");
+	if ((size_t)n != len) {
+		fprintf(stderr, "short write: %zd of %zu\n", n, len);
+		exit(1);
+	}
+}
+
+static void bench_command(struct bench *b, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void bench_command(struct bench *b, const char *fmt, ...)
+{
+	char cmd[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(cmd, sizeof(cmd), fmt, ap);
+	va_end(ap);
+	bench_write(b, cmd, n);
+}
+
+/* Read exactly len bytes with read() calls of at most size bytes */
+static void bench_read_all(struct bench *b, char *buf, size_t len,
+			   size_t size)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(b->fd, buf, len - done < size ? len - done : size);
+		if (n < 0)
+			die("read");
+		if (n == 0) {
+			fprintf(stderr, "unexpected end of message\n");
+			exit(1);
+		}
+		done += n;
+	}
+}
+
+static void bench_result(struct bench *b, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void bench_result(struct bench *b, const char *fmt, ...)
+{
+	va_list ap;
+
+	printf("%s\n    {", b->results++ ? "," : "");
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("}");
+	fflush(stdout);
+}
+
+/* Length of the answer to DATA? n: #<digits><n><data>\n */
+static size_t bench_block_len(size_t n)
+{
+	char size[32];
+
+	return 2 + snprintf(size, sizeof(size), "%zu", n) + n + 1;
+}
+
+static void bench_read_throughput(struct bench *b, const char *test,
+				  size_t size, size_t max_transfer)
+{
+	struct bench_time start;
+	struct bench_time end;
+	size_t len = bench_block_len(b->total);
+	char *buf;
+
+	buf = malloc(size);
+	if (!buf)
+		die("malloc");
+
+	bench_now(&start);
+	bench_command(b, "DATA? %zu\n", b->total);
+	bench_read_all(b, buf, len, size);
+	bench_now(&end);
+
+	bench_result(b, "\"test\": \"%s\", \"read_size\": %zu, "
+		     "\"max_transfer\": %zu, \"bytes\": %zu, "
+		     "\"seconds\": %.6f, \"mb_per_s\": %.3f, "
+		     "\"cpu_ns_per_byte\": %.3f",
+		     test, size, max_transfer, len, end.wall - start.wall,
+		     len / (end.wall - start.wall) / 1e6,
+		     (end.cpu - start.cpu) * 1e9 / len);
+	free(buf);
+}
+
+/* DATA #<digits><n><data>, each write() one message of size bytes */
+static void bench_write_throughput(struct bench *b, size_t size)
+{
+	struct bench_time start;
+	struct bench_time end;
+	char header[32];
+	size_t payload;
+	size_t done = 0;
+	size_t hdr;
+	char *buf;
+	int digits;
+
+	buf = malloc(size + sizeof(header));
+	if (!buf)
+		die("malloc");
+
+	/* The header length depends on the payload length */
+	payload = size;
+	do {
+		payload--;
+		digits = snprintf(header, sizeof(header), "%zu", payload);
+		hdr = snprintf(header, sizeof(header), "DATA #%d%zu",
+			       digits, payload);
+	} while (hdr + payload > size && payload);
+
+	memcpy(buf, header, hdr);
+	memset(buf + hdr, 0x55, payload);
+
+	bench_now(&start);
+	while (done < b->total) {
+		bench_write(b, buf, hdr + payload);
+		done += hdr + payload;
+	}
+	/* The last message has reached the device once this is answered */
+	bench_command(b, "*OPC?\n");
+	bench_read_all(b, header, 2, sizeof(header));
+	bench_now(&end);
+
+	bench_result(b, "\"test\": \"write\", \"write_size\": %zu, "
+		     "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+		     "\"cpu_ns_per_byte\": %.3f",
+		     hdr + payload, done, end.wall - start.wall,
+		     done / (end.wall - start.wall) / 1e6,
+		     (end.cpu - start.cpu) * 1e9 / done);
+	free(buf);
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const double *sorted, unsigned int n,
+			       double p)
+{
+	unsigned int i = p * n;
+
+	return sorted[i < n ? i : n - 1];
+}
+
+static void bench_latency(struct bench *b)
+{
+	struct bench_time start;
+	struct bench_time end;
+	struct bench_time t0;
+	struct bench_time t1;
+	double *samples;
+	char answer[4096];
+	unsigned int i;
+	ssize_t n;
+
+	samples = malloc(b->iterations * sizeof(*samples));
+	if (!samples)
+		die("malloc");
+
+	bench_now(&start);
+	for (i = 0; i < b->iterations; i++) {
+		bench_now(&t0);
+		bench_command(b, "%s\n", b->query);
+		n = read(b->fd, answer, sizeof(answer));
+		if (n < 0)
+			die("read");
+		bench_now(&t1);
+		samples[i] = (t1.wall - t0.wall) * 1e6;
+	}
+	bench_now(&end);
+
+	qsort(samples, b->iterations, sizeof(*samples), bench_cmp_double);
+
+	bench_result(b, "\"test\": \"latency\", \"query\": \"%s\", "
+		     "\"count\": %u, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+		     "\"p999_us\": %.1f, \"max_us\": %.1f, "
+		     "\"cpu_us_per_query\": %.2f",
+		     b->query, b->iterations,
+		     bench_percentile(samples, b->iterations, 0.5),
+		     bench_percentile(samples, b->iterations, 0.99),
+		     bench_percentile(samples, b->iterations, 0.999),
+		     samples[b->iterations - 1],
+		     (end.cpu - start.cpu) * 1e6 / b->iterations);
+	free(samples);
+}
+
+static unsigned int bench_parse_sizes(const char *list, size_t *sizes)
+{
+	char *copy = strdup(list);
+	char *tok;
+	char *save;
+	char *end;
+	unsigned int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < BENCH_MAX_SIZES;
+	     tok = strtok_r(NULL, ",", &save)) {
+		sizes[n] = strtoull(tok, &end, 0);
+		if (*end == 'k' || *end == 'K')
+			sizes[n] <<= 10;
+		else if (*end == 'M')
+			sizes[n] <<= 20;
+		if (sizes[n])
+			n++;
+	}
+
+	free(copy);
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <device>\n"
+		"  -t <tests>   comma separated: read,write,latency,sweep "
+		"(all)\n"
+		"  -n <bytes>   bytes per throughput measurement (10M)\n"
+		"  -s <sizes>   read()/write() sizes (64,1k,4k,16k,64k,1M)\n"
+		"  -m <sizes>   bulk in transfer sizes for the sweep "
+		"(64,512,2k,8k,64k)\n"
+		"  -i <count>   queries for the latency test (1000)\n"
+		"  -q <query>   latency query (*IDN?)\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench bench = {
+		.total = 10 << 20,
+		.iterations = 1000,
+		.query = "*IDN?",
+	};
+	struct bench *b = &bench;
+	const char *tests = "read,write,latency,sweep";
+	size_t sizes[BENCH_MAX_SIZES];
+	unsigned int i;
+	int opt;
+
+	b->n_sizes = bench_parse_sizes("64,1k,4k,16k,64k,1M", b->sizes);
+	b->n_transfers = bench_parse_sizes("64,512,2k,8k,64k", b->transfers);
+
+	while ((opt = getopt(argc, argv, "t:n:s:m:i:q:")) != -1) {
+		switch (opt) {
+		case 't':
+			tests = optarg;
+			break;
+		case 'n':
+			if (bench_parse_sizes(optarg, sizes) != 1)
+				usage(argv[0]);
+			b->total = sizes[0];
+			break;
+		case 's':
+			b->n_sizes = bench_parse_sizes(optarg, b->sizes);
+			break;
+		case 'm':
+			b->n_transfers = bench_parse_sizes(optarg,
+							   b->transfers);
+			break;
+		case 'i':
+			b->iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			b->query = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || !b->iterations || !b->n_sizes)
+		usage(argv[0]);
+
+	b->device = argv[optind];
+	b->fd = open(b->device, O_RDWR);
+	if (b->fd < 0)
+		die(b->device);
+
+	printf("{\n  \"device\": \"%s\",\n  \"results\": [", b->device);
+
+	if (strstr(tests, "read"))
+		for (i = 0; i < b->n_sizes; i++)
+			bench_read_throughput(b, "read", b->sizes[i], 0);
+
+	if (strstr(tests, "write"))
+		for (i = 0; i < b->n_sizes; i++)
+			bench_write_throughput(b, b->sizes[i]);
+
+	if (strstr(tests, "latency"))
+		bench_latency(b);
+
+	if (strstr(tests, "sweep")) {
+		for (i = 0; i < b->n_transfers; i++) {
+			bench_command(b, "EMU:MAXTRANSFER %zu\n",
+				      b->transfers[i]);
+			bench_read_throughput(b, "sweep",
+					      b->sizes[b->n_sizes - 1],
+					      b->transfers[i]);
+		}
+		bench_command(b, "EMU:MAXTRANSFER 65536\n");
+	}
+
+	printf("\n  ]\n}\n");
+	close(b->fd);
+	return 0;
+}
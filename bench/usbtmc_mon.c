@@ -0,0 +1,682 @@
+/**
+ * usbtmc_mon.c - USBTMC protocol analyzer on top of usbmon
+ *
+ * Reads URB events from the binary usbmon interface (/dev/usbmonN) or from
+ * a pcap file saved from it (tcpdump -i usbmonN -w file, or Wireshark),
+ * decodes the USBTMC bulk headers and class control requests, and splits
+ * the time of every message into:
+ *
+ *	host	no bulk transfer in flight: the application or the driver
+ *	bus	a bulk out transfer, or a bulk in transfer after response
+ *		data has started to arrive
+ *	device	a bulk in transfer waiting for the first response data
+ *	gap	between the end of a message and the start of the next one
+ *
+ * A message starts with the first DEV_DEP_MSG_OUT transfer of a command
+ * and ends with the DEV_DEP_MSG_IN transfer carrying EOM, or, for a command
+ * without a response, with its last bulk out transfer. The device time
+ * includes the transfer of the first response packet, which usbmon can
+ * not separate from the wait. One line per message is printed, with the
+ * TermChar its response was requested with (- if TermCharEnabled was not
+ * set), then a summary per command; with -F the summary is written as folded stacks
+ * for flamegraph.pl instead, weighted in microseconds.
+ *
+ * The pcap file must have been written on a host of the same byte order.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+/* struct usbmon_packet of Documentation/usb/usbmon.txt */
+struct mon_packet {
+	uint64_t id;
+	uint8_t type;			/* 'S'ubmit, 'C'omplete, 'E'rror */
+	uint8_t xfer_type;		/* MON_ISO .. MON_BULK */
+	uint8_t epnum;			/* with USB_DIR_IN */
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;		/* 0 if setup is valid */
+	char flag_data;			/* 0 if data follows */
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	union {
+		uint8_t setup[8];
+		struct {
+			int32_t error_count;
+			int32_t numdesc;
+		} iso;
+	} s;
+	/* Only in the 64 byte header of the mmap API */
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+struct mon_get_arg {
+	struct mon_packet *hdr;
+	void *data;
+	size_t alloc;
+};
+
+#define MON_IOCX_GETX		_IOW(0x92, 10, struct mon_get_arg)
+
+#define MON_INT			1
+#define MON_CTRL		2
+#define MON_BULK		3
+
+/* pcap link types of usbmon captures, with their header sizes */
+#define LINKTYPE_USB_LINUX		189	/* 48 bytes */
+#define LINKTYPE_USB_LINUX_MMAPPED	220	/* 64 bytes */
+
+#define MON_MAX_DATA		65536
+#define MON_MAX_URBS		1024	/* in flight, power of 2 */
+#define MON_MAX_DEVS		16
+#define MON_MAX_STATS		256
+#define MON_CMD_LEN		24
+
+/* USBTMC bulk header */
+#define USBTMC_HEADER_SIZE	12
+#define MSGID_DEV_DEP_MSG_OUT	1
+#define MSGID_REQUEST_IN	2
+#define ATTR_EOM		0x01
+#define ATTR_TERM_CHAR		0x02	/* of REQUEST_DEV_DEP_MSG_IN */
+
+/* A URB between its submission and completion */
+struct mon_urb {
+	uint64_t id;			/* 0 if the slot is free */
+	double t;
+	uint8_t setup[8];
+	uint8_t MsgID;			/* of a bulk out transfer */
+	uint8_t attributes;
+	uint32_t size;			/* TransferSize */
+};
+
+struct mon_msg {
+	double start;
+	double host;
+	double bus;
+	double device;
+	double gap;
+	uint8_t bTag;
+	int term_char;			/* requested TermChar, -1 if none */
+	char cmd[MON_CMD_LEN + 1];
+	uint32_t out_bytes;
+	uint32_t in_bytes;
+	bool cmd_done;			/* the command was sent with EOM */
+};
+
+struct mon_dev {
+	uint16_t bus;
+	uint8_t dev;
+	int out_busy;			/* bulk transfers in flight */
+	int in_busy;
+	bool in_data;			/* response data has arrived */
+	bool active;			/* msg is open */
+	double last;			/* time accounted up to */
+	double end;			/* of the last message */
+	struct mon_msg msg;
+};
+
+/* Totals per device and command, or control request */
+struct mon_stat {
+	uint16_t bus;
+	uint8_t dev;
+	char cmd[MON_CMD_LEN + 1];
+	bool control;
+	unsigned long count;
+	double total;
+	double host;
+	double bus_time;
+	double device;
+	double gap;
+};
+
+static struct mon_urb urbs[MON_MAX_URBS];
+static struct mon_dev devs[MON_MAX_DEVS];
+static unsigned int n_devs;
+static struct mon_stat stats[MON_MAX_STATS];
+static unsigned int n_stats;
+
+static int filter_bus = -1;
+static int filter_dev = -1;
+static bool quiet;
+static bool folded;
+static volatile sig_atomic_t stop;
+
+static const char *const class_requests[256] = {
+	[1] = "INITIATE_ABORT_BULK_OUT",
+	[2] = "CHECK_ABORT_BULK_OUT_STATUS",
+	[3] = "INITIATE_ABORT_BULK_IN",
+	[4] = "CHECK_ABORT_BULK_IN_STATUS",
+	[5] = "INITIATE_CLEAR",
+	[6] = "CHECK_CLEAR_STATUS",
+	[7] = "GET_CAPABILITIES",
+	[64] = "INDICATOR_PULSE",
+	[128] = "READ_STATUS_BYTE",
+	[160] = "REN_CONTROL",
+	[161] = "GO_TO_LOCAL",
+	[162] = "LOCAL_LOCKOUT",
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static struct mon_urb *urb_slot(uint64_t id, bool create)
+{
+	unsigned int i = (id >> 4) & (MON_MAX_URBS - 1);
+	unsigned int n;
+
+	for (n = 0; n < MON_MAX_URBS; n++, i = (i + 1) & (MON_MAX_URBS - 1)) {
+		if (urbs[i].id == id)
+			return &urbs[i];
+		if (!urbs[i].id)
+			break;
+	}
+	if (!create || n == MON_MAX_URBS)
+		return NULL;
+	memset(&urbs[i], 0, sizeof(urbs[i]));
+	urbs[i].id = id;
+	return &urbs[i];
+}
+
+/* Removal from the open addressed table: reinsert the rest of the run */
+static void urb_free(struct mon_urb *urb)
+{
+	unsigned int i = urb - urbs;
+	struct mon_urb moved;
+
+	urb->id = 0;
+	for (i = (i + 1) & (MON_MAX_URBS - 1); urbs[i].id;
+	     i = (i + 1) & (MON_MAX_URBS - 1)) {
+		moved = urbs[i];
+		urbs[i].id = 0;
+		*urb_slot(moved.id, true) = moved;
+	}
+}
+
+static struct mon_dev *dev_get(uint16_t bus, uint8_t dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_devs; i++)
+		if (devs[i].bus == bus && devs[i].dev == dev)
+			return &devs[i];
+	if (n_devs == MON_MAX_DEVS)
+		return NULL;
+	devs[n_devs].bus = bus;
+	devs[n_devs].dev = dev;
+	return &devs[n_devs++];
+}
+
+static struct mon_stat *stat_get(uint16_t bus, uint8_t dev, const char *cmd,
+				 bool control)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_stats; i++)
+		if (stats[i].bus == bus && stats[i].dev == dev &&
+		    stats[i].control == control && !strcmp(stats[i].cmd, cmd))
+			return &stats[i];
+	if (n_stats == MON_MAX_STATS)
+		return NULL;
+	stats[n_stats].bus = bus;
+	stats[n_stats].dev = dev;
+	stats[n_stats].control = control;
+	strcpy(stats[n_stats].cmd, cmd);
+	return &stats[n_stats++];
+}
+
+/* Command label: the first word of the command, '?' included */
+static void msg_label(char *cmd, const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	for (n = 0; n < len && n < MON_CMD_LEN; n++) {
+		if (isspace(data[n]) || data[n] == ';')
+			break;
+		cmd[n] = isprint(data[n]) ? data[n] : '.';
+	}
+	cmd[n] = 0;
+	if (!n)
+		strcpy(cmd, "(empty)");
+}
+
+/* Charge the time since the last event to what was going on */
+static void dev_account(struct mon_dev *d, double t)
+{
+	double dt = t - d->last;
+
+	d->last = t;
+	if (!d->active)
+		return;
+	if (d->out_busy)
+		d->msg.bus += dt;
+	else if (d->in_busy && d->in_data)
+		d->msg.bus += dt;
+	else if (d->in_busy)
+		d->msg.device += dt;
+	else
+		d->msg.host += dt;
+}
+
+static void msg_start(struct mon_dev *d, double t)
+{
+	memset(&d->msg, 0, sizeof(d->msg));
+	d->msg.term_char = -1;
+	d->msg.start = t;
+	d->msg.gap = d->end ? t - d->end : 0;
+	d->active = true;
+	d->in_data = false;
+	d->last = t;
+}
+
+static void msg_finish(struct mon_dev *d, double t)
+{
+	struct mon_msg *m = &d->msg;
+	struct mon_stat *s;
+	char term[12] = "-";
+
+	d->active = false;
+	d->end = t;
+
+	if (m->term_char >= 0)
+		snprintf(term, sizeof(term), "0x%02x", m->term_char);
+	if (!quiet && !folded)
+		printf("%14.6f %3u.%-3u %3u %4s %-*s %8u %8u %9.1f %9.1f "
+		       "%9.1f %9.1f %9.1f\n", m->start / 1e6, d->bus, d->dev,
+		       m->bTag, term, MON_CMD_LEN, m->cmd, m->out_bytes,
+		       m->in_bytes, t - m->start, m->host, m->bus, m->device,
+		       m->gap);
+
+	s = stat_get(d->bus, d->dev, m->cmd, false);
+	if (!s)
+		return;
+	s->count++;
+	s->total += t - m->start;
+	s->host += m->host;
+	s->bus_time += m->bus;
+	s->device += m->device;
+	s->gap += m->gap;
+}
+
+static void on_bulk_out_submit(struct mon_dev *d, struct mon_urb *urb,
+			       double t, const uint8_t *data, size_t len)
+{
+	if (len < USBTMC_HEADER_SIZE)
+		return;
+	urb->MsgID = data[0];
+	urb->attributes = data[8];
+	urb->size = get_le32(data + 4);
+
+	if (urb->MsgID == MSGID_DEV_DEP_MSG_OUT) {
+		/* A new command after one that got no response */
+		if (d->active && d->msg.cmd_done) {
+			if (d->out_busy || d->in_busy)
+				dev_account(d, t);
+			msg_finish(d, d->last);
+		}
+		if (!d->active) {
+			msg_start(d, t);
+			d->msg.bTag = data[1];
+			msg_label(d->msg.cmd, data + USBTMC_HEADER_SIZE,
+				  len - USBTMC_HEADER_SIZE < urb->size ?
+				  len - USBTMC_HEADER_SIZE : urb->size);
+		}
+	} else if (urb->MsgID == MSGID_REQUEST_IN && !d->active) {
+		/* Reading the rest of an earlier response */
+		msg_start(d, t);
+		d->msg.bTag = data[1];
+		d->msg.cmd_done = true;
+		strcpy(d->msg.cmd, "(read)");
+	}
+
+	/* TermChar is data[9], only used with TermCharEnabled */
+	if (urb->MsgID == MSGID_REQUEST_IN && d->active)
+		d->msg.term_char = urb->attributes & ATTR_TERM_CHAR ?
+				   data[9] : -1;
+
+	dev_account(d, t);
+	d->out_busy++;
+}
+
+static void on_bulk_out_complete(struct mon_dev *d, struct mon_urb *urb,
+				 double t, int status)
+{
+	dev_account(d, t);
+	if (d->out_busy)
+		d->out_busy--;
+	if (!d->active || status || urb->MsgID != MSGID_DEV_DEP_MSG_OUT)
+		return;
+	d->msg.out_bytes += urb->size;
+	if (urb->attributes & ATTR_EOM)
+		d->msg.cmd_done = true;
+}
+
+static void on_bulk_in_complete(struct mon_dev *d, double t, int status,
+				const uint8_t *data, size_t len)
+{
+	dev_account(d, t);
+	if (d->in_busy)
+		d->in_busy--;
+	if (!d->active || status || len < USBTMC_HEADER_SIZE ||
+	    data[0] != MSGID_REQUEST_IN)
+		return;
+	d->in_data = true;
+	d->msg.in_bytes += get_le32(data + 4);
+	if (data[8] & ATTR_EOM)
+		msg_finish(d, t);
+}
+
+static void on_control(const struct mon_packet *p, struct mon_urb *urb,
+		       double t, const uint8_t *data, size_t len)
+{
+	const uint8_t *setup = urb->setup;
+	const char *name = NULL;
+	char label[MON_CMD_LEN + 1];
+	struct mon_stat *s;
+	int status = -1;
+
+	if ((setup[0] & 0x60) == 0x20)
+		name = class_requests[setup[1]];
+	else if (setup[0] == 0x02 && setup[1] == 1 && !setup[2] && !setup[3])
+		name = "CLEAR_HALT";
+	if (!name)
+		return;
+
+	/* USBTMC_status is the first byte of every class response */
+	if ((setup[0] & 0x80) && len)
+		status = data[0];
+
+	if (!quiet && !folded)
+		printf("%14.6f %3u.%-3u          %-*s wValue 0x%04x "
+		       "wIndex 0x%04x status %d result %d %9.1f\n", urb->t / 1e6, p->busnum,
+		       p->devnum, MON_CMD_LEN, name,
+		       setup[2] | setup[3] << 8, setup[4] | setup[5] << 8,
+		       status, p->status, t - urb->t);
+
+	snprintf(label, sizeof(label), "%s", name);
+	s = stat_get(p->busnum, p->devnum, label, true);
+	if (!s)
+		return;
+	s->count++;
+	s->total += t - urb->t;
+}
+
+static void on_event(const struct mon_packet *p, const uint8_t *data)
+{
+	double t = p->ts_sec * 1e6 + p->ts_usec;
+	size_t len = p->flag_data ? 0 : p->len_cap;
+	struct mon_urb *urb;
+	struct mon_dev *d;
+	bool in = p->epnum & 0x80;
+
+	if ((filter_bus >= 0 && p->busnum != filter_bus) ||
+	    (filter_dev >= 0 && p->devnum != filter_dev))
+		return;
+	if (p->xfer_type != MON_BULK && p->xfer_type != MON_CTRL &&
+	    p->xfer_type != MON_INT)
+		return;
+
+	if (p->type == 'S') {
+		urb = urb_slot(p->id, true);
+		if (!urb)
+			return;
+		urb->t = t;
+		if (p->xfer_type == MON_CTRL && !p->flag_setup)
+			memcpy(urb->setup, p->s.setup, 8);
+		if (p->xfer_type != MON_BULK)
+			return;
+		d = dev_get(p->busnum, p->devnum);
+		if (!d)
+			return;
+		if (in) {
+			dev_account(d, t);
+			d->in_busy++;
+		} else {
+			on_bulk_out_submit(d, urb, t, data, len);
+		}
+		return;
+	}
+
+	/* 'C'omplete, or 'E'rror of a submission */
+	urb = urb_slot(p->id, false);
+	if (!urb)
+		return;
+
+	if (p->xfer_type == MON_CTRL) {
+		on_control(p, urb, t, data, len);
+	} else if (p->xfer_type == MON_INT) {
+		/* USB488 SRQ notification */
+		if (in && !p->status && len >= 2 && data[0] == 0x81 &&
+		    !quiet && !folded)
+			printf("%14.6f %3u.%-3u          SRQ status byte 0x%02x\n",
+			       t / 1e6, p->busnum, p->devnum, data[1]);
+	} else {
+		d = dev_get(p->busnum, p->devnum);
+		if (d && in)
+			on_bulk_in_complete(d, t, p->status, data, len);
+		else if (d)
+			on_bulk_out_complete(d, urb, t, p->status);
+	}
+	urb_free(urb);
+}
+
+static void read_usbmon(int fd)
+{
+	static uint8_t data[MON_MAX_DATA];
+	struct mon_packet p;
+	struct mon_get_arg arg = {
+		.hdr = &p,
+		.data = data,
+		.alloc = sizeof(data),
+	};
+
+	while (!stop) {
+		if (ioctl(fd, MON_IOCX_GETX, &arg) < 0) {
+			if (errno == EINTR)
+				continue;
+			die("MON_IOCX_GETX");
+		}
+		on_event(&p, data);
+	}
+}
+
+static void read_pcap(int fd, const char *path)
+{
+	static uint8_t buf[sizeof(struct mon_packet) + MON_MAX_DATA];
+	uint32_t global[6];
+	uint32_t record[4];
+	struct mon_packet p;
+	size_t hdr_size;
+	FILE *f;
+
+	f = fdopen(fd, "r");
+	if (!f)
+		die(path);
+	if (fread(global, sizeof(global), 1, f) != 1 ||
+	    (global[0] != 0xa1b2c3d4 && global[0] != 0xa1b23c4d)) {
+		fprintf(stderr, "%s: not a pcap file of this byte order\n",
+			path);
+		exit(1);
+	}
+	if (global[5] == LINKTYPE_USB_LINUX) {
+		hdr_size = 48;
+	} else if (global[5] == LINKTYPE_USB_LINUX_MMAPPED) {
+		hdr_size = 64;
+	} else {
+		fprintf(stderr, "%s: link type %u is not usbmon\n", path,
+			global[5]);
+		exit(1);
+	}
+
+	while (!stop && fread(record, sizeof(record), 1, f) == 1) {
+		if (record[2] > sizeof(buf) || record[2] < hdr_size) {
+			fprintf(stderr, "%s: bad record length %u\n", path,
+				record[2]);
+			exit(1);
+		}
+		if (fread(buf, record[2], 1, f) != 1)
+			break;
+		memset(&p, 0, sizeof(p));
+		memcpy(&p, buf, hdr_size);
+		if (p.len_cap > record[2] - hdr_size)
+			p.len_cap = record[2] - hdr_size;
+		on_event(&p, buf + hdr_size);
+	}
+	fclose(f);
+}
+
+static void print_folded(const struct mon_stat *s, const char *what,
+			 double us)
+{
+	/* flamegraph.pl has no use for empty frames */
+	if (us >= 0.5)
+		printf("%u.%u;%s;%s %.0f\n", s->bus, s->dev, s->cmd, what,
+		       us);
+}
+
+static void print_summary(void)
+{
+	struct mon_stat *s;
+	unsigned int i;
+	double n;
+
+	if (!folded)
+		printf("\n%7s %-*s %8s %10s %10s %10s %10s %10s\n", "dev",
+		       MON_CMD_LEN, "command", "count", "total_us",
+		       "host_us", "bus_us", "device_us", "gap_us");
+
+	for (i = 0; i < n_stats; i++) {
+		s = &stats[i];
+		n = s->count;
+		if (folded && s->control) {
+			printf("%u.%u;control;%s %.0f\n", s->bus, s->dev,
+			       s->cmd, s->total);
+		} else if (folded) {
+			print_folded(s, "host", s->host);
+			print_folded(s, "bus", s->bus_time);
+			print_folded(s, "device", s->device);
+			if (s->gap >= 0.5)
+				printf("%u.%u;gap %.0f\n", s->bus, s->dev,
+				       s->gap);
+		} else if (s->control) {
+			printf("%3u.%-3u %-*s %8lu %10.1f\n", s->bus, s->dev,
+			       MON_CMD_LEN, s->cmd, s->count, s->total / n);
+		} else {
+			printf("%3u.%-3u %-*s %8lu %10.1f %10.1f %10.1f %10.1f "
+			       "%10.1f\n", s->bus, s->dev, MON_CMD_LEN,
+			       s->cmd, s->count, s->total / n, s->host / n,
+			       s->bus_time / n, s->device / n, s->gap / n);
+		}
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <usbmon device or pcap file>\n"
+		"  -d [bus.]dev  only this device\n"
+		"  -q            summary only\n"
+		"  -F            summary as folded stacks for flamegraph.pl\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa = { .sa_handler = on_signal };
+	struct stat st;
+	unsigned int i;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "d:qF")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%d.%d", &filter_bus,
+				   &filter_dev) != 2) {
+				filter_bus = -1;
+				filter_dev = atoi(optarg);
+			}
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'F':
+			folded = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die(argv[optind]);
+
+	/* Interrupted reads of usbmon must fail, so no SA_RESTART */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (!quiet && !folded)
+		printf("%14s %7s %3s %4s %-*s %8s %8s %9s %9s %9s %9s %9s\n",
+		       "time", "dev", "tag", "term", MON_CMD_LEN, "command",
+		       "out", "in", "total_us", "host_us", "bus_us",
+		       "device_us", "gap_us");
+
+	if (S_ISCHR(st.st_mode))
+		read_usbmon(fd);
+	else
+		read_pcap(fd, argv[optind]);
+
+	/* Commands still waiting for a response that never came */
+	for (i = 0; i < n_devs; i++)
+		if (devs[i].active && devs[i].msg.cmd_done)
+			msg_finish(&devs[i], devs[i].last);
+
+	print_summary();
+	return 0;
+}
@@ -0,0 +1,204 @@
+/**
+ * usbtmc_msg_bench.c - Check and time the bulk header helpers of the driver
+ *
+ * Runs the helpers of ../kernel/usbtmc_msg.h in user space. They are first
+ * compared against the byte by byte encoding of the USBTMC specification
+ * for header building, response validation, chunk sizing and padding,
+ * then timed. The cost per message of each helper is written to stdout as
+ * JSON, in the format of usbtmc_bench. A mismatch ends the program with
+ * exit code 1 before anything is timed.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* What usbtmc_msg.h takes from the kernel */
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint32_t __le32;
+#define __packed		__attribute__((packed))
+#define cpu_to_le32(x)		htole32(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#define min(x, y)		((x) < (y) ? (x) : (y))
+
+#include "../kernel/usbtmc_msg.h"
+
+static unsigned int errors;
+static unsigned int results;
+
+static void check(bool ok, const char *what, unsigned long a,
+		  unsigned long b)
+{
+	if (ok)
+		return;
+	if (errors++ < 10)
+		fprintf(stderr, "%s: %lu %lu\n", what, a, b);
+}
+
+static void check_header(const u8 *hdr, u8 MsgID, u8 bTag, u32 size,
+			 u8 attributes, u8 term_char)
+{
+	u8 expected[USBTMC_HEADER_SIZE] = {
+		MsgID, bTag, (u8)~bTag, 0,
+		size & 255, (size >> 8) & 255, (size >> 16) & 255, size >> 24,
+		attributes, term_char, 0, 0,
+	};
+
+	check(!memcmp(hdr, expected, sizeof(expected)), "header", MsgID,
+	      size);
+}
+
+static void check_all(void)
+{
+	static const u32 sizes[] = {
+		0, 1, 3, 4, 5, 511, 512, 2036, 2048, 65536, 0x12345678,
+		0xffffffff,
+	};
+	struct usbtmc_bulk_header hdr;
+	unsigned int i;
+	unsigned int b;
+	u32 actual;
+	u32 n;
+	size_t len;
+	bool eom;
+	int problems;
+
+	check(sizeof(hdr) == USBTMC_HEADER_SIZE, "sizeof", sizeof(hdr), 12);
+
+	/* Header build */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (b = 1; b < 256; b++) {
+			usbtmc_msg_out(&hdr, b, sizes[i], b & 1);
+			check_header((u8 *)&hdr, 1, b, sizes[i], b & 1, 0);
+			usbtmc_msg_request_in(&hdr, b, sizes[i], b & 2, b);
+			check_header((u8 *)&hdr, 2, b, sizes[i], b & 2, b);
+		}
+	}
+
+	/* bTag sequence, skipping 0 */
+	for (b = 0; b < 256; b++)
+		check(usbtmc_msg_next_btag(b) == (b == 255 ? 1 : b + 1),
+		      "next bTag", b, usbtmc_msg_next_btag(b));
+
+	/* Response validation */
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (actual = 12; actual < 2048 + 12; actual += 97) {
+			usbtmc_msg_header(&hdr, 2, 1, sizes[i]);
+			hdr.bmTransferAttributes = i & 1;
+			problems = usbtmc_msg_check_in(&hdr, actual, 1024, &n,
+						       &eom);
+			check(n <= actual - 12 && n <= 1024, "n_characters",
+			      n, actual);
+			check(n == min(min(sizes[i], actual - 12), 1024U),
+			      "n_characters", n, sizes[i]);
+			check(!(problems & USBTMC_MSG_SIZE_LIE) ==
+			      (sizes[i] <= actual - 12), "size lie",
+			      sizes[i], actual);
+			check(eom == (i & 1), "eom", eom, i);
+		}
+	}
+
+	/* Chunk sizing and padding */
+	for (len = 0; len < 5000; len++) {
+		n = usbtmc_msg_transfer_size(len);
+		check(n % 4 == 0 && n >= len + 12 && n < len + 16,
+		      "transfer size", len, n);
+		n = usbtmc_msg_out_chunk(len, 2048);
+		check(usbtmc_msg_transfer_size(n) <= 2048 && n <= len &&
+		      (n == len || n == 2036), "out chunk", len, n);
+		n = usbtmc_msg_in_chunk(len, 2048);
+		check(n + 12 + 3 <= 2048 && n <= len &&
+		      (n == len || n == 2033), "in chunk", len, n);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void result(const char *test, unsigned long iterations, double ns)
+{
+	printf("%s\n    {\"test\": \"%s\", \"iterations\": %lu, "
+	       "\"ns_per_message\": %.3f}", results++ ? "," : "", test,
+	       iterations, ns / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 10000000;
+	struct usbtmc_bulk_header hdr[16];
+	volatile u32 sink = 0;
+	unsigned long i;
+	double start;
+	u32 n;
+	bool eom;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+	if (!iterations) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	check_all();
+	if (errors) {
+		fprintf(stderr, "%u mismatches\n", errors);
+		return 1;
+	}
+
+	printf("{\n  \"results\": [");
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		usbtmc_msg_out(&hdr[i & 15], i, i, i & 1);
+	result("msg_out", iterations, now() - start);
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		usbtmc_msg_request_in(&hdr[i & 15], i, i, i & 1, '\n');
+	result("msg_request_in", iterations, now() - start);
+
+	for (i = 0; i < 16; i++)
+		usbtmc_msg_header(&hdr[i], 2, i + 1, i * 100);
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		sink += usbtmc_msg_check_in(&hdr[i & 15], 1024 + (i & 1023),
+					    2033, &n, &eom);
+		sink += n + eom;
+	}
+	result("msg_check_in", iterations, now() - start);
+
+	start = now();
+	for (i = 0; i < iterations; i++)
+		sink += usbtmc_msg_transfer_size(usbtmc_msg_out_chunk(i, 2048));
+	result("msg_out_chunk", iterations, now() - start);
+
+	printf("\n  ]\n}\n");
+	return sink == 0xdeadbeef;
+}
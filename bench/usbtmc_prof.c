@@ -0,0 +1,671 @@
+/**
+ * usbtmc_prof.c - Profile the usbtmc traffic of an unmodified application
+ *
+ *	LD_PRELOAD=./libusbtmc_prof.so testexec ...
+ *
+ * Interposes open(), read(), write(), ioctl() and close(). Calls on file
+ * descriptors opened from a path starting with /dev/usbtmc (or with
+ * $USBTMC_PROF_MATCH) are timed; everything else goes straight to libc.
+ * Each thread records its calls in its own ring buffer, without locks:
+ * the start time, latency, size, result and SCPI command text. A read()
+ * is charged to the command last written to the same descriptor, so a
+ * query counts its write and the reads of its answer.
+ *
+ * At exit, and at the first intercepted call after SIGUSR1 (or the
+ * signal number in $USBTMC_PROF_SIGNAL), a report is appended to
+ * $USBTMC_PROF_OUTPUT, or written to stderr. It has a latency histogram
+ * per call, the commands by total time and the slowest calls. The
+ * histograms count every call; the other two tables cover the last
+ * PROF_RING_SIZE calls of each thread.
+ *
+ * With $USBTMC_PROF_TRACE set to a file name, the reads and writes are
+ * also recorded there with their data, in the format of usbtmc_trace.h,
+ * for replay with usbtmc_replay and usbtmc_emu -r. Recording takes a
+ * lock per call. Only the first PROF_MAX_CHANNELS devices are traced.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "usbtmc_trace.h"
+
+#define PROF_RING_SIZE		16384	/* calls per thread, power of 2 */
+#define PROF_MAX_FDS		4096
+#define PROF_CMD_LEN		40
+#define PROF_BUCKETS		40	/* log2 of the latency in ns */
+#define PROF_MAX_CMDS		256
+#define PROF_SLOWEST		10
+#define PROF_MAX_CHANNELS	64
+#define PROF_NO_CHANNEL		0xffff	/* device not traced */
+
+enum prof_op {
+	PROF_OPEN,
+	PROF_READ,
+	PROF_WRITE,
+	PROF_IOCTL,
+	PROF_CLOSE,
+	PROF_OPS
+};
+
+static const char *const prof_op_names[PROF_OPS] = {
+	"open", "read", "write", "ioctl", "close",
+};
+
+struct prof_rec {
+	uint64_t start;			/* ns, CLOCK_MONOTONIC */
+	uint64_t ns;
+	size_t size;			/* asked for */
+	ssize_t result;
+	int fd;
+	uint8_t op;
+	char cmd[PROF_CMD_LEN];
+};
+
+/* Written by its thread only, read by whoever writes the report */
+struct prof_thread {
+	struct prof_thread *next;
+	pid_t tid;
+	_Atomic uint64_t head;		/* records written so far */
+	_Atomic uint64_t hist[PROF_OPS][PROF_BUCKETS];
+	_Atomic uint64_t total_ns[PROF_OPS];
+	struct prof_rec ring[PROF_RING_SIZE];
+};
+
+/* Per descriptor: opened on a usbtmc device, last command written */
+struct prof_fd {
+	atomic_bool tmc;
+	char cmd[PROF_CMD_LEN];
+	uint16_t channel;		/* in the trace */
+};
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static int (*real_ioctl)(int, unsigned long, ...);
+static int (*real_close)(int);
+
+static struct prof_fd prof_fds[PROF_MAX_FDS];
+static _Atomic(struct prof_thread *) prof_threads;
+static __thread struct prof_thread *prof_self;
+static __thread bool prof_busy;		/* in the report, do not record */
+static const char *prof_match = "/dev/usbtmc";
+static volatile sig_atomic_t prof_dump_requested;
+static atomic_flag prof_dumping = ATOMIC_FLAG_INIT;
+static int prof_stderr = -1;		/* survives the application closing 2 */
+static struct sigaction prof_old_action;	/* of the report signal */
+
+/* Session trace, see usbtmc_trace.h */
+static FILE *prof_trace;
+static uint64_t prof_trace_start;
+static pthread_mutex_t prof_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *prof_channels[PROF_MAX_CHANNELS];	/* device paths */
+static unsigned int prof_n_channels;
+
+static uint64_t prof_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The application's handler, if it had one, still runs */
+static void prof_on_signal(int sig, siginfo_t *info, void *context)
+{
+	prof_dump_requested = 1;
+
+	if (prof_old_action.sa_flags & SA_SIGINFO)
+		prof_old_action.sa_sigaction(sig, info, context);
+	else if (prof_old_action.sa_handler != SIG_DFL &&
+		 prof_old_action.sa_handler != SIG_IGN)
+		prof_old_action.sa_handler(sig);
+}
+
+static void prof_report(void);
+
+/* Also called by the wrappers, in case of calls from other constructors */
+static void prof_syms(void)
+{
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_openat = dlsym(RTLD_NEXT, "openat");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_close = dlsym(RTLD_NEXT, "close");
+}
+
+static void prof_trace_open(const char *path)
+{
+	struct usbtmc_trace_header hdr = {
+		.magic = USBTMC_TRACE_MAGIC,
+		.version = USBTMC_TRACE_VERSION,
+		.header_size = sizeof(hdr),
+	};
+
+	prof_trace = fopen(path, "we");
+	if (!prof_trace) {
+		perror(path);
+		return;
+	}
+	setvbuf(prof_trace, NULL, _IOFBF, 1 << 20);
+	prof_trace_start = prof_now();
+	hdr.start_ns = prof_trace_start;
+	fwrite(&hdr, sizeof(hdr), 1, prof_trace);
+}
+
+/*
+ * Channel of a device path, the same for every open of the device, or
+ * PROF_NO_CHANNEL when there is no room for another one: its calls are
+ * left out rather than mixed into the trace of a different device.
+ */
+static uint16_t prof_trace_channel(const char *path)
+{
+	static bool warned;
+	unsigned int i;
+
+	pthread_mutex_lock(&prof_trace_lock);
+	for (i = 0; i < prof_n_channels; i++)
+		if (!strcmp(prof_channels[i], path))
+			break;
+	if (i == prof_n_channels) {
+		if (i < PROF_MAX_CHANNELS)
+			prof_channels[i] = strdup(path);
+		if (i < PROF_MAX_CHANNELS && prof_channels[i]) {
+			prof_n_channels++;
+		} else {
+			if (!warned)
+				dprintf(prof_stderr, "usbtmc_prof: %s and "
+					"further devices are not traced\n",
+					path);
+			warned = true;
+			i = PROF_NO_CHANNEL;
+		}
+	}
+	pthread_mutex_unlock(&prof_trace_lock);
+	return i;
+}
+
+static void prof_trace_add(uint8_t op, int fd, uint64_t start, uint64_t ns,
+			   size_t size, const void *buf, ssize_t n)
+{
+	static const uint8_t pad[8];
+	struct usbtmc_trace_rec rec = {
+		.start_ns = start - prof_trace_start,
+		.ns = ns,
+		.len = n,
+		.size = size,
+		.op = op,
+		.channel = prof_fds[fd].channel,
+	};
+
+	if (n < 0 || rec.channel == PROF_NO_CHANNEL)
+		return;
+	pthread_mutex_lock(&prof_trace_lock);
+	/* Calls made while the process exits are not recorded */
+	if (prof_trace) {
+		fwrite(&rec, sizeof(rec), 1, prof_trace);
+		fwrite(buf, n, 1, prof_trace);
+		fwrite(pad, usbtmc_trace_rec_size(n) - sizeof(rec) - n, 1,
+		       prof_trace);
+	}
+	pthread_mutex_unlock(&prof_trace_lock);
+}
+
+__attribute__((constructor))
+static void prof_init(void)
+{
+	struct sigaction sa = {
+		.sa_sigaction = prof_on_signal,
+		.sa_flags = SA_RESTART | SA_SIGINFO,
+	};
+	const char *env;
+
+	if (!real_close)
+		prof_syms();
+	prof_stderr = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+
+	env = getenv("USBTMC_PROF_MATCH");
+	if (env && *env)
+		prof_match = env;
+	env = getenv("USBTMC_PROF_SIGNAL");
+	sigaction(env ? atoi(env) : SIGUSR1, &sa, &prof_old_action);
+
+	env = getenv("USBTMC_PROF_TRACE");
+	if (env && *env)
+		prof_trace_open(env);
+}
+
+__attribute__((destructor))
+static void prof_fini(void)
+{
+	prof_report();
+	if (prof_trace) {
+		pthread_mutex_lock(&prof_trace_lock);
+		fclose(prof_trace);
+		prof_trace = NULL;
+		pthread_mutex_unlock(&prof_trace_lock);
+	}
+}
+
+static bool prof_is_tmc(int fd)
+{
+	if (!real_close)
+		prof_syms();
+	return fd >= 0 && fd < PROF_MAX_FDS &&
+	       atomic_load_explicit(&prof_fds[fd].tmc, memory_order_relaxed);
+}
+
+static struct prof_thread *prof_thread(void)
+{
+	struct prof_thread *t = prof_self;
+
+	if (t)
+		return t;
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->tid = gettid();
+	t->next = atomic_load(&prof_threads);
+	while (!atomic_compare_exchange_weak(&prof_threads, &t->next, t))
+		;
+	prof_self = t;
+	return t;
+}
+
+/* Printable start of a command, up to its first newline */
+static void prof_text(char *cmd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t n;
+
+	for (n = 0; n < len && n < PROF_CMD_LEN - 1 && p[n] != '\n'; n++)
+		cmd[n] = isprint(p[n]) ? p[n] : '.';
+	cmd[n] = 0;
+}
+
+/* Returns the duration of the call */
+static uint64_t prof_record(enum prof_op op, int fd, uint64_t start,
+			    size_t size, ssize_t result, const char *cmd)
+{
+	struct prof_thread *t;
+	struct prof_rec *rec;
+	uint64_t ns = prof_now() - start;
+	uint64_t head;
+	int bucket;
+
+	if (prof_dump_requested) {
+		prof_dump_requested = 0;
+		prof_report();
+	}
+
+	t = prof_thread();
+	if (!t)
+		return ns;
+
+	bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= PROF_BUCKETS)
+		bucket = PROF_BUCKETS - 1;
+	atomic_fetch_add_explicit(&t->hist[op][bucket], 1,
+				  memory_order_relaxed);
+	atomic_fetch_add_explicit(&t->total_ns[op], ns, memory_order_relaxed);
+
+	head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	rec = &t->ring[head & (PROF_RING_SIZE - 1)];
+	rec->start = start;
+	rec->ns = ns;
+	rec->size = size;
+	rec->result = result;
+	rec->fd = fd;
+	rec->op = op;
+	snprintf(rec->cmd, sizeof(rec->cmd), "%s", cmd ? cmd : "");
+	atomic_store_explicit(&t->head, head + 1, memory_order_release);
+	return ns;
+}
+
+static int prof_open_common(int dirfd, const char *path, int flags,
+			    mode_t mode, bool at)
+{
+	uint64_t start = prof_now();
+	bool tmc;
+	int fd;
+
+	if (!real_close)
+		prof_syms();
+	tmc = !prof_busy && path &&
+	      !strncmp(path, prof_match, strlen(prof_match));
+
+	fd = at ? real_openat(dirfd, path, flags, mode) :
+		  real_open(path, flags, mode);
+	if (!tmc || fd >= PROF_MAX_FDS)
+		return fd;
+
+	if (fd >= 0) {
+		prof_fds[fd].cmd[0] = 0;
+		if (prof_trace)
+			prof_fds[fd].channel = prof_trace_channel(path);
+		atomic_store(&prof_fds[fd].tmc, true);
+	}
+	prof_record(PROF_OPEN, fd, start, 0, fd, path);
+	return fd;
+}
+
+/* The mode argument is only there with O_CREAT or O_TMPFILE */
+#define PROF_MODE(flags, mode)						\
+	do {								\
+		va_list ap;						\
+									\
+		if (((flags) & O_CREAT) ||				\
+		    ((flags) & O_TMPFILE) == O_TMPFILE) {		\
+			va_start(ap, flags);				\
+			mode = va_arg(ap, mode_t);			\
+			va_end(ap);					\
+		}							\
+	} while (0)
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	PROF_MODE(flags, mode);
+	return prof_open_common(AT_FDCWD, path, flags, mode, false);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	PROF_MODE(flags, mode);
+	return prof_open_common(AT_FDCWD, path, flags | O_LARGEFILE, mode,
+				false);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	PROF_MODE(flags, mode);
+	return prof_open_common(dirfd, path, flags, mode, true);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+
+	PROF_MODE(flags, mode);
+	return prof_open_common(dirfd, path, flags | O_LARGEFILE, mode, true);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	uint64_t start;
+	uint64_t ns;
+	ssize_t n;
+
+	if (!prof_is_tmc(fd) || prof_busy)
+		return real_read(fd, buf, count);
+
+	start = prof_now();
+	n = real_read(fd, buf, count);
+	ns = prof_record(PROF_READ, fd, start, count, n, prof_fds[fd].cmd);
+	if (prof_trace)
+		prof_trace_add(USBTMC_TRACE_READ, fd, start, ns, count, buf, n);
+	return n;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	uint64_t start;
+	uint64_t ns;
+	ssize_t n;
+
+	if (!prof_is_tmc(fd) || prof_busy)
+		return real_write(fd, buf, count);
+
+	prof_text(prof_fds[fd].cmd, buf, count);
+	start = prof_now();
+	n = real_write(fd, buf, count);
+	ns = prof_record(PROF_WRITE, fd, start, count, n, prof_fds[fd].cmd);
+	if (prof_trace)
+		prof_trace_add(USBTMC_TRACE_WRITE, fd, start, ns, count, buf,
+			       n);
+	return n;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	char cmd[PROF_CMD_LEN];
+	uint64_t start;
+	va_list ap;
+	void *arg;
+	int retval;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!prof_is_tmc(fd) || prof_busy)
+		return real_ioctl(fd, request, arg);
+
+	snprintf(cmd, sizeof(cmd), "ioctl %c/%lu", (char)_IOC_TYPE(request),
+		 (unsigned long)_IOC_NR(request));
+	start = prof_now();
+	retval = real_ioctl(fd, request, arg);
+	prof_record(PROF_IOCTL, fd, start, 0, retval, cmd);
+	return retval;
+}
+
+int close(int fd)
+{
+	uint64_t start;
+	int retval;
+
+	if (!prof_is_tmc(fd) || prof_busy)
+		return real_close(fd);
+
+	atomic_store(&prof_fds[fd].tmc, false);
+	start = prof_now();
+	retval = real_close(fd);
+	prof_record(PROF_CLOSE, fd, start, 0, retval, NULL);
+	return retval;
+}
+
+/* Report */
+
+struct prof_cmd {
+	char cmd[PROF_CMD_LEN];
+	unsigned long count;
+	uint64_t ns;
+	uint64_t max_ns;
+	uint64_t bytes;
+};
+
+static int prof_cmd_cmp(const void *a, const void *b)
+{
+	const struct prof_cmd *x = a;
+	const struct prof_cmd *y = b;
+
+	return x->ns < y->ns ? 1 : x->ns > y->ns ? -1 : 0;
+}
+
+static struct prof_cmd *prof_cmd_get(struct prof_cmd *cmds,
+				     unsigned int *n_cmds, const char *cmd)
+{
+	unsigned int i;
+
+	for (i = 0; i < *n_cmds; i++)
+		if (!strcmp(cmds[i].cmd, cmd))
+			return &cmds[i];
+	/* The last slot collects everything that did not fit */
+	if (*n_cmds == PROF_MAX_CMDS - 1)
+		cmd = "(other)";
+	if (*n_cmds == PROF_MAX_CMDS)
+		return &cmds[PROF_MAX_CMDS - 1];
+	snprintf(cmds[*n_cmds].cmd, PROF_CMD_LEN, "%s", cmd);
+	return &cmds[(*n_cmds)++];
+}
+
+static void prof_slowest_add(struct prof_rec *slowest, unsigned int *n,
+			     const struct prof_rec *rec)
+{
+	unsigned int i;
+
+	if (*n < PROF_SLOWEST) {
+		i = (*n)++;
+	} else if (rec->ns > slowest[PROF_SLOWEST - 1].ns) {
+		i = PROF_SLOWEST - 1;
+	} else {
+		return;
+	}
+	for (; i > 0 && slowest[i - 1].ns < rec->ns; i--)
+		slowest[i] = slowest[i - 1];
+	slowest[i] = *rec;
+}
+
+static void prof_print_hist(FILE *f)
+{
+	uint64_t hist[PROF_BUCKETS];
+	uint64_t total_ns;
+	uint64_t count;
+	uint64_t max;
+	struct prof_thread *t;
+	unsigned int op;
+	unsigned int b;
+	unsigned int bar;
+
+	for (op = 0; op < PROF_OPS; op++) {
+		memset(hist, 0, sizeof(hist));
+		total_ns = 0;
+		for (t = atomic_load(&prof_threads); t; t = t->next) {
+			for (b = 0; b < PROF_BUCKETS; b++)
+				hist[b] += atomic_load(&t->hist[op][b]);
+			total_ns += atomic_load(&t->total_ns[op]);
+		}
+		count = 0;
+		max = 0;
+		for (b = 0; b < PROF_BUCKETS; b++) {
+			count += hist[b];
+			if (hist[b] > max)
+				max = hist[b];
+		}
+		if (!count)
+			continue;
+
+		fprintf(f, "%s: %lu calls, %.3f ms, %.1f us mean\n",
+			prof_op_names[op], (unsigned long)count, total_ns / 1e6,
+			total_ns / 1e3 / count);
+		for (b = 0; b < PROF_BUCKETS; b++) {
+			if (!hist[b])
+				continue;
+			bar = hist[b] * 40 / max;
+			fprintf(f, "  %12.1f us %10lu %.*s\n",
+				(1ull << b) / 1e3, (unsigned long)hist[b], bar,
+				"########################################");
+		}
+	}
+}
+
+static void prof_report(void)
+{
+	struct prof_rec slowest[PROF_SLOWEST];
+	unsigned int n_slowest = 0;
+	struct prof_cmd *cmds;
+	unsigned int n_cmds = 0;
+	struct prof_thread *t;
+	struct prof_cmd *c;
+	struct prof_rec *rec;
+	const char *path;
+	uint64_t head;
+	uint64_t i;
+	FILE *f;
+
+	/* Nothing to say for processes that never opened a device */
+	if (!atomic_load(&prof_threads) ||
+	    atomic_flag_test_and_set(&prof_dumping))
+		return;
+	prof_busy = true;
+
+	cmds = calloc(PROF_MAX_CMDS, sizeof(*cmds));
+	if (!cmds)
+		goto exit;
+
+	for (t = atomic_load(&prof_threads); t; t = t->next) {
+		head = atomic_load_explicit(&t->head, memory_order_acquire);
+		i = head > PROF_RING_SIZE ? head - PROF_RING_SIZE : 0;
+		for (; i < head; i++) {
+			rec = &t->ring[i & (PROF_RING_SIZE - 1)];
+			prof_slowest_add(slowest, &n_slowest, rec);
+			if (rec->op != PROF_READ && rec->op != PROF_WRITE)
+				continue;
+			c = prof_cmd_get(cmds, &n_cmds, rec->cmd);
+			c->count += rec->op == PROF_WRITE;
+			c->ns += rec->ns;
+			if (rec->ns > c->max_ns)
+				c->max_ns = rec->ns;
+			if (rec->result > 0)
+				c->bytes += rec->result;
+		}
+	}
+	qsort(cmds, n_cmds, sizeof(*cmds), prof_cmd_cmp);
+
+	path = getenv("USBTMC_PROF_OUTPUT");
+	if (path)
+		f = fopen(path, "a");
+	else
+		f = fdopen(dup(prof_stderr), "w");
+	if (!f)
+		goto exit;
+
+	fprintf(f, "=== usbtmc_prof: pid %d ===\n", getpid());
+	prof_print_hist(f);
+
+	fprintf(f, "\n%-*s %8s %12s %12s %12s %12s\n", PROF_CMD_LEN,
+		"command", "count", "total_ms", "mean_us", "max_call_us",
+		"bytes");
+	for (i = 0; i < n_cmds; i++)
+		fprintf(f, "%-*s %8lu %12.3f %12.1f %12.1f %12lu\n",
+			PROF_CMD_LEN, cmds[i].cmd[0] ? cmds[i].cmd : "(none)",
+			cmds[i].count, cmds[i].ns / 1e6,
+			cmds[i].count ? cmds[i].ns / 1e3 / cmds[i].count : 0,
+			cmds[i].max_ns / 1e3, (unsigned long)cmds[i].bytes);
+
+	fprintf(f, "\nslowest calls:\n");
+	for (i = 0; i < n_slowest; i++)
+		fprintf(f, "  %12.1f us %-5s fd %d size %zu result %zd  %s\n",
+			slowest[i].ns / 1e3, prof_op_names[slowest[i].op],
+			slowest[i].fd, slowest[i].size, slowest[i].result,
+			slowest[i].cmd);
+
+	fclose(f);
+exit:
+	free(cmds);
+	prof_busy = false;
+	atomic_flag_clear(&prof_dumping);
+}
@@ -0,0 +1,294 @@
+/**
+ * usbtmc_recover.c - Recovery time of usbtmc devices after injected faults
+ *
+ * Arms a fault in the emulator in ../emulator with EMU:FAULT, lets a block
+ * query (DATA?) run into it and recovers the way an application would:
+ * USBTMC_IOCTL_CLEAR, followed by USBTMC_IOCTL_CLEAR_IN_HALT if the read
+ * ended with a stalled endpoint. Afterwards the bTag stream is checked:
+ * EMU:BTAG? has to return the bTag the driver used for the query (from
+ * USBTMC_IOCTL_GET_TIMESTAMPS, where available), and a second block query
+ * has to come back intact.
+ *
+ * For every fault, the time until the fault was seen (detect) and from
+ * there until the device was verified to be in sync again (recover) are
+ * written to stdout as JSON, together with the number of runs in which the
+ * fault was noticed at all and in which recovery succeeded.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/tmc.h>
+#include "../kernel/usbtmc.h"
+
+#define RECOVER_MAX_RUNS	1000
+
+struct recover {
+	const char *device;
+	int fd;
+	unsigned int runs;
+	size_t block;			/* payload of the DATA? queries */
+	char *expected;			/* the answer to DATA? block */
+	size_t expected_len;
+	char *buf;
+	unsigned int results;		/* JSON objects written so far */
+};
+
+/* Outcome of one run */
+struct recover_run {
+	bool detected;
+	bool recovered;
+	int error;			/* errno of the faulted read, or 0 */
+	double detect_ms;
+	double recover_ms;
+};
+
+static double recover_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int recover_command(struct recover *r, const char *cmd)
+{
+	ssize_t len = strlen(cmd);
+
+	return write(r->fd, cmd, len) == len ? 0 : -1;
+}
+
+/* DATA? query, 0 if the answer is intact */
+static int recover_block(struct recover *r)
+{
+	char cmd[32];
+	ssize_t n;
+
+	snprintf(cmd, sizeof(cmd), "DATA? %zu\n", r->block);
+	if (recover_command(r, cmd) < 0)
+		return -errno;
+
+	/* One read() returns the whole message, up to the EOM */
+	n = read(r->fd, r->buf, r->expected_len + 64);
+	if (n < 0)
+		return -errno;
+	if ((size_t)n != r->expected_len ||
+	    memcmp(r->buf, r->expected, n))
+		return 1;
+	return 0;
+}
+
+/*
+ * The bTag the emulator saw for EMU:BTAG? has to be the one the driver
+ * used. Without USBTMC_IOCTL_GET_TIMESTAMPS (e.g. the agilent driver) a
+ * plausible answer is all that can be checked.
+ */
+static bool recover_btag_in_sync(struct recover *r)
+{
+	struct usbtmc_msg_timestamps ts;
+	char answer[16];
+	ssize_t n;
+	unsigned int bTag;
+
+	if (recover_command(r, "EMU:BTAG?\n") < 0)
+		return false;
+	n = read(r->fd, answer, sizeof(answer) - 1);
+	if (n <= 0)
+		return false;
+	answer[n] = 0;
+	if (sscanf(answer, "%u", &bTag) != 1 || bTag < 1 || bTag > 255)
+		return false;
+
+	/* Both drivers answer unknown ioctls with EBADRQC */
+	if (ioctl(r->fd, USBTMC_IOCTL_GET_TIMESTAMPS, &ts) < 0)
+		return errno == EBADRQC || errno == ENOTTY || errno == EINVAL;
+	return bTag == ts.bTag_out;
+}
+
+static void recover_once(struct recover *r, const char *fault,
+			 struct recover_run *run)
+{
+	char cmd[64];
+	double start;
+	double seen;
+	int rv;
+
+	memset(run, 0, sizeof(*run));
+
+	snprintf(cmd, sizeof(cmd), "EMU:FAULT %s\n", fault);
+	if (recover_command(r, cmd) < 0)
+		die("write");
+
+	start = recover_now();
+	rv = recover_block(r);
+	seen = recover_now();
+
+	run->detected = rv != 0;
+	run->error = rv < 0 ? -rv : 0;
+	run->detect_ms = seen - start;
+
+	/* Faults that went unnoticed may still have left stale data */
+	if (ioctl(r->fd, USBTMC_IOCTL_CLEAR) < 0)
+		return;
+	if (run->error == EPIPE &&
+	    ioctl(r->fd, USBTMC_IOCTL_CLEAR_IN_HALT) < 0)
+		return;
+
+	run->recovered = recover_btag_in_sync(r) && recover_block(r) == 0;
+	run->recover_ms = recover_now() - seen;
+}
+
+static int recover_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void recover_fault(struct recover *r, const char *fault)
+{
+	struct recover_run run;
+	double detect[RECOVER_MAX_RUNS];
+	double recover[RECOVER_MAX_RUNS];
+	unsigned int detected = 0;
+	unsigned int recovered = 0;
+	int error = 0;
+	unsigned int i;
+
+	for (i = 0; i < r->runs; i++) {
+		recover_once(r, fault, &run);
+		detect[i] = run.detect_ms;
+		if (run.detected)
+			detected++;
+		if (run.error)
+			error = run.error;
+		if (run.recovered)
+			recover[recovered++] = run.recover_ms;
+	}
+
+	qsort(detect, r->runs, sizeof(*detect), recover_cmp_double);
+	qsort(recover, recovered, sizeof(*recover), recover_cmp_double);
+
+	printf("%s\n    {\"fault\": \"%s\", \"runs\": %u, \"detected\": %u, "
+	       "\"recovered\": %u, \"error\": \"%s\", \"detect_ms_p50\": %.3f, "
+	       "\"detect_ms_max\": %.3f, \"recover_ms_p50\": %.3f, "
+	       "\"recover_ms_max\": %.3f}", r->results++ ? "," : "", fault,
+	       r->runs, detected, recovered, error ? strerror(error) : "",
+	       detect[r->runs / 2], detect[r->runs - 1],
+	       recovered ? recover[recovered / 2] : 0,
+	       recovered ? recover[recovered - 1] : 0);
+	fflush(stdout);
+}
+
+/* The answer to DATA? n: #<digits><n><data>\n, see the emulator */
+static void recover_expect(struct recover *r)
+{
+	char size[32];
+	size_t hdr;
+	size_t i;
+
+	snprintf(size, sizeof(size), "%zu", r->block);
+	r->expected_len = 2 + strlen(size) + r->block + 1;
+	r->expected = malloc(r->expected_len);
+	r->buf = malloc(r->expected_len + 64);
+	if (!r->expected || !r->buf)
+		die("malloc");
+
+	hdr = sprintf(r->expected, "#%zu%s", strlen(size), size);
+	for (i = 0; i < r->block; i++)
+		r->expected[hdr + i] = i;
+	r->expected[hdr + r->block] = '\n';
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <device>\n"
+		"  -f <faults>  ';' separated EMU:FAULT arguments\n"
+		"               (STALL;NAK,100;TRUNCATE;SIZE,16;BTAG;PENDING,10)\n"
+		"  -r <runs>    runs per fault (10, at most %d)\n"
+		"  -n <bytes>   payload of the faulted DATA? query (4096)\n"
+		"VANISH ends the emulator and thus has to be the last fault.\n",
+		name, RECOVER_MAX_RUNS);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct recover recover = {
+		.runs = 10,
+		.block = 4096,
+	};
+	struct recover *r = &recover;
+	char faults_default[] = "STALL;NAK,100;TRUNCATE;SIZE,16;BTAG;PENDING,10";
+	char *faults = faults_default;
+	char *fault;
+	char *save;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:r:n:")) != -1) {
+		switch (opt) {
+		case 'f':
+			faults = optarg;
+			break;
+		case 'r':
+			r->runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			r->block = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || !r->runs || r->runs > RECOVER_MAX_RUNS)
+		usage(argv[0]);
+
+	r->device = argv[optind];
+	r->fd = open(r->device, O_RDWR);
+	if (r->fd < 0)
+		die(r->device);
+
+	recover_expect(r);
+
+	/* Start from a known state */
+	ioctl(r->fd, USBTMC_IOCTL_CLEAR);
+	if (recover_command(r, "EMU:FAULT NONE\n") < 0)
+		die("write");
+
+	printf("{\n  \"device\": \"%s\",\n  \"results\": [", r->device);
+	for (fault = strtok_r(faults, ";", &save); fault;
+	     fault = strtok_r(NULL, ";", &save))
+		recover_fault(r, fault);
+	printf("\n  ]\n}\n");
+
+	close(r->fd);
+	return 0;
+}
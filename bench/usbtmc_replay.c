@@ -0,0 +1,231 @@
+/**
+ * usbtmc_replay.c - Replay a recorded usbtmc session against a device
+ *
+ * Repeats the writes and reads of one channel of a trace recorded with
+ * libusbtmc_prof.so (see usbtmc_trace.h) on a /dev/usbtmcN device, in
+ * order and with the original host time between calls, or back to back
+ * with -f. Reads ask for the same number of bytes as in the recording
+ * and their data is compared with the recorded one. Against usbtmc_emu -r
+ * on the same trace, the instrument answers with the recorded responses
+ * and think times, which makes a production session a repeatable
+ * benchmark for driver and library changes.
+ *
+ * The trace is used in place through mmap(). The recorded and replayed
+ * time spent in reads and writes and the span of the whole session are
+ * written to stdout as JSON, in the format of usbtmc_bench.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usbtmc_trace.h"
+
+/* Recorded and replayed totals of one kind of call */
+struct replay_stat {
+	unsigned long calls;
+	unsigned long long bytes;
+	uint64_t recorded_ns;
+	uint64_t replayed_ns;
+	uint64_t replayed_max_ns;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void stat_add(struct replay_stat *s, const struct usbtmc_trace_rec *rec,
+		     uint64_t ns, ssize_t n)
+{
+	s->calls++;
+	s->bytes += n > 0 ? n : 0;
+	s->recorded_ns += rec->ns;
+	s->replayed_ns += ns;
+	if (ns > s->replayed_max_ns)
+		s->replayed_max_ns = ns;
+}
+
+static void print_stat(const char *test, const struct replay_stat *s,
+		       bool last)
+{
+	printf("    {\"test\": \"%s\", \"calls\": %lu, \"bytes\": %llu, "
+	       "\"recorded_ms\": %.3f, \"replayed_ms\": %.3f, "
+	       "\"recorded_mean_us\": %.1f, \"replayed_mean_us\": %.1f, "
+	       "\"replayed_max_us\": %.1f}%s\n", test, s->calls, s->bytes,
+	       s->recorded_ns / 1e6, s->replayed_ns / 1e6,
+	       s->calls ? s->recorded_ns / 1e3 / s->calls : 0,
+	       s->calls ? s->replayed_ns / 1e3 / s->calls : 0,
+	       s->replayed_max_ns / 1e3, last ? "" : ",");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <trace> <device>\n"
+		"  -c <n>   channel of the trace to replay (0)\n"
+		"  -f       no host time between calls\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct usbtmc_trace_rec *rec;
+	const struct usbtmc_trace_rec *first = NULL;
+	struct replay_stat reads = { 0 };
+	struct replay_stat writes = { 0 };
+	unsigned long mismatches = 0;
+	unsigned int channel = 0;
+	bool fast = false;
+	uint64_t recorded_end = 0;	/* of the previous call */
+	uint64_t replayed_end = 0;
+	uint64_t replay_start;
+	uint64_t start;
+	uint64_t ns;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	struct stat st;
+	const void *end;
+	void *map;
+	ssize_t n;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "c:f")) != -1) {
+		switch (opt) {
+		case 'c':
+			channel = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fast = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 2 != argc)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		die(argv[optind]);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	end = (const unsigned char *)map + st.st_size;
+
+	rec = usbtmc_trace_first(map, st.st_size);
+	if (!rec && (size_t)st.st_size > sizeof(struct usbtmc_trace_header)) {
+		fprintf(stderr, "%s: not a usbtmc trace\n", argv[optind]);
+		return 1;
+	}
+
+	fd = open(argv[optind + 1], O_RDWR);
+	if (fd < 0)
+		die(argv[optind + 1]);
+
+	replay_start = now_ns();
+	for (; rec; rec = usbtmc_trace_next(rec, end)) {
+		if (rec->channel != channel)
+			continue;
+
+		/* The host time before this call, as recorded */
+		if (!first) {
+			first = rec;
+		} else if (!fast && rec->start_ns > recorded_end) {
+			sleep_until(replayed_end + rec->start_ns -
+				    recorded_end);
+		}
+
+		if (rec->op == USBTMC_TRACE_WRITE) {
+			start = now_ns();
+			n = write(fd, usbtmc_trace_data(rec), rec->len);
+			ns = now_ns() - start;
+			if (n < 0)
+				die("write");
+			stat_add(&writes, rec, ns, n);
+		} else {
+			if (rec->size > buf_size) {
+				buf_size = rec->size;
+				buf = realloc(buf, buf_size);
+				if (!buf)
+					die("realloc");
+			}
+			start = now_ns();
+			n = read(fd, buf, rec->size);
+			ns = now_ns() - start;
+			if (n < 0)
+				die("read");
+			if ((size_t)n != rec->len ||
+			    memcmp(buf, usbtmc_trace_data(rec), n))
+				mismatches++;
+			stat_add(&reads, rec, ns, n);
+		}
+
+		recorded_end = rec->start_ns + rec->ns;
+		replayed_end = start + ns;
+	}
+
+	printf("{\n  \"device\": \"%s\",\n  \"trace\": \"%s\",\n"
+	       "  \"channel\": %u,\n  \"paced\": %s,\n"
+	       "  \"recorded_span_ms\": %.3f,\n  \"replayed_span_ms\": %.3f,\n"
+	       "  \"read_mismatches\": %lu,\n  \"results\": [\n",
+	       argv[optind + 1], argv[optind], channel,
+	       fast ? "false" : "true",
+	       first ? (recorded_end - first->start_ns) / 1e6 : 0.0,
+	       first ? (replayed_end - replay_start) / 1e6 : 0.0,
+	       mismatches);
+	print_stat("write", &writes, false);
+	print_stat("read", &reads, true);
+	printf("  ]\n}\n");
+
+	free(buf);
+	close(fd);
+	munmap(map, st.st_size);
+	return 0;
+}
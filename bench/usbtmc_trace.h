@@ -0,0 +1,111 @@
+/**
+ * usbtmc_trace.h - Trace format of recorded usbtmc sessions
+ *
+ * A trace holds the read() and write() calls an application made on
+ * usbtmc devices: when, for how long, and the bytes that went through.
+ * It is written by libusbtmc_prof.so with $USBTMC_PROF_TRACE set, replayed
+ * against a device by usbtmc_replay, and answered by usbtmc_emu -r, which
+ * plays the instrument side with the recorded think times.
+ *
+ * The file is a header followed by records, each followed by its data
+ * padded to 8 bytes. Everything is 8 byte aligned and in host byte
+ * order, so a trace is used in place through mmap() without parsing.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_TRACE_H
+#define __USBTMC_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define USBTMC_TRACE_MAGIC	"USBTMCTR"
+#define USBTMC_TRACE_VERSION	1
+
+#define USBTMC_TRACE_WRITE	'W'
+#define USBTMC_TRACE_READ	'R'
+
+struct usbtmc_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;		/* offset of the first record */
+	uint64_t start_ns;		/* CLOCK_MONOTONIC when recording began */
+	uint64_t reserved;
+};
+
+struct usbtmc_trace_rec {
+	uint64_t start_ns;		/* relative to the header's start_ns */
+	uint64_t ns;			/* duration of the call */
+	uint32_t len;			/* bytes transferred, following */
+	uint32_t size;			/* bytes asked for */
+	uint8_t op;			/* USBTMC_TRACE_WRITE or _READ */
+	uint8_t reserved;
+	uint16_t channel;		/* device, in order of first open */
+	uint32_t reserved2;
+};
+
+static inline const unsigned char *
+usbtmc_trace_data(const struct usbtmc_trace_rec *rec)
+{
+	return (const unsigned char *)(rec + 1);
+}
+
+static inline size_t usbtmc_trace_rec_size(uint32_t len)
+{
+	return sizeof(struct usbtmc_trace_rec) + ((len + 7) & ~(size_t)7);
+}
+
+/* NULL unless rec and its data lie entirely before end */
+static inline const struct usbtmc_trace_rec *
+usbtmc_trace_check(const struct usbtmc_trace_rec *rec, const void *end)
+{
+	const unsigned char *p = (const unsigned char *)rec;
+
+	if ((size_t)((const unsigned char *)end - p) <
+	    sizeof(struct usbtmc_trace_rec) ||
+	    (size_t)((const unsigned char *)end - p) <
+	    usbtmc_trace_rec_size(rec->len))
+		return NULL;
+	return rec;
+}
+
+/* First record of a mapped trace, NULL if it is not one */
+static inline const struct usbtmc_trace_rec *
+usbtmc_trace_first(const void *map, size_t size)
+{
+	const struct usbtmc_trace_header *hdr = map;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, USBTMC_TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != USBTMC_TRACE_VERSION ||
+	    hdr->header_size < sizeof(*hdr) || hdr->header_size > size ||
+	    hdr->header_size & 7)
+		return NULL;
+	return usbtmc_trace_check((const void *)
+				  ((const unsigned char *)map +
+				   hdr->header_size),
+				  (const unsigned char *)map + size);
+}
+
+static inline const struct usbtmc_trace_rec *
+usbtmc_trace_next(const struct usbtmc_trace_rec *rec, const void *end)
+{
+	return usbtmc_trace_check((const void *)
+				  ((const unsigned char *)rec +
+				   usbtmc_trace_rec_size(rec->len)), end);
+}
+
+#endif /* __USBTMC_TRACE_H */
@@ -0,0 +1,320 @@
+/**
+ * usbtmc.cpp - C++ client library for usbtmc devices
+ *
+ * See usbtmc.hpp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include "usbtmc.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "../agilent/usbtmc.h"
+
+namespace usbtmc {
+
+static_assert(sizeof(Capabilities) == sizeof(usbtmc_dev_capabilities),
+	      "Capabilities must match struct usbtmc_dev_capabilities");
+static_assert(static_cast<int>(Attribute::rem_nl_on_write) ==
+	      USBTMC_ATTRIB_REM_NL_ON_WRITE, "Attribute out of sync");
+static_assert(read_mode_fread == USBTMC_ATTRIB_VAL_FREAD &&
+	      read_mode_read == USBTMC_ATTRIB_VAL_READ,
+	      "read modes out of sync");
+
+/* Commands rarely are longer than this */
+static constexpr std::size_t out_buffer_size = 4096;
+
+[[noreturn]] static void fail(const char *what)
+{
+	throw std::system_error(errno, std::system_category(), what);
+}
+
+Session::Session(int minor, std::size_t buffer_size)
+{
+	char path[32];
+
+	std::snprintf(path, sizeof(path), "/dev/usbtmc%d", minor);
+	grow(in_, in_size_, buffer_size, 0);
+	open(path);
+}
+
+Session::Session(const std::string &path, std::size_t buffer_size)
+{
+	grow(in_, in_size_, buffer_size, 0);
+	open(path.c_str());
+}
+
+Session::~Session()
+{
+	close();
+}
+
+Session::Session(Session &&other) noexcept
+{
+	*this = std::move(other);
+}
+
+Session &Session::operator=(Session &&other) noexcept
+{
+	if (this != &other) {
+		close();
+		fd_ = std::exchange(other.fd_, -1);
+		fread_ = other.fread_;
+		eof_pending_ = other.eof_pending_;
+		in_ = std::move(other.in_);
+		in_size_ = std::exchange(other.in_size_, 0);
+		out_ = std::move(other.out_);
+		out_size_ = std::exchange(other.out_size_, 0);
+	}
+	return *this;
+}
+
+void Session::open(const char *path)
+{
+	struct usbtmc_attribute attr = { USBTMC_ATTRIB_READ_MODE, 0 };
+
+	fd_ = ::open(path, O_RDWR | O_CLOEXEC);
+	if (fd_ < 0)
+		fail(path);
+	grow(out_, out_size_, out_buffer_size, 0);
+
+	/*
+	 * In fread mode the driver answers the read after a short one with
+	 * 0, which read() has to consume. Without the attribute (another
+	 * driver) there is no such read.
+	 */
+	if (::ioctl(fd_, USBTMC_IOCTL_GET_ATTRIBUTE, &attr) == 0)
+		fread_ = attr.value == USBTMC_ATTRIB_VAL_FREAD;
+}
+
+void Session::close() noexcept
+{
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+void Session::grow(std::unique_ptr<char[]> &buf, std::size_t &size,
+		   std::size_t need, std::size_t keep)
+{
+	std::size_t new_size = size ? size : 64;
+
+	while (new_size < need)
+		new_size *= 2;
+	if (new_size == size)
+		return;
+
+	std::unique_ptr<char[]> new_buf(new char[new_size]);
+	if (keep)
+		std::memcpy(new_buf.get(), buf.get(), keep);
+	buf = std::move(new_buf);
+	size = new_size;
+}
+
+void Session::write(std::string_view message)
+{
+	bool newline = message.empty() || message.back() != '\n';
+	std::size_t len = message.size() + newline;
+	std::size_t done = 0;
+	ssize_t n;
+
+	/* One write() is one message, so the newline has to go with it */
+	if (len > out_size_)
+		grow(out_, out_size_, len, 0);
+	std::memcpy(out_.get(), message.data(), message.size());
+	if (newline)
+		out_[message.size()] = '\n';
+
+	eof_pending_ = false;
+	while (done < len) {
+		n = ::write(fd_, out_.get() + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("usbtmc write");
+		}
+		done += n;
+	}
+}
+
+std::string_view Session::read()
+{
+	std::size_t done = 0;
+	std::size_t want;
+	ssize_t n;
+	char c;
+
+	if (eof_pending_ && fread_) {
+		if (::read(fd_, &c, 1) < 0)
+			fail("usbtmc read");
+		eof_pending_ = false;
+	}
+
+	/* The driver ends a response with a short read */
+	for (;;) {
+		if (done == in_size_)
+			grow(in_, in_size_, in_size_ * 2, done);
+		want = in_size_ - done;
+		n = ::read(fd_, in_.get() + done, want);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("usbtmc read");
+		}
+		done += n;
+		if (static_cast<std::size_t>(n) < want)
+			break;
+	}
+
+	eof_pending_ = true;
+	return std::string_view(in_.get(), done);
+}
+
+std::string_view Session::query(std::string_view command)
+{
+	std::string_view response;
+
+	write(command);
+	response = read();
+	if (!response.empty() && response.back() == '\n')
+		response.remove_suffix(1);
+	return response;
+}
+
+std::string_view block_data(std::string_view response)
+{
+	std::size_t digits;
+	std::size_t len = 0;
+
+	if (response.size() < 2 || response[0] != '#' ||
+	    response[1] < '0' || response[1] > '9')
+		goto bad_block;
+
+	/* #0 is an indefinite length block, ended by the newline */
+	digits = response[1] - '0';
+	if (!digits) {
+		response.remove_prefix(2);
+		if (!response.empty() && response.back() == '\n')
+			response.remove_suffix(1);
+		return response;
+	}
+
+	if (response.size() < 2 + digits)
+		goto bad_block;
+	for (std::size_t i = 2; i < 2 + digits; i++) {
+		if (response[i] < '0' || response[i] > '9')
+			goto bad_block;
+		len = len * 10 + response[i] - '0';
+	}
+	if (response.size() - 2 - digits < len)
+		goto bad_block;
+	return response.substr(2 + digits, len);
+
+bad_block:
+	errno = EPROTO;
+	fail("usbtmc block");
+}
+
+std::string_view Session::read_block()
+{
+	return block_data(read());
+}
+
+std::string_view Session::read_block(std::string_view command)
+{
+	write(command);
+	return read_block();
+}
+
+void Session::request(unsigned long code, void *arg, const char *what)
+{
+	if (::ioctl(fd_, code, arg) < 0)
+		fail(what);
+}
+
+Capabilities Session::capabilities()
+{
+	struct usbtmc_dev_capabilities caps;
+
+	request(USBTMC_IOCTL_GET_CAPABILITIES, &caps, "usbtmc getcaps");
+	return Capabilities{
+		static_cast<unsigned char>(caps.interface_capabilities),
+		static_cast<unsigned char>(caps.device_capabilities),
+		static_cast<unsigned char>(caps.usb488_interface_capabilities),
+		static_cast<unsigned char>(caps.usb488_device_capabilities),
+	};
+}
+
+void Session::indicator_pulse()
+{
+	request(USBTMC_IOCTL_INDICATOR_PULSE, nullptr, "usbtmc indpulse");
+}
+
+void Session::clear()
+{
+	request(USBTMC_IOCTL_CLEAR, nullptr, "usbtmc clear");
+}
+
+void Session::abort_bulk_out()
+{
+	request(USBTMC_IOCTL_ABORT_BULK_OUT, nullptr, "usbtmc abortout");
+}
+
+void Session::abort_bulk_in()
+{
+	request(USBTMC_IOCTL_ABORT_BULK_IN, nullptr, "usbtmc abortin");
+}
+
+void Session::clear_out_halt()
+{
+	request(USBTMC_IOCTL_CLEAR_OUT_HALT, nullptr, "usbtmc clearouthalt");
+}
+
+void Session::clear_in_halt()
+{
+	request(USBTMC_IOCTL_CLEAR_IN_HALT, nullptr, "usbtmc clearinhalt");
+}
+
+void Session::reset_configuration()
+{
+	request(USBTMC_IOCTL_RESET_CONF, nullptr, "usbtmc reset");
+}
+
+int Session::attribute(Attribute attribute)
+{
+	struct usbtmc_attribute attr = { static_cast<int>(attribute), 0 };
+
+	request(USBTMC_IOCTL_GET_ATTRIBUTE, &attr, "usbtmc getattr");
+	return attr.value;
+}
+
+void Session::set_attribute(Attribute attribute, int value)
+{
+	struct usbtmc_attribute attr = { static_cast<int>(attribute), value };
+
+	request(USBTMC_IOCTL_SET_ATTRIBUTE, &attr, "usbtmc setattr");
+	if (attribute == Attribute::read_mode)
+		fread_ = value == USBTMC_ATTRIB_VAL_FREAD;
+}
+
+} // namespace usbtmc
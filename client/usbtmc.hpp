@@ -0,0 +1,144 @@
+/**
+ * usbtmc.hpp - C++ client library for usbtmc devices
+ *
+ * A usbtmc::Session owns the file descriptor of a /dev/usbtmcN device of
+ * the driver in ../agilent and closes it when it goes out of scope. It
+ * keeps one response buffer and one command buffer for its lifetime, so
+ * once they have grown to the largest message of a session, query(),
+ * write(), read() and read_block() make no heap allocations. Responses
+ * are returned as views into the response buffer, valid until the next
+ * call on the session.
+ *
+ * The ioctl requests of ../agilent/usbtmc.h are typed methods. Errors
+ * are reported as std::system_error carrying the errno of the failed
+ * call.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_HPP
+#define __USBTMC_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace usbtmc {
+
+/* Attributes of USBTMC_IOCTL_GET_ATTRIBUTE and _SET_ATTRIBUTE */
+enum class Attribute : int {
+	auto_abort = 0,		/* USBTMC_ATTRIB_AUTO_ABORT_ON_ERROR */
+	read_mode = 1,
+	timeout = 2,
+	num_instruments = 3,
+	minor_numbers = 4,
+	size_io_buffer = 5,
+	default_timeout = 6,
+	debug_mode = 7,
+	version = 8,
+	term_char_enabled = 9,
+	term_char = 10,
+	add_nl_on_read = 11,
+	rem_nl_on_write = 12,
+};
+
+/* Values of on/off attributes and of Attribute::read_mode */
+constexpr int off = 0;
+constexpr int on = 1;
+constexpr int read_mode_fread = 0;
+constexpr int read_mode_read = 1;
+
+/* USBTMC_IOCTL_GET_CAPABILITIES, see section 4.2.1.8 of the spec */
+struct Capabilities {
+	unsigned char interface;
+	unsigned char device;
+	unsigned char usb488_interface;
+	unsigned char usb488_device;
+};
+
+/*
+ * Data of an IEEE 488.2 block response (#<n><length><data> or #0<data>),
+ * as a view into response. Throws std::system_error (EPROTO) if it is
+ * not one.
+ */
+std::string_view block_data(std::string_view response);
+
+class Session {
+public:
+	/* Initial size of the response buffer, it grows as needed */
+	static constexpr std::size_t default_buffer_size = 64 * 1024;
+
+	explicit Session(int minor,
+			 std::size_t buffer_size = default_buffer_size);
+	explicit Session(const std::string &path,
+			 std::size_t buffer_size = default_buffer_size);
+	~Session();
+
+	Session(Session &&other) noexcept;
+	Session &operator=(Session &&other) noexcept;
+	Session(const Session &) = delete;
+	Session &operator=(const Session &) = delete;
+
+	int fd() const { return fd_; }
+
+	/* Send one message, a newline is added unless it ends with one */
+	void write(std::string_view message);
+
+	/* Read one response, including its terminator */
+	std::string_view read();
+
+	/* write() and read(), without the response's trailing newline */
+	std::string_view query(std::string_view command);
+
+	/*
+	 * Read an IEEE 488.2 block response (#<n><length><data> or
+	 * #0<data>) and return its data. With a command, it is sent first.
+	 */
+	std::string_view read_block();
+	std::string_view read_block(std::string_view command);
+
+	Capabilities capabilities();
+	void indicator_pulse();
+	void clear();
+	void abort_bulk_out();
+	void abort_bulk_in();
+	void clear_out_halt();
+	void clear_in_halt();
+	void reset_configuration();
+
+	int attribute(Attribute attribute);
+	void set_attribute(Attribute attribute, int value);
+
+private:
+	friend class AsyncSession;	/* usbtmc_uring.hpp, same buffers */
+
+	void open(const char *path);
+	void request(unsigned long code, void *arg, const char *what);
+	void grow(std::unique_ptr<char[]> &buf, std::size_t &size,
+		  std::size_t need, std::size_t keep);
+	void close() noexcept;
+
+	int fd_ = -1;
+	bool fread_ = false;		/* driver in fread read mode */
+	bool eof_pending_ = false;	/* short read since the last write */
+	std::unique_ptr<char[]> in_;
+	std::size_t in_size_ = 0;
+	std::unique_ptr<char[]> out_;
+	std::size_t out_size_ = 0;
+};
+
+} // namespace usbtmc
+
+#endif /* __USBTMC_HPP */
@@ -0,0 +1,235 @@
+/**
+ * usbtmc_client_bench.cpp - Query latency and allocations of usbtmc::Session
+ *
+ * Sends a query (*IDN? by default) through a usbtmc session a number of
+ * times and reports the round trip time as percentiles, together with
+ * the heap allocations made by the queries. The global operator new is
+ * replaced to count them. After a warm up, in which the session's
+ * buffers reach their final size, the query path must not allocate:
+ * the program fails if it did. With -b the query is expected to return
+ * an IEEE 488.2 block and is read with read_block(). With -p the query
+ * is sent that many times per round trip through a usbtmc::Pipeline;
+ * the instrument must answer all queries of a message with one response
+ * message, as IEEE 488.2 instruments and ../emulator/usbtmc_emu do.
+ *
+ * The device is either a /dev/usbtmcN node, or a /dev/bus/usb/BBB/DDD
+ * node that is used through usbtmc::UsbfsSession, so that the usbfs
+ * transport can be compared with the drivers on the same instrument.
+ * Results are written to stdout as JSON, in the format of usbtmc_bench.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "usbtmc.hpp"
+#include "usbtmc_pipeline.hpp"
+#include "usbtmc_usbfs.hpp"
+
+static std::atomic<unsigned long> allocations;
+
+/* GCC takes the malloc() and free() below for a new/delete mismatch */
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t size)
+{
+	void *p;
+
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	p = std::malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name)
+{
+	std::fprintf(stderr,
+		     "Usage: %s [options] <device>\n"
+		     "  -n <n>     queries to time (1000)\n"
+		     "  -w <n>     queries before timing (10)\n"
+		     "  -q <query> query to send (*IDN?)\n"
+		     "  -b         the response is a definite length block\n"
+		     "  -p <n>     pipeline n queries per round trip (1)\n",
+		     name);
+	std::exit(1);
+}
+
+/* One round trip of depth queries, the bytes of their responses */
+template <class S>
+static std::size_t round_trip(S &session,
+			      usbtmc::BasicPipeline<S> &pipeline,
+			      const char *query, bool block, unsigned int depth)
+{
+	std::size_t bytes = 0;
+
+	if (depth > 1) {
+		for (std::string_view response : pipeline.run())
+			bytes += response.size();
+		return bytes;
+	}
+	return (block ? session.read_block(query) : session.query(query)).size();
+}
+
+/* Time iterations round trips after warmup ones, count their allocations */
+template <class S>
+static unsigned long run(S &session, const char *device, const char *test,
+			 const char *query, bool block, unsigned int depth,
+			 unsigned int warmup, unsigned int iterations)
+{
+	usbtmc::BasicPipeline<S> pipeline(session);
+	std::vector<double> times(iterations);
+	unsigned long long bytes = 0;
+	unsigned long allocs;
+	double start;
+	double total;
+
+	for (unsigned int i = 0; depth > 1 && i < depth; i++)
+		pipeline.add(query);
+	for (unsigned int i = 0; i < warmup; i++)
+		round_trip(session, pipeline, query, block, depth);
+
+	allocs = allocations.load();
+	total = now();
+	for (unsigned int i = 0; i < iterations; i++) {
+		start = now();
+		bytes += round_trip(session, pipeline, query, block, depth);
+		times[i] = now() - start;
+	}
+	total = now() - total;
+	allocs = allocations.load() - allocs;
+
+	std::sort(times.begin(), times.end());
+	std::printf("{\n  \"device\": \"%s\",\n  \"results\": [\n"
+		    "    {\"test\": \"%s_%s\", \"query\": \"%s\", "
+		    "\"iterations\": %u, \"depth\": %u, \"bytes\": %llu, "
+		    "\"p50_us\": %.1f, \"p90_us\": %.1f, "
+		    "\"p99_us\": %.1f, \"max_us\": %.1f, "
+		    "\"queries_per_s\": %.1f, "
+		    "\"MB_per_s\": %.3f, "
+		    "\"allocations\": %lu}\n  ]\n}\n",
+		    device, test,
+		    depth > 1 ? "pipeline" : block ? "block" : "query", query,
+		    iterations, depth, bytes,
+		    times[iterations / 2] * 1e6,
+		    times[iterations * 9 / 10] * 1e6,
+		    times[iterations * 99 / 100] * 1e6,
+		    times[iterations - 1] * 1e6,
+		    iterations * depth / total, bytes / total / 1e6, allocs);
+	return allocs;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *query = "*IDN?";
+	unsigned int iterations = 1000;
+	unsigned int warmup = 10;
+	unsigned int depth = 1;
+	unsigned long allocs;
+	bool block = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:q:bp:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = std::strtoul(optarg, nullptr, 0);
+			break;
+		case 'w':
+			warmup = std::strtoul(optarg, nullptr, 0);
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'b':
+			block = true;
+			break;
+		case 'p':
+			depth = std::strtoul(optarg, nullptr, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || !iterations || !depth ||
+	    (block && depth > 1))
+		usage(argv[0]);
+
+	try {
+		if (!std::strncmp(argv[optind], "/dev/bus/usb/", 13)) {
+			usbtmc::UsbfsSession session(argv[optind]);
+
+			allocs = run(session, argv[optind],
+				     session.mapped() ? "usbfs_mmap" : "usbfs",
+				     query, block, depth, warmup, iterations);
+		} else {
+			usbtmc::Session session(argv[optind]);
+
+			allocs = run(session, argv[optind], "session", query,
+				     block, depth, warmup, iterations);
+		}
+	} catch (const std::system_error &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	if (allocs) {
+		std::fprintf(stderr, "%lu heap allocations in %u queries\n",
+			     allocs, iterations);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * usbtmc_pipeline.cpp - Several SCPI queries per usbtmc round trip
+ *
+ * See usbtmc_pipeline.hpp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include "usbtmc_pipeline.hpp"
+
+namespace usbtmc {
+
+bool is_query(std::string_view command)
+{
+	char quote = 0;
+
+	for (char c : command) {
+		if (quote) {
+			/* A doubled quote ends and restarts the string */
+			if (c == quote)
+				quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '?') {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Length of the block at the start of s, or 0 if it is none */
+static std::size_t block_length(std::string_view s)
+{
+	std::size_t digits;
+	std::size_t len = 0;
+
+	if (s.size() < 2 || s[0] != '#' || s[1] < '0' || s[1] > '9')
+		return 0;
+
+	/* #0 is an indefinite length block, it runs to the end */
+	digits = s[1] - '0';
+	if (!digits)
+		return s.size();
+
+	if (s.size() < 2 + digits)
+		return 0;
+	for (std::size_t i = 2; i < 2 + digits; i++) {
+		if (s[i] < '0' || s[i] > '9')
+			return 0;
+		len = len * 10 + s[i] - '0';
+	}
+	if (s.size() - 2 - digits < len)
+		return 0;
+	return 2 + digits + len;
+}
+
+std::size_t split_responses(std::string_view response,
+			    std::vector<std::string_view> &responses)
+{
+	std::size_t count = 0;
+	std::size_t start = 0;
+	std::size_t skip;
+	char quote = 0;
+
+	for (std::size_t i = 0; i < response.size(); i++) {
+		char c = response[i];
+
+		if (quote) {
+			if (c == quote)
+				quote = 0;
+		} else if (c == '"' || c == '\'') {
+			quote = c;
+		} else if (c == '#') {
+			skip = block_length(response.substr(i));
+			if (skip)
+				i += skip - 1;
+		} else if (c == ';') {
+			responses.push_back(response.substr(start, i - start));
+			count++;
+			start = i + 1;
+		}
+	}
+	responses.push_back(response.substr(start));
+	return count + 1;
+}
+
+} // namespace usbtmc
@@ -0,0 +1,186 @@
+/**
+ * usbtmc_pipeline.hpp - Several SCPI queries per usbtmc round trip
+ *
+ * A usbtmc::Pipeline collects commands and queries and sends them joined
+ * into program messages, "MEAS:VOLT?;:MEAS:CURR?", as few as fit into
+ * max_message bytes each. An instrument answers all queries of a message
+ * with one response message, "1.25;0.031", which is read once and split
+ * at the separators, so N queries cost one write and one read instead of
+ * N of each:
+ *
+ *	usbtmc::Pipeline pipeline(session);
+ *
+ *	pipeline.add("MEAS:VOLT?").add("MEAS:CURR?");
+ *	const auto &values = pipeline.run();	// values[0], values[1]
+ *
+ * The messages are kept, so run() can be called again for the next
+ * reading, and after the first run it makes no heap allocations. The
+ * responses it returns are valid until the next run() or clear().
+ *
+ * The messages of a pipeline are still sent one after the other, each
+ * response read before the next message: IEEE 488.2 instruments discard
+ * an unread response when a new message arrives (query interrupted).
+ * Commands are joined with ";:", back at the root of the command tree,
+ * so every command must be complete, as it would be on its own.
+ *
+ * Pipeline works on a usbtmc::Session, BasicPipeline on anything with
+ * its write() and read(), such as a usbtmc::UsbfsSession.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_PIPELINE_HPP
+#define __USBTMC_PIPELINE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include "usbtmc.hpp"
+
+namespace usbtmc {
+
+/* Whether command is a query: it has a '?' outside of quoted strings */
+bool is_query(std::string_view command);
+
+/*
+ * Split a response message at the ';' between the responses of its
+ * queries, skipping separators in quoted strings and IEEE 488.2 blocks.
+ * The views are appended to responses, their number is returned.
+ */
+std::size_t split_responses(std::string_view response,
+			    std::vector<std::string_view> &responses);
+
+template <class S>
+class BasicPipeline {
+public:
+	/* Longest program message that is built, without the newline */
+	static constexpr std::size_t default_max_message = 1024;
+
+	explicit BasicPipeline(S &session,
+			       std::size_t max_message = default_max_message)
+		: session_(session), max_message_(max_message)
+	{
+	}
+
+	/* Queue a command or query, answered in order by run() */
+	BasicPipeline &add(std::string_view command);
+
+	/* Send the queued messages, one response per query */
+	const std::vector<std::string_view> &run();
+
+	/* Forget the queued commands */
+	void clear()
+	{
+		text_.clear();
+		messages_.clear();
+		responses_.clear();
+		results_.clear();
+		queries_ = 0;
+	}
+
+	std::size_t queries() const { return queries_; }
+	std::size_t messages() const { return messages_.size(); }
+
+private:
+	struct Message {
+		std::size_t start;	/* of its text in text_ */
+		std::size_t end;
+		std::size_t queries;
+		std::size_t response;	/* of its response in responses_ */
+		std::size_t response_end;
+	};
+
+	S &session_;
+	std::size_t max_message_;
+	std::size_t queries_ = 0;
+	std::string text_;		/* the messages, one after the other */
+	std::vector<Message> messages_;
+	std::string responses_;		/* copies, the session reuses its buffer */
+	std::vector<std::string_view> results_;
+};
+
+using Pipeline = BasicPipeline<Session>;
+
+template <class S>
+BasicPipeline<S> &BasicPipeline<S>::add(std::string_view command)
+{
+	bool root = !command.empty() &&
+		    (command.front() == ':' || command.front() == '*');
+	std::size_t join = root ? 1 : 2;
+
+	while (!command.empty() && command.back() == '\n')
+		command.remove_suffix(1);
+
+	if (messages_.empty() ||
+	    text_.size() - messages_.back().start + join + command.size() >
+	    max_message_) {
+		messages_.push_back(Message{ text_.size(), text_.size(), 0, 0,
+					     0 });
+	} else {
+		text_ += root ? ";" : ";:";
+	}
+	text_ += command;
+
+	Message &m = messages_.back();
+
+	m.end = text_.size();
+	if (is_query(command)) {
+		m.queries++;
+		queries_++;
+	}
+	return *this;
+}
+
+template <class S>
+const std::vector<std::string_view> &BasicPipeline<S>::run()
+{
+	std::string_view response;
+
+	responses_.clear();
+	results_.clear();
+	for (Message &m : messages_) {
+		session_.write(std::string_view(text_).substr(m.start,
+							       m.end - m.start));
+		m.response = m.response_end = responses_.size();
+		if (!m.queries)
+			continue;
+		response = session_.read();
+		if (!response.empty() && response.back() == '\n')
+			response.remove_suffix(1);
+		responses_ += response;
+		m.response_end = responses_.size();
+	}
+
+	/* Only now, responses_ does not move anymore */
+	for (const Message &m : messages_) {
+		if (!m.queries)
+			continue;
+		if (split_responses(std::string_view(responses_).substr(
+				m.response, m.response_end - m.response),
+				    results_) != m.queries) {
+			results_.clear();
+			throw std::system_error(EPROTO, std::system_category(),
+						"usbtmc pipeline response");
+		}
+	}
+	return results_;
+}
+
+} // namespace usbtmc
+
+#endif /* __USBTMC_PIPELINE_HPP */
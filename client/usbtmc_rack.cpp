@@ -0,0 +1,215 @@
+/**
+ * usbtmc_rack.cpp - Query many usbtmc devices from one thread
+ *
+ * Runs one coroutine per device on a usbtmc::Ring, each sending the same
+ * query (*IDN? by default) a number of times. All devices are busy at
+ * once although the program has a single thread, which is what the
+ * coroutine API of usbtmc_uring.hpp is for. With -e the same is done
+ * with callbacks on a usbtmc::Reactor (usbtmc_reactor.hpp), whose pool
+ * has -t threads. With -s the devices are queried one after the other
+ * with blocking usbtmc::Session calls instead, for comparison.
+ *
+ * Results are written to stdout as JSON, in the format of usbtmc_bench.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "usbtmc_reactor.hpp"
+#include "usbtmc_uring.hpp"
+
+/* Per device results */
+struct device_stat {
+	unsigned long queries;
+	unsigned long long bytes;
+	double busy;		/* seconds spent waiting for responses */
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static usbtmc::Task<void> poll_device(usbtmc::AsyncSession &session,
+				      const char *query, unsigned int count,
+				      device_stat &stat)
+{
+	double start;
+
+	for (unsigned int i = 0; i < count; i++) {
+		start = now();
+		stat.bytes += (co_await session.query(query)).size();
+		stat.busy += now() - start;
+		stat.queries++;
+	}
+}
+
+/* Query again from the callback until count queries are done */
+static void poll_device(usbtmc::Reactor &reactor, usbtmc::Device &device,
+			const char *query, unsigned int count,
+			device_stat &stat, int &error)
+{
+	double start = now();
+
+	reactor.query(device, query,
+		      [&reactor, &device, query, count, &stat, &error, start]
+		      (int err, std::string_view response) {
+			      stat.busy += now() - start;
+			      if (err) {
+				      error = err;
+				      return;
+			      }
+			      stat.bytes += response.size();
+			      if (++stat.queries < count)
+				      poll_device(reactor, device, query,
+						  count, stat, error);
+		      });
+}
+
+static void usage(const char *name)
+{
+	std::fprintf(stderr,
+		     "Usage: %s [options] <device>...\n"
+		     "  -n <n>     queries per device (1000)\n"
+		     "  -q <query> query to send (*IDN?)\n"
+		     "  -e         callbacks on an epoll reactor\n"
+		     "  -t <n>     threads of the reactor's pool (4)\n"
+		     "  -s         blocking queries, one device after the other\n",
+		     name);
+	std::exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *query = "*IDN?";
+	unsigned int count = 1000;
+	unsigned int threads = 4;
+	bool reactor = false;
+	bool serial = false;
+	int error = 0;
+	int n_devices;
+	double total;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:q:et:s")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = std::strtoul(optarg, nullptr, 0);
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		case 'e':
+			reactor = true;
+			break;
+		case 't':
+			threads = std::strtoul(optarg, nullptr, 0);
+			break;
+		case 's':
+			serial = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	n_devices = argc - optind;
+	if (n_devices < 1)
+		usage(argv[0]);
+
+	std::vector<device_stat> stats(n_devices);
+
+	try {
+		if (serial) {
+			std::vector<std::unique_ptr<usbtmc::Session>> sessions;
+			double start;
+
+			for (int i = 0; i < n_devices; i++)
+				sessions.push_back(std::make_unique<
+					usbtmc::Session>(argv[optind + i]));
+			total = now();
+			for (unsigned int q = 0; q < count; q++) {
+				for (int i = 0; i < n_devices; i++) {
+					start = now();
+					stats[i].bytes +=
+						sessions[i]->query(query).size();
+					stats[i].busy += now() - start;
+					stats[i].queries++;
+				}
+			}
+			total = now() - total;
+		} else if (reactor) {
+			usbtmc::Reactor loop(threads);
+			std::vector<usbtmc::Device *> devices;
+
+			for (int i = 0; i < n_devices; i++)
+				devices.push_back(&loop.open(argv[optind + i]));
+			total = now();
+			for (int i = 0; i < n_devices; i++)
+				poll_device(loop, *devices[i], query, count,
+					    stats[i], error);
+			loop.run();
+			total = now() - total;
+			if (error) {
+				errno = error;
+				throw std::system_error(errno,
+							std::system_category(),
+							"usbtmc query");
+			}
+		} else {
+			usbtmc::Ring ring(2 * n_devices);
+			std::vector<std::unique_ptr<usbtmc::AsyncSession>>
+				sessions;
+
+			for (int i = 0; i < n_devices; i++)
+				sessions.push_back(std::make_unique<
+					usbtmc::AsyncSession>(ring,
+							      argv[optind + i]));
+			total = now();
+			for (int i = 0; i < n_devices; i++)
+				ring.spawn(poll_device(*sessions[i], query, count,
+						       stats[i]));
+			ring.run();
+			total = now() - total;
+		}
+	} catch (const std::system_error &e) {
+		std::fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	std::printf("{\n  \"mode\": \"%s\",\n  \"devices\": %d,\n"
+		    "  \"seconds\": %.3f,\n  \"queries_per_s\": %.1f,\n"
+		    "  \"results\": [\n", serial ? "serial" : reactor ? "epoll" : "io_uring",
+		    n_devices, total, n_devices * count / total);
+	for (int i = 0; i < n_devices; i++)
+		std::printf("    {\"device\": \"%s\", \"queries\": %lu, "
+			    "\"bytes\": %llu, \"mean_us\": %.1f}%s\n",
+			    argv[optind + i], stats[i].queries, stats[i].bytes,
+			    stats[i].queries ?
+			    stats[i].busy * 1e6 / stats[i].queries : 0,
+			    i + 1 < n_devices ? "," : "");
+	std::printf("  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,516 @@
+/**
+ * usbtmc_reactor.cpp - Single threaded event loop for many usbtmc devices
+ *
+ * See usbtmc_reactor.hpp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include "usbtmc_reactor.hpp"
+
+#include <cerrno>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "usbtmc.hpp"
+
+namespace usbtmc {
+
+/* Bytes read at a time from a pollable device */
+static constexpr std::size_t read_chunk = 4096;
+
+[[noreturn]] static void fail(const char *what)
+{
+	throw std::system_error(errno, std::system_category(), what);
+}
+
+/* A device and its requests, only known to the reactor */
+class Device {
+public:
+	struct Request {
+		bool query;
+		std::string command;
+		Reactor::Callback callback;
+		unsigned int timeout_ms;
+	};
+
+	explicit Device(const std::string &path) : session(path) {}
+
+	Session session;
+	bool pollable = false;
+	std::uint32_t watched = 0;	/* epoll events asked for */
+
+	std::deque<Request> queue;
+	Request current;
+	bool busy = false;
+	bool timed_out = false;		/* callback already told */
+	std::uint64_t seq = 0;		/* of the current request */
+	Reactor::TimerId timer = 0;
+
+	/* Non-blocking I/O */
+	std::string out;
+	std::size_t out_done = 0;
+	std::string in;
+	bool reading = false;
+
+	/* Result of the pool */
+	int error = 0;
+	std::string_view response;
+};
+
+Reactor::Reactor(unsigned int threads)
+{
+	struct epoll_event ev = {};
+
+	for (unsigned int i = 0; i < wheel_slots; i++)
+		slots_[i] = -1;
+	tick_ = now_tick();
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		fail("epoll_create1");
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd_ < 0) {
+		::close(epoll_fd_);
+		fail("eventfd");
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev) < 0) {
+		::close(event_fd_);
+		::close(epoll_fd_);
+		fail("epoll_ctl");
+	}
+
+	for (unsigned int i = 0; i < threads; i++)
+		threads_.emplace_back(&Reactor::worker, this);
+}
+
+Reactor::~Reactor()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		exiting_ = true;
+	}
+	wake_.notify_all();
+	for (auto &t : threads_)
+		t.join();
+
+	::close(event_fd_);
+	::close(epoll_fd_);
+}
+
+Device &Reactor::open(const std::string &path)
+{
+	auto device = std::make_unique<Device>(path);
+	struct epoll_event ev = {};
+	int fd = device->session.fd();
+
+	/* Files without poll support are refused with EPERM */
+	ev.events = 0;
+	ev.data.ptr = device.get();
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0) {
+		device->pollable = true;
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+			fail("fcntl");
+	} else if (errno != EPERM) {
+		fail("epoll_ctl");
+	}
+
+	devices_.push_back(std::move(device));
+	return *devices_.back();
+}
+
+void Reactor::write(Device &device, std::string_view message,
+		    Callback callback, unsigned int timeout_ms)
+{
+	submit(device, false, message, std::move(callback), timeout_ms);
+}
+
+void Reactor::query(Device &device, std::string_view command,
+		    Callback callback, unsigned int timeout_ms)
+{
+	submit(device, true, command, std::move(callback), timeout_ms);
+}
+
+void Reactor::submit(Device &device, bool query, std::string_view command,
+		     Callback callback, unsigned int timeout_ms)
+{
+	device.queue.push_back(Device::Request{ query, std::string(command),
+						std::move(callback),
+						timeout_ms });
+	if (!device.busy)
+		start(device);
+}
+
+void Reactor::start(Device &device)
+{
+	std::uint64_t seq;
+
+	device.current = std::move(device.queue.front());
+	device.queue.pop_front();
+	device.busy = true;
+	device.timed_out = false;
+	seq = ++device.seq;
+	busy_++;
+
+	device.timer = 0;
+	if (device.current.timeout_ms)
+		device.timer = add_timer(device.current.timeout_ms,
+					 [this, &device, seq] {
+						 timed_out(device, seq);
+					 });
+
+	if (device.pollable) {
+		device.out = device.current.command;
+		if (device.out.empty() || device.out.back() != '\n')
+			device.out += '\n';
+		device.out_done = 0;
+		device.in.clear();
+		device.reading = false;
+		poll_io(device, EPOLLOUT);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		jobs_.push_back(&device);
+	}
+	wake_.notify_one();
+}
+
+void Reactor::finish(Device &device, int error, std::string_view response)
+{
+	Callback callback = std::move(device.current.callback);
+
+	if (device.timer)
+		cancel_timer(device.timer);
+	device.timer = 0;
+
+	/*
+	 * The response lives in the device's session, so it stays busy
+	 * during the callback: a request the callback makes is only queued
+	 * by submit(), and started here once the callback has returned.
+	 */
+	if (callback && !device.timed_out)
+		callback(error, response);
+	device.busy = false;
+	busy_--;
+	if (!device.queue.empty())
+		start(device);
+}
+
+void Reactor::timed_out(Device &device, std::uint64_t seq)
+{
+	Callback callback;
+
+	if (!device.busy || device.seq != seq)
+		return;
+	device.timer = 0;
+
+	if (device.pollable) {
+		watch(device, 0);
+		finish(device, ETIMEDOUT, std::string_view());
+		return;
+	}
+
+	/* The pool thread still has the device, finish() comes later */
+	device.timed_out = true;
+	callback = std::move(device.current.callback);
+	if (callback)
+		callback(ETIMEDOUT, std::string_view());
+}
+
+void Reactor::watch(Device &device, std::uint32_t events)
+{
+	struct epoll_event ev = {};
+
+	if (device.watched == events)
+		return;
+	ev.events = events;
+	ev.data.ptr = &device;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, device.session.fd(), &ev) < 0)
+		fail("epoll_ctl");
+	device.watched = events;
+}
+
+/* Move the request of a pollable device on as far as it goes */
+void Reactor::poll_io(Device &device, std::uint32_t)
+{
+	int fd = device.session.fd();
+	std::size_t old;
+	std::size_t end;
+	ssize_t n;
+
+	if (!device.busy)
+		return;
+
+	while (!device.reading) {
+		if (device.out_done == device.out.size()) {
+			if (!device.current.query) {
+				watch(device, 0);
+				finish(device, 0, std::string_view());
+				return;
+			}
+			device.reading = true;
+			break;
+		}
+		n = ::write(fd, device.out.data() + device.out_done,
+			    device.out.size() - device.out_done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				watch(device, EPOLLOUT);
+				return;
+			}
+			watch(device, 0);
+			finish(device, errno, std::string_view());
+			return;
+		}
+		device.out_done += n;
+	}
+
+	for (;;) {
+		old = device.in.size();
+		device.in.resize(old + read_chunk);
+		n = ::read(fd, &device.in[old], read_chunk);
+		device.in.resize(old + (n > 0 ? n : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				watch(device, EPOLLIN);
+				return;
+			}
+			watch(device, 0);
+			finish(device, errno, std::string_view());
+			return;
+		}
+		if (!n) {
+			watch(device, 0);
+			finish(device, EPIPE, std::string_view());
+			return;
+		}
+		end = device.in.find('\n', old);
+		if (end != std::string::npos) {
+			watch(device, 0);
+			finish(device, 0, std::string_view(device.in.data(), end));
+			return;
+		}
+	}
+}
+
+void Reactor::worker()
+{
+	std::unique_lock<std::mutex> guard(lock_);
+	std::uint64_t one = 1;
+	std::uint64_t seq;
+	Device *device;
+
+	for (;;) {
+		wake_.wait(guard, [this] { return exiting_ || !jobs_.empty(); });
+		if (exiting_)
+			return;
+		device = jobs_.front();
+		jobs_.pop_front();
+		seq = device->seq;
+		guard.unlock();
+
+		device->error = 0;
+		device->response = std::string_view();
+		try {
+			if (device->current.query)
+				device->response = device->session.query(
+					device->current.command);
+			else
+				device->session.write(device->current.command);
+		} catch (const std::system_error &e) {
+			device->error = e.code().value();
+		}
+
+		guard.lock();
+		done_.emplace_back(device, seq);
+		guard.unlock();
+
+		if (::write(event_fd_, &one, sizeof(one)) < 0) {
+			/* Only fails when the counter is full: still woken */
+		}
+		guard.lock();
+	}
+}
+
+/* Completions of the pool */
+void Reactor::pool_done()
+{
+	std::uint64_t count;
+
+	if (::read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fail("eventfd");
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		done_local_.swap(done_);
+	}
+	for (auto &done : done_local_)
+		if (done.first->busy && done.first->seq == done.second)
+			finish(*done.first, done.first->error,
+			       done.first->response);
+	done_local_.clear();
+}
+
+void Reactor::run()
+{
+	struct epoll_event events[64];
+	int n;
+
+	stopped_ = false;
+	while (!stopped_ && (busy_ || active_timers_)) {
+		n = epoll_wait(epoll_fd_, events, 64, next_timeout());
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("epoll_wait");
+		}
+		for (int i = 0; i < n; i++) {
+			if (!events[i].data.ptr)
+				pool_done();
+			else
+				poll_io(*static_cast<Device *>(events[i].data.ptr),
+					events[i].events);
+		}
+		expire_timers();
+	}
+}
+
+std::uint64_t Reactor::now_tick() const
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+Reactor::TimerId Reactor::add_timer(unsigned int ms,
+				    std::function<void()> callback)
+{
+	unsigned int slot;
+	int index;
+
+	if (!free_timers_.empty()) {
+		index = free_timers_.back();
+		free_timers_.pop_back();
+	} else {
+		index = timers_.size();
+		/* Generation 1 on, so that no TimerId is 0 */
+		timers_.push_back(Timer{ 0, nullptr, -1, -1, 1, false });
+	}
+
+	Timer &t = timers_[index];
+	t.expires = now_tick() + (ms ? ms : 1);
+	t.callback = std::move(callback);
+	t.active = true;
+	slot = t.expires % wheel_slots;
+	t.prev = -1;
+	t.next = slots_[slot];
+	if (t.next >= 0)
+		timers_[t.next].prev = index;
+	slots_[slot] = index;
+	active_timers_++;
+
+	return static_cast<TimerId>(t.generation) << 32 | index;
+}
+
+void Reactor::cancel_timer(TimerId id)
+{
+	std::size_t index = id & 0xffffffff;
+
+	if (index < timers_.size() && timers_[index].active &&
+	    timers_[index].generation == id >> 32)
+		unlink_timer(index);
+}
+
+void Reactor::unlink_timer(int index)
+{
+	Timer &t = timers_[index];
+
+	if (t.prev >= 0)
+		timers_[t.prev].next = t.next;
+	else
+		slots_[t.expires % wheel_slots] = t.next;
+	if (t.next >= 0)
+		timers_[t.next].prev = t.prev;
+
+	t.active = false;
+	t.generation++;
+	t.callback = nullptr;
+	free_timers_.push_back(index);
+	active_timers_--;
+}
+
+/* Run the timers of the ticks since the last call */
+void Reactor::expire_timers()
+{
+	std::uint64_t now = now_tick();
+	std::uint64_t first = tick_ + 1;
+	int index;
+	int next;
+
+	if (now < first)
+		return;
+	if (now - first >= wheel_slots)
+		first = now - wheel_slots + 1;
+
+	for (std::uint64_t tick = first; tick <= now; tick++) {
+		for (index = slots_[tick % wheel_slots]; index >= 0;
+		     index = next) {
+			next = timers_[index].next;
+			if (timers_[index].expires > now)
+				continue;
+			fired_.push_back(std::move(timers_[index].callback));
+			unlink_timer(index);
+		}
+	}
+	tick_ = now;
+
+	for (std::size_t i = 0; i < fired_.size(); i++)
+		fired_[i]();
+	fired_.clear();
+}
+
+/* Milliseconds until the next timer might expire, -1 without timers */
+int Reactor::next_timeout() const
+{
+	std::uint64_t now;
+
+	if (!active_timers_)
+		return -1;
+	now = now_tick();
+	for (std::uint64_t tick = tick_ + 1; tick <= tick_ + wheel_slots;
+	     tick++) {
+		for (int index = slots_[tick % wheel_slots]; index >= 0;
+		     index = timers_[index].next)
+			if (timers_[index].expires <= tick)
+				return tick > now ? tick - now : 0;
+	}
+	return wheel_slots;
+}
+
+} // namespace usbtmc
@@ -0,0 +1,141 @@
+/**
+ * usbtmc_reactor.hpp - Single threaded event loop for many usbtmc devices
+ *
+ * A usbtmc::Reactor runs writes and queries on any number of devices
+ * from one thread and reports each completion to a callback, called
+ * from run(). It is the callback counterpart of usbtmc_uring.hpp for
+ * kernels or programs where io_uring is not an option, and replaces a
+ * thread per instrument, which stops scaling at a few dozen of them.
+ *
+ * Devices whose file descriptor can be polled are driven with
+ * non-blocking I/O through epoll; a response ends with a newline then.
+ * Neither usbtmc driver supports poll() on its device nodes, so their
+ * devices go to a small pool of threads that make the blocking
+ * usbtmc::Session calls, and report back through an eventfd. The pool
+ * only needs as many threads as requests that are expected to wait on
+ * the bus at the same time, not one per instrument.
+ *
+ * Timeouts and timers live on a timer wheel with 1 ms ticks. When a
+ * request times out, its callback gets ETIMEDOUT. A blocking call in
+ * the pool cannot be interrupted though: the device stays busy until it
+ * returns (see the driver's timeout attribute), its result is dropped.
+ *
+ * Requests on one device run one after the other, in order. A response
+ * passed to a callback is only valid during the call.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_REACTOR_HPP
+#define __USBTMC_REACTOR_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace usbtmc {
+
+class Device;
+
+class Reactor {
+public:
+	/* error is 0 or an errno value, response is empty for writes */
+	using Callback = std::function<void(int error,
+					    std::string_view response)>;
+	using TimerId = std::uint64_t;
+
+	static constexpr unsigned int wheel_slots = 512;
+
+	explicit Reactor(unsigned int threads = 4);
+	~Reactor();
+
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	/* Open a device, owned by the reactor */
+	Device &open(const std::string &path);
+
+	/* Queue a request, timeout_ms 0 waits forever */
+	void write(Device &device, std::string_view message, Callback callback,
+		   unsigned int timeout_ms = 0);
+	void query(Device &device, std::string_view command, Callback callback,
+		   unsigned int timeout_ms = 0);
+
+	/* Call callback once, after ms milliseconds */
+	TimerId add_timer(unsigned int ms, std::function<void()> callback);
+	void cancel_timer(TimerId id);
+
+	/* Dispatch until no request or timer is left, or stop() */
+	void run();
+	void stop() { stopped_ = true; }
+
+private:
+	struct Timer {
+		std::uint64_t expires;	/* tick */
+		std::function<void()> callback;
+		int next;
+		int prev;
+		std::uint32_t generation;
+		bool active;
+	};
+
+	void submit(Device &device, bool query, std::string_view command,
+		    Callback callback, unsigned int timeout_ms);
+	void start(Device &device);
+	void finish(Device &device, int error, std::string_view response);
+	void timed_out(Device &device, std::uint64_t seq);
+	void poll_io(Device &device, std::uint32_t events);
+	void watch(Device &device, std::uint32_t events);
+	void pool_done();
+	void worker();
+
+	std::uint64_t now_tick() const;
+	void unlink_timer(int index);
+	void expire_timers();
+	int next_timeout() const;
+
+	int epoll_fd_ = -1;
+	int event_fd_ = -1;
+	bool stopped_ = false;
+	unsigned int busy_ = 0;		/* devices with a request running */
+	std::vector<std::unique_ptr<Device>> devices_;
+
+	/* Blocking I/O pool */
+	std::vector<std::thread> threads_;
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::deque<Device *> jobs_;
+	std::vector<std::pair<Device *, std::uint64_t>> done_;
+	std::vector<std::pair<Device *, std::uint64_t>> done_local_;
+	bool exiting_ = false;
+
+	/* Timer wheel */
+	std::vector<Timer> timers_;
+	std::vector<int> free_timers_;
+	int slots_[wheel_slots];
+	std::uint64_t tick_;
+	unsigned int active_timers_ = 0;
+	std::vector<std::function<void()>> fired_;
+};
+
+} // namespace usbtmc
+
+#endif /* __USBTMC_REACTOR_HPP */
@@ -0,0 +1,346 @@
+/**
+ * usbtmc_uring.cpp - C++20 coroutine API for usbtmc devices on io_uring
+ *
+ * See usbtmc_uring.hpp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include "usbtmc_uring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace usbtmc {
+
+[[noreturn]] static void fail(const char *what)
+{
+	throw std::system_error(errno, std::system_category(), what);
+}
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       nullptr, 0);
+}
+
+template <class T>
+static T *at(void *map, unsigned int offset)
+{
+	return reinterpret_cast<T *>(static_cast<char *>(map) + offset);
+}
+
+Ring::Ring(unsigned int entries)
+{
+	struct io_uring_params p;
+	void *map;
+
+	std::memset(&p, 0, sizeof(p));
+	fd_ = io_uring_setup(entries, &p);
+	if (fd_ < 0)
+		fail("io_uring_setup");
+
+	sq_map_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_map_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_map_size_ = cq_map_size_ =
+			std::max(sq_map_size_, cq_map_size_);
+	sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+
+	map = mmap(nullptr, sq_map_size_, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto failed;
+	sq_map_ = map;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_map_ = sq_map_;
+	} else {
+		map = mmap(nullptr, cq_map_size_, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED)
+			goto failed;
+		cq_map_ = map;
+	}
+
+	map = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (map == MAP_FAILED)
+		goto failed;
+	sqes_ = static_cast<io_uring_sqe *>(map);
+
+	sq_head_ = at<unsigned int>(sq_map_, p.sq_off.head);
+	sq_tail_ = at<unsigned int>(sq_map_, p.sq_off.tail);
+	sq_mask_ = at<unsigned int>(sq_map_, p.sq_off.ring_mask);
+	sq_entries_ = at<unsigned int>(sq_map_, p.sq_off.ring_entries);
+	sq_array_ = at<unsigned int>(sq_map_, p.sq_off.array);
+	cq_head_ = at<unsigned int>(cq_map_, p.cq_off.head);
+	cq_tail_ = at<unsigned int>(cq_map_, p.cq_off.tail);
+	cq_mask_ = at<unsigned int>(cq_map_, p.cq_off.ring_mask);
+	cqes_ = at<io_uring_cqe>(cq_map_, p.cq_off.cqes);
+	return;
+
+failed:
+	int error = errno;
+
+	release();
+	errno = error;
+	fail("io_uring mmap");
+}
+
+Ring::~Ring()
+{
+	for (auto h : tasks_)
+		h.destroy();
+	release();
+}
+
+void Ring::release() noexcept
+{
+	if (sqes_)
+		munmap(sqes_, sqes_size_);
+	if (cq_map_ && cq_map_ != sq_map_)
+		munmap(cq_map_, cq_map_size_);
+	if (sq_map_)
+		munmap(sq_map_, sq_map_size_);
+	sqes_ = nullptr;
+	sq_map_ = cq_map_ = nullptr;
+	if (fd_ >= 0)
+		::close(fd_);
+	fd_ = -1;
+}
+
+Ring::Operation Ring::read(int fd, void *buf, unsigned int len)
+{
+	return Operation{ *this, IORING_OP_READ, fd, buf, len, 0, {} };
+}
+
+Ring::Operation Ring::write(int fd, const void *buf, unsigned int len)
+{
+	return Operation{ *this, IORING_OP_WRITE, fd, const_cast<void *>(buf),
+			  len, 0, {} };
+}
+
+/* Put an operation into the submission queue, submitted by run() */
+void Ring::queue(Operation *op)
+{
+	unsigned int tail = *sq_tail_;
+	unsigned int index;
+	io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == *sq_entries_) {
+		enter(0);
+		tail = *sq_tail_;
+	}
+
+	index = tail & *sq_mask_;
+	sqe = &sqes_[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->opcode;
+	sqe->fd = op->fd;
+	sqe->off = -1;		/* character devices have no offset */
+	sqe->addr = reinterpret_cast<std::uintptr_t>(op->buf);
+	sqe->len = op->len;
+	sqe->user_data = reinterpret_cast<std::uintptr_t>(op);
+	sq_array_[index] = index;
+	__atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+	pending_++;
+}
+
+/* Submit what is queued and wait for min_complete completions */
+void Ring::enter(unsigned int min_complete)
+{
+	int n;
+
+	do {
+		n = io_uring_enter(fd_, pending_, min_complete,
+				   min_complete ? IORING_ENTER_GETEVENTS : 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		fail("io_uring_enter");
+	pending_ -= n;
+	in_flight_ += n;
+}
+
+/* Resume the coroutines of all completed operations */
+void Ring::complete()
+{
+	unsigned int head = *cq_head_;
+	Operation *op;
+
+	while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+		io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+
+		op = reinterpret_cast<Operation *>(cqe->user_data);
+		op->result = cqe->res;
+		__atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+		in_flight_--;
+		op->waiter.resume();
+		head = *cq_head_;
+	}
+}
+
+/* Destroy the spawned tasks that returned, keep the first exception */
+void Ring::reap_tasks()
+{
+	auto done = std::remove_if(tasks_.begin(), tasks_.end(),
+		[this](std::coroutine_handle<detail::Promise<void>> h) {
+			if (!h.done())
+				return false;
+			if (h.promise().error && !error_)
+				error_ = h.promise().error;
+			h.destroy();
+			return true;
+		});
+
+	tasks_.erase(done, tasks_.end());
+}
+
+void Ring::spawn(Task<void> task)
+{
+	auto h = task.release();
+
+	tasks_.push_back(h);
+	h.resume();
+}
+
+void Ring::run()
+{
+	std::exception_ptr error;
+
+	for (;;) {
+		reap_tasks();
+		if (tasks_.empty())
+			break;
+		if (!pending_ && !in_flight_) {
+			/* A task waits for something that is not a ring op */
+			errno = EDEADLK;
+			fail("usbtmc ring");
+		}
+		enter(1);
+		complete();
+	}
+
+	error = std::exchange(error_, nullptr);
+	if (error)
+		std::rethrow_exception(error);
+}
+
+AsyncSession::AsyncSession(Ring &ring, int minor, std::size_t buffer_size)
+	: ring_(ring), session_(minor, buffer_size)
+{
+}
+
+AsyncSession::AsyncSession(Ring &ring, const std::string &path,
+			   std::size_t buffer_size)
+	: ring_(ring), session_(path, buffer_size)
+{
+}
+
+Task<void> AsyncSession::write(std::string_view message)
+{
+	Session &s = session_;
+	bool newline = message.empty() || message.back() != '\n';
+	std::size_t len = message.size() + newline;
+	std::size_t done = 0;
+	int n;
+
+	if (len > s.out_size_)
+		s.grow(s.out_, s.out_size_, len, 0);
+	std::memcpy(s.out_.get(), message.data(), message.size());
+	if (newline)
+		s.out_[message.size()] = '\n';
+
+	s.eof_pending_ = false;
+	while (done < len) {
+		n = co_await ring_.write(s.fd_, s.out_.get() + done, len - done);
+		if (n < 0) {
+			if (n == -EINTR)
+				continue;
+			errno = -n;
+			fail("usbtmc write");
+		}
+		done += n;
+	}
+}
+
+Task<std::string_view> AsyncSession::read()
+{
+	Session &s = session_;
+	std::size_t done = 0;
+	std::size_t want;
+	char c;
+	int n;
+
+	if (s.eof_pending_ && s.fread_) {
+		n = co_await ring_.read(s.fd_, &c, 1);
+		if (n < 0) {
+			errno = -n;
+			fail("usbtmc read");
+		}
+		s.eof_pending_ = false;
+	}
+
+	/* The driver ends a response with a short read */
+	for (;;) {
+		if (done == s.in_size_)
+			s.grow(s.in_, s.in_size_, s.in_size_ * 2, done);
+		want = s.in_size_ - done;
+		n = co_await ring_.read(s.fd_, s.in_.get() + done, want);
+		if (n < 0) {
+			if (n == -EINTR)
+				continue;
+			errno = -n;
+			fail("usbtmc read");
+		}
+		done += n;
+		if (static_cast<std::size_t>(n) < want)
+			break;
+	}
+
+	s.eof_pending_ = true;
+	co_return std::string_view(s.in_.get(), done);
+}
+
+Task<std::string_view> AsyncSession::query(std::string_view command)
+{
+	std::string_view response;
+
+	co_await write(command);
+	response = co_await read();
+	if (!response.empty() && response.back() == '\n')
+		response.remove_suffix(1);
+	co_return response;
+}
+
+Task<std::string_view> AsyncSession::read_block(std::string_view command)
+{
+	co_await write(command);
+	co_return block_data(co_await read());
+}
+
+} // namespace usbtmc
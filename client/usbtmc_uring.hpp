@@ -0,0 +1,280 @@
+/**
+ * usbtmc_uring.hpp - C++20 coroutine API for usbtmc devices on io_uring
+ *
+ * A usbtmc::Ring is a single threaded scheduler. Coroutines returning
+ * usbtmc::Task are started with spawn() and run() drives them: reads and
+ * writes on usbtmc devices are submitted to an io_uring, and the
+ * coroutine that awaits one is resumed from run() when it completes.
+ * One thread can so keep a request outstanding on every instrument of a
+ * rack, for example:
+ *
+ *	usbtmc::Task<void> measure(usbtmc::AsyncSession &dmm)
+ *	{
+ *		std::string_view value = co_await dmm.query("MEAS?");
+ *		...
+ *	}
+ *
+ *	usbtmc::Ring ring;
+ *	usbtmc::AsyncSession dmm(ring, 1);
+ *	ring.spawn(measure(dmm));
+ *	ring.run();
+ *
+ * The drivers have no non-blocking I/O, so the kernel completes each
+ * read or write in an io_uring worker thread; the application has one
+ * thread and no locking. The ring uses the system calls directly
+ * (Linux 5.6 or newer for IORING_OP_READ and _WRITE), without liburing.
+ *
+ * An AsyncSession keeps the buffers and read mode handling of a
+ * usbtmc::Session, whose ioctl methods are reached with session(). It
+ * runs one operation at a time: responses are views into its buffer,
+ * valid until its next operation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_URING_HPP
+#define __USBTMC_URING_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "usbtmc.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace usbtmc {
+
+template <class T> class Task;
+
+namespace detail {
+
+/* What the promises of Task<T> and Task<void> have in common */
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	/* Resume the awaiting coroutine, if any, when done */
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <class P>
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			if (h.promise().continuation)
+				return h.promise().continuation;
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <class T>
+struct Promise : PromiseBase {
+	T value{};
+
+	Task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} // namespace detail
+
+/*
+ * Coroutine result. A task starts when it is awaited (or spawned) and
+ * resumes its awaiter when it returns; exceptions travel along.
+ */
+template <class T>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit Task(handle_type h) : h_(h) {}
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	Task &operator=(Task &&other) noexcept
+	{
+		if (this != &other) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(other.h_, nullptr);
+		}
+		return *this;
+	}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> h)
+	{
+		h_.promise().continuation = h;
+		return h_;
+	}
+
+	T await_resume() { return h_.promise().result(); }
+
+	handle_type release() { return std::exchange(h_, nullptr); }
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+
+template <class T>
+inline Task<T> Promise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(
+		*this));
+}
+
+} // namespace detail
+
+class Ring {
+public:
+	explicit Ring(unsigned int entries = 64);
+	~Ring();
+
+	Ring(const Ring &) = delete;
+	Ring &operator=(const Ring &) = delete;
+
+	/* Start a task, run() finishes it */
+	void spawn(Task<void> task);
+
+	/*
+	 * Drive the spawned tasks until all have returned. The first
+	 * exception one of them threw is rethrown when all are done.
+	 */
+	void run();
+
+	/* co_await ring.read(...) or write(...): the result of the call */
+	struct Operation {
+		Ring &ring;
+		std::uint8_t opcode;
+		int fd;
+		void *buf;
+		unsigned int len;
+		int result = 0;
+		std::coroutine_handle<> waiter;
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			waiter = h;
+			ring.queue(this);
+		}
+		int await_resume() const noexcept { return result; }
+	};
+
+	Operation read(int fd, void *buf, unsigned int len);
+	Operation write(int fd, const void *buf, unsigned int len);
+
+private:
+	void queue(Operation *op);
+	void enter(unsigned int min_complete);
+	void complete();
+	void reap_tasks();
+	void release() noexcept;
+
+	int fd_ = -1;
+	unsigned int pending_ = 0;	/* queued, not yet submitted */
+	unsigned int in_flight_ = 0;	/* submitted, not yet completed */
+
+	void *sq_map_ = nullptr;
+	std::size_t sq_map_size_ = 0;
+	void *cq_map_ = nullptr;
+	std::size_t cq_map_size_ = 0;
+	io_uring_sqe *sqes_ = nullptr;
+	std::size_t sqes_size_ = 0;
+
+	unsigned int *sq_head_;
+	unsigned int *sq_tail_;
+	unsigned int *sq_mask_;
+	unsigned int *sq_entries_;
+	unsigned int *sq_array_;
+	unsigned int *cq_head_;
+	unsigned int *cq_tail_;
+	unsigned int *cq_mask_;
+	io_uring_cqe *cqes_;
+
+	std::vector<std::coroutine_handle<detail::Promise<void>>> tasks_;
+	std::exception_ptr error_;
+};
+
+class AsyncSession {
+public:
+	AsyncSession(Ring &ring, int minor,
+		     std::size_t buffer_size = Session::default_buffer_size);
+	AsyncSession(Ring &ring, const std::string &path,
+		     std::size_t buffer_size = Session::default_buffer_size);
+
+	/* The blocking session on the same fd, for its ioctl methods */
+	Session &session() { return session_; }
+
+	/* As in usbtmc::Session, but awaitable */
+	Task<void> write(std::string_view message);
+	Task<std::string_view> read();
+	Task<std::string_view> query(std::string_view command);
+	Task<std::string_view> read_block(std::string_view command);
+
+private:
+	Ring &ring_;
+	Session session_;
+};
+
+} // namespace usbtmc
+
+#endif /* __USBTMC_URING_HPP */
@@ -0,0 +1,519 @@
+/**
+ * usbtmc_usbfs.cpp - USBTMC over usbfs, without a kernel driver
+ *
+ * See usbtmc_usbfs.hpp.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#include "usbtmc_usbfs.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+
+#include "../agilent/usbtmc.h"
+
+/* What usbtmc_msg.h takes from the kernel */
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint32_t __le32;
+#define __packed		__attribute__((packed))
+#define cpu_to_le32(x)		htole32(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#define min(x, y)		((x) < (y) ? (x) : (y))
+
+#include "../kernel/usbtmc_msg.h"
+
+#undef min
+#undef roundup
+
+namespace usbtmc {
+
+/* Interface class and subclass of USBTMC, section 4.2.1.1 */
+static constexpr unsigned char usbtmc_class = 0xfe;
+static constexpr unsigned char usbtmc_subclass = 0x03;
+
+/* Class specific request to the interface, device to host */
+static constexpr unsigned char usbtmc_request_type = 0xa1;
+
+[[noreturn]] static void fail(const char *what)
+{
+	throw std::system_error(errno, std::system_category(), what);
+}
+
+UsbfsSession::UsbfsSession(const std::string &path, std::size_t buffer_size,
+			   unsigned int timeout_ms)
+	: timeout_ms_(timeout_ms),
+	  buffer_size_((buffer_size + urb_size - 1) / urb_size * urb_size),
+	  urbs_(new usbdevfs_urb[max_urbs]())
+{
+	fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd_ < 0)
+		fail(path.c_str());
+
+	try {
+		find_interface();
+		claim();
+		map_buffers();
+	} catch (...) {
+		close();
+		throw;
+	}
+}
+
+UsbfsSession::~UsbfsSession()
+{
+	close();
+}
+
+/*
+ * Reading a usbfs node returns the device descriptor followed by the
+ * configuration descriptors. The USBTMC interface and its bulk
+ * endpoints are taken from the first configuration that has one.
+ */
+void UsbfsSession::find_interface()
+{
+	unsigned char desc[4096];
+	bool in_usbtmc = false;
+	ssize_t len;
+	ssize_t i;
+
+	len = ::read(fd_, desc, sizeof(desc));
+	if (len < 0)
+		fail("usbfs descriptors");
+
+	for (i = 0; i + 2 <= len && desc[i] >= 2; i += desc[i]) {
+		if (i + desc[i] > len)
+			break;
+		switch (desc[i + 1]) {
+		case 2:		/* configuration */
+			if (ep_in_ && ep_out_)
+				return;
+			in_usbtmc = false;
+			break;
+		case 4:		/* interface */
+			if (ep_in_ && ep_out_)
+				return;
+			in_usbtmc = desc[i] >= 9 && desc[i + 3] == 0 &&
+				    desc[i + 5] == usbtmc_class &&
+				    desc[i + 6] == usbtmc_subclass;
+			if (in_usbtmc) {
+				ifno_ = desc[i + 2];
+				ep_in_ = ep_out_ = 0;
+			}
+			break;
+		case 5:		/* endpoint */
+			if (!in_usbtmc || desc[i] < 7 ||
+			    (desc[i + 3] & 3) != 2)
+				break;
+			if (desc[i + 2] & 0x80)
+				ep_in_ = desc[i + 2];
+			else
+				ep_out_ = desc[i + 2];
+			max_packet_ = (desc[i + 4] | desc[i + 5] << 8) & 0x7ff;
+			break;
+		}
+	}
+
+	if (!ep_in_ || !ep_out_) {
+		errno = ENODEV;
+		fail("usbfs: no USBTMC interface");
+	}
+	if (!max_packet_ || urb_size % max_packet_) {
+		errno = EINVAL;
+		fail("usbfs: odd wMaxPacketSize");
+	}
+}
+
+void UsbfsSession::claim()
+{
+	struct usbdevfs_ioctl command = {
+		static_cast<int>(ifno_), USBDEVFS_DISCONNECT, nullptr
+	};
+
+	/* Fails with ENODATA if no driver is bound */
+	if (::ioctl(fd_, USBDEVFS_IOCTL, &command) == 0)
+		detached_ = true;
+	if (::ioctl(fd_, USBDEVFS_CLAIMINTERFACE, &ifno_) < 0)
+		fail("usbfs claim");
+	claimed_ = true;
+}
+
+/*
+ * usbfs can map memory the host controller reaches directly (since
+ * Linux 4.6). URBs whose buffer lies in it skip the bounce buffer. On
+ * older kernels, or past usbfs_memory_mb, plain memory is used.
+ */
+void UsbfsSession::map_buffers()
+{
+	void *map;
+
+	map = mmap(nullptr, 2 * buffer_size_, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd_, 0);
+	if (map != MAP_FAILED) {
+		mapped_ = true;
+		in_ = static_cast<unsigned char *>(map);
+	} else {
+		in_ = new unsigned char[2 * buffer_size_];
+	}
+	out_ = in_ + buffer_size_;
+}
+
+void UsbfsSession::close() noexcept
+{
+	struct usbdevfs_ioctl command = {
+		static_cast<int>(ifno_), USBDEVFS_CONNECT, nullptr
+	};
+
+	if (mapped_)
+		munmap(in_, 2 * buffer_size_);
+	else
+		delete[] in_;
+	in_ = out_ = nullptr;
+	mapped_ = false;
+
+	if (fd_ < 0)
+		return;
+	if (claimed_)
+		::ioctl(fd_, USBDEVFS_RELEASEINTERFACE, &ifno_);
+	if (detached_)
+		::ioctl(fd_, USBDEVFS_IOCTL, &command);
+	::close(fd_);
+	fd_ = -1;
+}
+
+/* Next completed URB, nullptr with errno set on error or timeout */
+usbdevfs_urb *UsbfsSession::reap()
+{
+	struct pollfd pfd = { fd_, POLLOUT, 0 };
+	void *urb;
+	int n;
+
+	for (;;) {
+		if (::ioctl(fd_, USBDEVFS_REAPURBNDELAY, &urb) == 0)
+			return static_cast<usbdevfs_urb *>(urb);
+		if (errno != EAGAIN)
+			return nullptr;
+		n = poll(&pfd, 1, timeout_ms_ ? static_cast<int>(timeout_ms_) :
+			 -1);
+		if (!n) {
+			errno = ETIMEDOUT;
+			return nullptr;
+		}
+		if (n < 0 && errno != EINTR)
+			return nullptr;
+	}
+}
+
+/* Cancel count URBs from urbs_[head] on and wait until they are back */
+void UsbfsSession::discard(unsigned int head, unsigned int count)
+{
+	void *urb;
+
+	for (unsigned int i = 0; i < count; i++)
+		::ioctl(fd_, USBDEVFS_DISCARDURB, &urbs_[(head + i) % max_urbs]);
+	for (unsigned int i = 0; i < count; i++)
+		if (::ioctl(fd_, USBDEVFS_REAPURB, &urb) < 0)
+			break;
+}
+
+/*
+ * Move len bytes at buf through a bulk endpoint as one transfer, with up
+ * to max_urbs URBs in flight, and return the number of bytes moved. An
+ * in transfer ends at the first short URB: it fails with EREMOTEIO
+ * because of USBDEVFS_URB_SHORT_NOT_OK, the kernel then cancels the URBs
+ * queued behind it and refuses further continuation URBs.
+ */
+std::size_t UsbfsSession::bulk(unsigned char ep, unsigned char *buf,
+			       std::size_t len)
+{
+	std::size_t submitted = 0;
+	std::size_t done = 0;
+	unsigned int head = 0;
+	unsigned int in_flight = 0;
+	bool ended = false;
+	usbdevfs_urb *urb;
+	unsigned int halted;
+	int status;
+
+	for (;;) {
+		while (!ended && in_flight < max_urbs && submitted < len) {
+			urb = &urbs_[(head + in_flight) % max_urbs];
+			std::memset(urb, 0, sizeof(*urb));
+			urb->type = USBDEVFS_URB_TYPE_BULK;
+			urb->endpoint = ep;
+			urb->buffer = buf + submitted;
+			urb->buffer_length = std::min(urb_size,
+						      len - submitted);
+			if (ep & 0x80)
+				urb->flags = USBDEVFS_URB_SHORT_NOT_OK |
+					(submitted ?
+					 USBDEVFS_URB_BULK_CONTINUATION : 0);
+			if (::ioctl(fd_, USBDEVFS_SUBMITURB, urb) < 0) {
+				if (errno == EREMOTEIO && submitted) {
+					ended = true;
+					break;
+				}
+				status = errno;
+				discard(head, in_flight);
+				errno = status;
+				fail("usbfs submit");
+			}
+			submitted += urb->buffer_length;
+			in_flight++;
+		}
+		if (!in_flight)
+			return done;
+
+		urb = reap();
+		if (!urb) {
+			status = errno;
+			discard(head, in_flight);
+			errno = status;
+			fail("usbfs reap");
+		}
+		head = (head + 1) % max_urbs;
+		in_flight--;
+
+		if (!urb->status) {
+			done += urb->actual_length;
+			if (urb->actual_length < urb->buffer_length)
+				ended = true;
+		} else if (urb->status == -EREMOTEIO) {
+			done += urb->actual_length;
+			ended = true;
+		} else if (!ended || (urb->status != -ECONNRESET &&
+				      urb->status != -ENOENT)) {
+			status = -urb->status;
+			discard(head, in_flight);
+			if (status == EPIPE) {
+				halted = ep;
+				::ioctl(fd_, USBDEVFS_CLEAR_HALT, &halted);
+			}
+			errno = status;
+			fail("usbfs transfer");
+		}
+	}
+}
+
+/* One DEV_DEP_MSG_OUT transfer per buffer_size_ bytes, EOM on the last */
+void UsbfsSession::write(std::string_view message)
+{
+	bool newline = message.empty() || message.back() != '\n';
+	std::size_t len = message.size() + newline;
+	std::size_t max = buffer_size_ - USBTMC_HEADER_SIZE - 3;
+	std::size_t done = 0;
+	std::size_t chunk;
+	std::size_t copy;
+	std::size_t size;
+	bool eom;
+
+	do {
+		chunk = std::min(len - done, max);
+		eom = done + chunk == len;
+		copy = done < message.size() ?
+		       std::min(chunk, message.size() - done) : 0;
+
+		usbtmc_msg_out(reinterpret_cast<usbtmc_bulk_header *>(out_),
+			       bTag_, chunk, eom);
+		std::memcpy(out_ + USBTMC_HEADER_SIZE, message.data() + done,
+			    copy);
+		if (copy < chunk)
+			out_[USBTMC_HEADER_SIZE + copy] = '\n';
+		size = usbtmc_msg_transfer_size(chunk);
+		std::memset(out_ + USBTMC_HEADER_SIZE + chunk, 0,
+			    size - USBTMC_HEADER_SIZE - chunk);
+		bTag_ = usbtmc_msg_next_btag(bTag_);
+
+		if (bulk(ep_out_, out_, size) != size) {
+			errno = EIO;
+			fail("usbfs write");
+		}
+		done += chunk;
+	} while (done < len);
+}
+
+/*
+ * Each transfer of the response lands right behind the data of the one
+ * before: its header overwrites the last 12 bytes of that data, which
+ * are saved and put back, so the response ends up contiguous without
+ * being copied.
+ */
+std::string_view UsbfsSession::read()
+{
+	unsigned char saved[USBTMC_HEADER_SIZE];
+	struct usbtmc_bulk_header hdr;
+	std::size_t done = 0;
+	std::size_t len;
+	std::size_t n;
+	u32 ask;
+	u32 n_characters;
+	bool eom = false;
+
+	while (!eom) {
+		len = (buffer_size_ - done) / max_packet_ * max_packet_;
+		if (len <= USBTMC_HEADER_SIZE + 3) {
+			errno = EMSGSIZE;
+			fail("usbfs read");
+		}
+		ask = len - USBTMC_HEADER_SIZE - 3;
+
+		usbtmc_msg_request_in(reinterpret_cast<usbtmc_bulk_header *>
+				      (out_), bTag_, ask, false, 0);
+		bulk(ep_out_, out_, USBTMC_HEADER_SIZE);
+
+		std::memcpy(saved, in_ + done, sizeof(saved));
+		n = bulk(ep_in_, in_ + done, len);
+		std::memcpy(&hdr, in_ + done, sizeof(hdr));
+		std::memcpy(in_ + done, saved, sizeof(saved));
+
+		if (n < USBTMC_HEADER_SIZE ||
+		    hdr.MsgID != USBTMC_MSGID_DEV_DEP_MSG_IN ||
+		    hdr.bTag != bTag_ ||
+		    hdr.bTagInverse != static_cast<u8>(~bTag_)) {
+			bTag_ = usbtmc_msg_next_btag(bTag_);
+			errno = EPROTO;
+			fail("usbfs read");
+		}
+		bTag_ = usbtmc_msg_next_btag(bTag_);
+
+		usbtmc_msg_check_in(&hdr, n, ask, &n_characters, &eom);
+		done += n_characters;
+	}
+
+	return std::string_view(reinterpret_cast<char *>(in_) +
+				USBTMC_HEADER_SIZE, done);
+}
+
+std::string_view UsbfsSession::query(std::string_view command)
+{
+	std::string_view response;
+
+	write(command);
+	response = read();
+	if (!response.empty() && response.back() == '\n')
+		response.remove_suffix(1);
+	return response;
+}
+
+std::string_view UsbfsSession::read_block()
+{
+	return block_data(read());
+}
+
+std::string_view UsbfsSession::read_block(std::string_view command)
+{
+	write(command);
+	return block_data(read());
+}
+
+int UsbfsSession::control(unsigned char request, unsigned char *data,
+			  unsigned short len)
+{
+	struct usbdevfs_ctrltransfer ctrl = {};
+	int n;
+
+	ctrl.bRequestType = usbtmc_request_type;
+	ctrl.bRequest = request;
+	ctrl.wIndex = ifno_;
+	ctrl.wLength = len;
+	ctrl.timeout = timeout_ms_;
+	ctrl.data = data;
+
+	n = ::ioctl(fd_, USBDEVFS_CONTROL, &ctrl);
+	if (n < 0)
+		fail("usbfs control");
+	if (n < 1 || data[0] != USBTMC_STATUS_SUCCESS) {
+		errno = EIO;
+		fail("usbfs control");
+	}
+	return n;
+}
+
+Capabilities UsbfsSession::capabilities()
+{
+	unsigned char caps[0x18];
+
+	if (control(USBTMC_REQUEST_GET_CAPABILITIES, caps, sizeof(caps)) <
+	    16) {
+		errno = EPROTO;
+		fail("usbfs getcaps");
+	}
+	return Capabilities{ caps[4], caps[5], caps[14], caps[15] };
+}
+
+void UsbfsSession::indicator_pulse()
+{
+	unsigned char status;
+
+	control(USBTMC_REQUEST_INDICATOR_PULSE, &status, 1);
+}
+
+/*
+ * INITIATE_CLEAR, then CHECK_CLEAR_STATUS until the device is done,
+ * emptying the bulk in endpoint when it asks for it (bmClear), and
+ * finally CLEAR_FEATURE(ENDPOINT_HALT) on bulk out, as in section
+ * 4.2.1.6 of the specification.
+ */
+void UsbfsSession::clear()
+{
+	unsigned char status[2];
+	struct usbdevfs_ctrltransfer ctrl = {};
+	unsigned int ep = ep_out_;
+	int n;
+
+	control(USBTMC_REQUEST_INITIATE_CLEAR, status, 1);
+
+	ctrl.bRequestType = usbtmc_request_type;
+	ctrl.bRequest = USBTMC_REQUEST_CHECK_CLEAR_STATUS;
+	ctrl.wIndex = ifno_;
+	ctrl.wLength = sizeof(status);
+	ctrl.timeout = timeout_ms_;
+	ctrl.data = status;
+	for (;;) {
+		n = ::ioctl(fd_, USBDEVFS_CONTROL, &ctrl);
+		if (n < 0)
+			fail("usbfs clear");
+		if (n < 2) {
+			errno = EPROTO;
+			fail("usbfs clear");
+		}
+		if (status[0] != USBTMC_STATUS_PENDING)
+			break;
+		if (status[1] & 1)
+			bulk(ep_in_, in_, urb_size);
+		else
+			usleep(1000);
+	}
+	if (status[0] != USBTMC_STATUS_SUCCESS) {
+		errno = EIO;
+		fail("usbfs clear");
+	}
+
+	if (::ioctl(fd_, USBDEVFS_CLEAR_HALT, &ep) < 0)
+		fail("usbfs clear halt");
+}
+
+} // namespace usbtmc
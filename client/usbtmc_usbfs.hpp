@@ -0,0 +1,114 @@
+/**
+ * usbtmc_usbfs.hpp - USBTMC over usbfs, without a kernel driver
+ *
+ * A usbtmc::UsbfsSession talks USBTMC to a device through its usbfs node
+ * /dev/bus/usb/BBB/DDD, for machines where neither driver can be loaded.
+ * It claims the USBTMC interface (detaching a bound kernel driver, which
+ * is reattached when the session ends) and does the framing of
+ * usbtmc_read() and usbtmc_write() itself, with the helpers of
+ * ../kernel/usbtmc_msg.h.
+ *
+ * Transfers are split into URBs of urb_size bytes and up to max_urbs of
+ * them are kept in flight, so the host controller never waits for user
+ * space within a transfer. The bulk in URBs of one transfer are chained
+ * with USBDEVFS_URB_BULK_CONTINUATION: the short packet ending the
+ * transfer makes the kernel cancel the rest. The buffers are mapped from
+ * usbfs where the kernel allows it, so that the device reads and writes
+ * them directly, without the copy through a kernel bounce buffer; a
+ * response is returned in place, as a view into the session's buffer,
+ * and the data of a write is copied once, next to its header.
+ *
+ * The message API is the one of usbtmc::Session, so code can be written
+ * against either (see usbtmc_client_bench.cpp). A response longer than
+ * the buffer fails with EMSGSIZE and leaves the rest of it on the
+ * device, use clear() then.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#ifndef __USBTMC_USBFS_HPP
+#define __USBTMC_USBFS_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "usbtmc.hpp"
+
+struct usbdevfs_urb;
+
+namespace usbtmc {
+
+class UsbfsSession {
+public:
+	/* Largest message, in either direction */
+	static constexpr std::size_t default_buffer_size = 1024 * 1024;
+	static constexpr std::size_t urb_size = 16 * 1024;
+	static constexpr unsigned int max_urbs = 16;
+
+	explicit UsbfsSession(const std::string &path,
+			      std::size_t buffer_size = default_buffer_size,
+			      unsigned int timeout_ms = 5000);
+	~UsbfsSession();
+
+	UsbfsSession(const UsbfsSession &) = delete;
+	UsbfsSession &operator=(const UsbfsSession &) = delete;
+
+	int fd() const { return fd_; }
+	bool mapped() const { return mapped_; }
+
+	/* As in usbtmc::Session */
+	void write(std::string_view message);
+	std::string_view read();
+	std::string_view query(std::string_view command);
+	std::string_view read_block();
+	std::string_view read_block(std::string_view command);
+
+	/* Class specific control requests of the USBTMC interface */
+	Capabilities capabilities();
+	void indicator_pulse();
+	void clear();
+
+private:
+	void find_interface();
+	void claim();
+	void map_buffers();
+	std::size_t bulk(unsigned char ep, unsigned char *buf,
+			 std::size_t len);
+	usbdevfs_urb *reap();
+	void discard(unsigned int head, unsigned int count);
+	int control(unsigned char request, unsigned char *data,
+		    unsigned short len);
+	void close() noexcept;
+
+	int fd_ = -1;
+	unsigned int timeout_ms_;
+	unsigned int ifno_ = 0;
+	unsigned char ep_in_ = 0;
+	unsigned char ep_out_ = 0;
+	unsigned int max_packet_ = 512;
+	unsigned char bTag_ = 1;
+	bool claimed_ = false;
+	bool detached_ = false;		/* kernel driver to reattach */
+	bool mapped_ = false;
+	std::size_t buffer_size_;
+	unsigned char *in_ = nullptr;
+	unsigned char *out_ = nullptr;
+	std::unique_ptr<usbdevfs_urb[]> urbs_;
+};
+
+} // namespace usbtmc
+
+#endif /* __USBTMC_USBFS_HPP */
@@ -0,0 +1,1316 @@
+/**
+ * usbtmc_emu.c - USBTMC/USB488 instrument emulator on FunctionFS
+ *
+ * This program is the device side of a USBTMC instrument. It runs on a
+ * USB gadget built with configfs and FunctionFS, normally on dummy_hcd,
+ * so that kernel/usbtmc.c and the agilent driver can be exercised and
+ * benchmarked without an instrument. See usbtmc_gadget.sh for the setup.
+ *
+ * The emulator implements DEV_DEP_MSG_OUT, REQUEST_DEV_DEP_MSG_IN and
+ * DEV_DEP_MSG_IN with TermChar, the USBTMC and USB488 control requests
+ * and SRQ notifications on the interrupt in endpoint. It understands a
+ * small set of IEEE 488.2 style commands:
+ *
+ *	*IDN? *RST *CLS *TST? *OPC *OPC? *WAI
+ *	*ESE <n> *ESE? *ESR? *SRE <n> *SRE? *STB?
+ *	DATA? [<n>]		answer with a definite length block of n bytes
+ *	DATA <block>		accept a definite length block (AWG upload)
+ *	EMU:LATENCY <us>	delay before each bulk in transfer
+ *	EMU:OPDELAY <ms>	duration of an operation for *OPC and *OPC?
+ *	EMU:PAYLOAD <n>		default block size of DATA?
+ *	EMU:MAXTRANSFER <n>	message bytes per bulk in transfer
+ *	EMU:FAULT <fault>[,<n>]	inject a fault, see below
+ *	EMU:BTAG?		bTag of the transfer carrying this query
+ *
+ * As in IEEE 488.2, the responses to the queries of one message form one
+ * response message: joined with ';' and ended by a single newline.
+ *
+ * Faults are armed with EMU:FAULT and hit the next bulk in transfer,
+ * except for PENDING which applies to the following CHECK_*_STATUS
+ * requests:
+ *
+ *	STALL		halt the bulk in endpoint instead of answering
+ *	NAK,<ms>	NAK the bulk in endpoint for ms milliseconds (100)
+ *	TRUNCATE	send only half of the announced payload
+ *	SIZE,<n>	announce n more bytes than are sent (16)
+ *	BTAG		answer with a bTag that does not match the request
+ *	PENDING,<n>	answer the next n status checks with STATUS_PENDING
+ *	VANISH		exit in the middle of the transfer
+ *	NONE		disarm
+ *
+ * With -r, the emulator replays a session recorded by libusbtmc_prof.so
+ * (see ../bench/usbtmc_trace.h) instead: each message is answered with
+ * the data of the reads that followed the same write in the trace, after
+ * the recorded think time. That is the time from the end of the write to
+ * the end of the first read, so it includes the host time before the read
+ * and one bus round trip of the recording. Once the trace is used up, the
+ * commands above are answered again.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * The GNU General Public License is available at
+ * http://www.gnu.org/copyleft/gpl.html.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include "../bench/usbtmc_trace.h"
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x)	(x)
+#define cpu_to_le32(x)	(x)
+#else
+#define cpu_to_le16(x)	__bswap_constant_16(x)
+#define cpu_to_le32(x)	__bswap_constant_32(x)
+#endif
+
+/* USBTMC control requests and status values, see USBTMC 1.0 table 15/16 */
+#define USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT		1
+#define USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS	2
+#define USBTMC_REQUEST_INITIATE_ABORT_BULK_IN		3
+#define USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS	4
+#define USBTMC_REQUEST_INITIATE_CLEAR			5
+#define USBTMC_REQUEST_CHECK_CLEAR_STATUS		6
+#define USBTMC_REQUEST_GET_CAPABILITIES			7
+#define USBTMC_REQUEST_INDICATOR_PULSE			64
+#define USB488_REQUEST_READ_STATUS_BYTE			128
+#define USB488_REQUEST_REN_CONTROL			160
+#define USB488_REQUEST_GOTO_LOCAL			161
+#define USB488_REQUEST_LOCAL_LOCKOUT			162
+
+#define USBTMC_STATUS_SUCCESS				0x01
+#define USBTMC_STATUS_PENDING				0x02
+#define USBTMC_STATUS_FAILED				0x80
+#define USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS		0x81
+
+/* Bulk message IDs */
+#define USBTMC_MSGID_DEV_DEP_MSG_OUT			1
+#define USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN		2
+#define USBTMC_MSGID_DEV_DEP_MSG_IN			2
+
+/* IEEE 488.2 status byte and event status register bits */
+#define STB_MAV		0x10
+#define STB_ESB		0x20
+#define STB_MSS		0x40
+#define ESR_OPC		0x01
+#define ESR_EXE		0x10
+#define ESR_CME		0x20
+
+#define EMU_IDN		"EMULATOR,USBTMC-EMU,0,1.0"
+#define EMU_INTERFACE	"USBTMC emulator"
+#define EMU_NOTIFY_MAX	16
+
+/* Faults armed with EMU:FAULT */
+enum emu_fault {
+	EMU_FAULT_NONE,
+	EMU_FAULT_STALL,
+	EMU_FAULT_NAK,
+	EMU_FAULT_TRUNCATE,
+	EMU_FAULT_SIZE,
+	EMU_FAULT_BTAG,
+	EMU_FAULT_VANISH,
+};
+
+static const struct {
+	const char *name;
+	enum emu_fault fault;
+	unsigned int def;	/* default argument */
+} emu_faults[] = {
+	{ "NONE",	EMU_FAULT_NONE,		0 },
+	{ "STALL",	EMU_FAULT_STALL,	0 },
+	{ "NAK",	EMU_FAULT_NAK,		100 },
+	{ "TRUNCATE",	EMU_FAULT_TRUNCATE,	0 },
+	{ "SIZE",	EMU_FAULT_SIZE,		16 },
+	{ "BTAG",	EMU_FAULT_BTAG,		0 },
+	{ "VANISH",	EMU_FAULT_VANISH,	0 },
+};
+
+/* Endpoint files, in the order of the descriptors */
+#define EMU_EP_BULK_OUT	1
+#define EMU_EP_BULK_IN	2
+#define EMU_EP_INT_IN	3
+
+struct emu_descs {
+	struct usb_interface_descriptor intf;
+	struct usb_endpoint_descriptor_no_audio bulk_out;
+	struct usb_endpoint_descriptor_no_audio bulk_in;
+	struct usb_endpoint_descriptor_no_audio int_in;
+} __attribute__((packed));
+
+#define EMU_DESCS(bulk_size, interval) {				\
+	.intf = {							\
+		.bLength = sizeof(struct usb_interface_descriptor),	\
+		.bDescriptorType = USB_DT_INTERFACE,			\
+		.bNumEndpoints = 3,					\
+		.bInterfaceClass = USB_CLASS_APP_SPEC,			\
+		.bInterfaceSubClass = 3,				\
+		.bInterfaceProtocol = 1,				\
+		.iInterface = 1,					\
+	},								\
+	.bulk_out = {							\
+		.bLength = USB_DT_ENDPOINT_SIZE,			\
+		.bDescriptorType = USB_DT_ENDPOINT,			\
+		.bEndpointAddress = 1 | USB_DIR_OUT,			\
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,			\
+		.wMaxPacketSize = cpu_to_le16(bulk_size),		\
+	},								\
+	.bulk_in = {							\
+		.bLength = USB_DT_ENDPOINT_SIZE,			\
+		.bDescriptorType = USB_DT_ENDPOINT,			\
+		.bEndpointAddress = 2 | USB_DIR_IN,			\
+		.bmAttributes = USB_ENDPOINT_XFER_BULK,			\
+		.wMaxPacketSize = cpu_to_le16(bulk_size),		\
+	},								\
+	.int_in = {							\
+		.bLength = USB_DT_ENDPOINT_SIZE,			\
+		.bDescriptorType = USB_DT_ENDPOINT,			\
+		.bEndpointAddress = 3 | USB_DIR_IN,			\
+		.bmAttributes = USB_ENDPOINT_XFER_INT,			\
+		.wMaxPacketSize = cpu_to_le16(8),			\
+		.bInterval = interval,					\
+	},								\
+}
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	__le32 fs_count;
+	__le32 hs_count;
+	struct emu_descs fs_descs;
+	struct emu_descs hs_descs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC |
+				     FUNCTIONFS_HAS_HS_DESC),
+		.length = cpu_to_le32(sizeof(descriptors)),
+	},
+	.fs_count = cpu_to_le32(4),
+	.hs_count = cpu_to_le32(4),
+	.fs_descs = EMU_DESCS(64, 1),
+	.hs_descs = EMU_DESCS(512, 4),
+};
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		__le16 code;
+		const char str1[sizeof(EMU_INTERFACE)];
+	} __attribute__((packed)) lang0;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang0 = {
+		cpu_to_le16(0x0409),
+		EMU_INTERFACE,
+	},
+};
+
+/* Growing byte buffer */
+struct emu_buf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+struct emu {
+	/* settings, changed with options or EMU: commands */
+	unsigned int latency_us;
+	unsigned int op_delay_ms;
+	unsigned int payload;
+	unsigned int max_transfer;
+	int verbose;
+
+	int ep0;
+	int ep[4];
+	unsigned int mps_out;
+	unsigned int mps_in;
+
+	pthread_mutex_t lock;	/* everything below */
+	pthread_cond_t cond;	/* wakes up emu_notify_thread() */
+
+	/* input message being collected by the bulk thread */
+	struct emu_buf msg;
+	bool input_reset;	/* set by clear and abort bulk out */
+
+	/* response waiting to be read by the host */
+	struct emu_buf resp;
+	size_t resp_pos;
+
+	/* transfer bookkeeping for the abort requests */
+	uint8_t bTag_out;
+	uint8_t bTag_in;
+	bool in_progress;	/* bulk in write pending */
+	uint32_t nbytes_rxd;
+	uint32_t nbytes_txd;
+
+	/* IEEE 488.2 status reporting */
+	uint8_t esr;
+	uint8_t ese;
+	uint8_t sre;
+	bool rqs;		/* requesting service, until serial poll */
+	bool service;		/* last state of the service request summary */
+	bool opc_pending;
+	struct timespec opc_time;
+
+	/* fault injection */
+	enum emu_fault fault;	/* armed for the next bulk in transfer */
+	unsigned int fault_arg;
+	unsigned int pending_polls;
+
+	/* trace replay, next record to look at, NULL when used up */
+	const struct usbtmc_trace_rec *trace_pos;
+	const void *trace_end;
+	unsigned int trace_channel;
+
+	/* notifications for the interrupt in endpoint */
+	uint8_t notify[EMU_NOTIFY_MAX][2];
+	unsigned int notify_head;
+	unsigned int notify_count;
+};
+
+static void emu_log(struct emu *e, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!e->verbose)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+static void emu_buf_append(struct emu_buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		b->data = realloc(b->data, b->size);
+		if (!b->data) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void emu_printf(struct emu_buf *b, const char *fmt, ...)
+{
+	char line[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	emu_buf_append(b, line, n);
+}
+
+static void emu_timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Halt an endpoint: FunctionFS does so on I/O in the wrong direction */
+static void emu_halt(int fd, bool in)
+{
+	char dummy;
+
+	if (in)
+		(void)!read(fd, &dummy, 0);
+	else
+		(void)!write(fd, &dummy, 0);
+}
+
+/* Called with lock held */
+static void emu_notify(struct emu *e, uint8_t notify1, uint8_t notify2)
+{
+	unsigned int n;
+
+	if (e->notify_count == EMU_NOTIFY_MAX) {
+		emu_log(e, "notification queue full\n");
+		return;
+	}
+
+	n = (e->notify_head + e->notify_count) % EMU_NOTIFY_MAX;
+	e->notify[n][0] = notify1;
+	e->notify[n][1] = notify2;
+	e->notify_count++;
+	pthread_cond_signal(&e->cond);
+}
+
+/* Status byte without MSS/RQS. Called with lock held */
+static uint8_t emu_stb(struct emu *e)
+{
+	uint8_t stb = 0;
+
+	if (e->esr & e->ese)
+		stb |= STB_ESB;
+	if (e->resp_pos < e->resp.len)
+		stb |= STB_MAV;
+	return stb;
+}
+
+/*
+ * Request service when the summary of the enabled status bits becomes
+ * true. Called with lock held after every change of the status.
+ */
+static void emu_status_changed(struct emu *e)
+{
+	uint8_t stb = emu_stb(e);
+	bool service = stb & e->sre & ~STB_MSS;
+
+	if (service && !e->service) {
+		e->rqs = true;
+		emu_log(e, "SRQ, status byte %02x\n", stb | STB_MSS);
+		emu_notify(e, 0x81, stb | STB_MSS);
+	}
+	e->service = service;
+}
+
+/*
+ * Parse the next program message unit at *pos. Units are separated by
+ * ';' or newlines; definite length blocks (#<n><len><bytes>) in the
+ * arguments may contain any byte.
+ */
+static bool emu_next_unit(const unsigned char *msg, size_t len, size_t *pos,
+			  const char **hdr, size_t *hdr_len,
+			  const unsigned char **arg, size_t *arg_len)
+{
+	size_t p = *pos;
+	size_t start;
+	size_t digits;
+	size_t block;
+	size_t i;
+
+	while (p < len && (msg[p] == ';' || msg[p] == '\n' || msg[p] == ' ' ||
+			   msg[p] == '\r' || msg[p] == '\t'))
+		p++;
+	if (p == len)
+		return false;
+
+	start = p;
+	while (p < len && msg[p] != ' ' && msg[p] != ';' && msg[p] != '\n')
+		p++;
+	*hdr = (const char *)msg + start;
+	*hdr_len = p - start;
+
+	while (p < len && msg[p] == ' ')
+		p++;
+	start = p;
+
+	while (p < len && msg[p] != ';' && msg[p] != '\n') {
+		if (msg[p] == '#' && p + 1 < len &&
+		    msg[p + 1] >= '1' && msg[p + 1] <= '9') {
+			digits = msg[p + 1] - '0';
+			block = 0;
+			for (i = 0; i < digits && p + 2 + i < len; i++)
+				block = block * 10 + msg[p + 2 + i] - '0';
+			p += 2 + digits + block;
+			if (p > len)
+				p = len;
+			continue;
+		}
+		p++;
+	}
+
+	*arg = msg + start;
+	*arg_len = p - start;
+	*pos = p;
+	return true;
+}
+
+static bool emu_is(const char *hdr, size_t hdr_len, const char *name)
+{
+	return strlen(name) == hdr_len && !strncasecmp(hdr, name, hdr_len);
+}
+
+static unsigned long emu_arg_num(const unsigned char *arg, size_t arg_len,
+				 unsigned long def)
+{
+	char num[32];
+
+	if (!arg_len || arg_len >= sizeof(num))
+		return def;
+	memcpy(num, arg, arg_len);
+	num[arg_len] = 0;
+	return strtoul(num, NULL, 0);
+}
+
+static void emu_sleep_ms(unsigned int ms)
+{
+	if (ms)
+		usleep(ms * 1000);
+}
+
+/* EMU:FAULT <name>[,<n>]. Called with lock held */
+static void emu_arm_fault(struct emu *e, const unsigned char *arg,
+			  size_t arg_len)
+{
+	const unsigned char *comma = memchr(arg, ',', arg_len);
+	size_t name_len = comma ? (size_t)(comma - arg) : arg_len;
+	unsigned int i;
+
+	if (emu_is((const char *)arg, name_len, "PENDING")) {
+		e->pending_polls = comma ?
+			emu_arg_num(comma + 1, arg_len - name_len - 1, 1) : 1;
+		emu_log(e, "fault: PENDING for %u polls\n", e->pending_polls);
+		return;
+	}
+
+	for (i = 0; i < sizeof(emu_faults) / sizeof(emu_faults[0]); i++)
+		if (emu_is((const char *)arg, name_len, emu_faults[i].name))
+			break;
+
+	if (i == sizeof(emu_faults) / sizeof(emu_faults[0])) {
+		emu_log(e, "unknown fault %.*s\n", (int)arg_len, arg);
+		e->esr |= ESR_CME;
+		return;
+	}
+
+	e->fault = emu_faults[i].fault;
+	e->fault_arg = comma ?
+		emu_arg_num(comma + 1, arg_len - name_len - 1,
+			    emu_faults[i].def) : emu_faults[i].def;
+	if (!e->fault)
+		e->pending_polls = 0;
+	emu_log(e, "fault: %s,%u\n", emu_faults[i].name, e->fault_arg);
+}
+
+static void emu_sleep_ns(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+/* Answer a message from the trace, false once it is used up */
+static bool emu_replay(struct emu *e, const unsigned char *msg, size_t len)
+{
+	const struct usbtmc_trace_rec *w = e->trace_pos;
+	const struct usbtmc_trace_rec *rec;
+	uint64_t think = 0;
+	bool first = true;
+
+	while (w && (w->channel != e->trace_channel ||
+		     w->op != USBTMC_TRACE_WRITE))
+		w = usbtmc_trace_next(w, e->trace_end);
+	e->trace_pos = w;
+	if (!w) {
+		fprintf(stderr, "usbtmc_emu: end of the trace\n");
+		return false;
+	}
+
+	if (w->len != len || memcmp(usbtmc_trace_data(w), msg, len))
+		fprintf(stderr, "usbtmc_emu: replay: got %.*s instead of "
+			"%.*s\n", (int)(len > 32 ? 32 : len), msg,
+			(int)(w->len > 32 ? 32 : w->len),
+			usbtmc_trace_data(w));
+
+	/* The response is made of the reads up to the next write */
+	for (rec = usbtmc_trace_next(w, e->trace_end); rec;
+	     rec = usbtmc_trace_next(rec, e->trace_end)) {
+		if (rec->channel != e->trace_channel)
+			continue;
+		if (rec->op == USBTMC_TRACE_WRITE)
+			break;
+		if (first && rec->start_ns + rec->ns > w->start_ns + w->ns)
+			think = rec->start_ns + rec->ns - w->start_ns - w->ns;
+		first = false;
+	}
+	e->trace_pos = rec;
+
+	emu_log(e, "replay: %.*s, think time %llu us\n",
+		(int)(len > 64 ? 64 : len), msg,
+		(unsigned long long)think / 1000);
+	emu_sleep_ns(think);
+
+	pthread_mutex_lock(&e->lock);
+	for (w = usbtmc_trace_next(w, e->trace_end); w != rec;
+	     w = usbtmc_trace_next(w, e->trace_end))
+		if (w->channel == e->trace_channel)
+			emu_buf_append(&e->resp, usbtmc_trace_data(w), w->len);
+	emu_status_changed(e);
+	pthread_mutex_unlock(&e->lock);
+	return true;
+}
+
+/* Start the response to a query, after those of earlier units */
+static void emu_response_unit(struct emu *e, bool *answered)
+{
+	if (*answered)
+		emu_buf_append(&e->resp, ";", 1);
+	*answered = true;
+}
+
+/* Execute one complete message, queueing its response message */
+static void emu_execute(struct emu *e, const unsigned char *msg, size_t len)
+{
+	const unsigned char *arg;
+	const char *hdr;
+	size_t hdr_len;
+	size_t arg_len;
+	size_t pos = 0;
+	unsigned long n;
+	unsigned long i;
+	char size[16];
+	unsigned char *block;
+	bool answered = false;
+
+	if (e->trace_pos && emu_replay(e, msg, len))
+		return;
+
+	emu_log(e, "message: %.*s\n", (int)(len > 64 ? 64 : len), msg);
+
+	while (emu_next_unit(msg, len, &pos, &hdr, &hdr_len, &arg, &arg_len)) {
+		/* Operations that take time run outside of the lock */
+		if (emu_is(hdr, hdr_len, "*OPC?") ||
+		    emu_is(hdr, hdr_len, "*WAI"))
+			emu_sleep_ms(e->op_delay_ms);
+
+		pthread_mutex_lock(&e->lock);
+
+		if (emu_is(hdr, hdr_len, "*IDN?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%s", EMU_IDN);
+		} else if (emu_is(hdr, hdr_len, "*RST")) {
+			e->opc_pending = false;
+		} else if (emu_is(hdr, hdr_len, "*CLS")) {
+			e->esr = 0;
+			e->rqs = false;
+			e->opc_pending = false;
+		} else if (emu_is(hdr, hdr_len, "*TST?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "0");
+		} else if (emu_is(hdr, hdr_len, "*OPC")) {
+			clock_gettime(CLOCK_MONOTONIC, &e->opc_time);
+			emu_timespec_add_ms(&e->opc_time, e->op_delay_ms);
+			e->opc_pending = true;
+			pthread_cond_signal(&e->cond);
+		} else if (emu_is(hdr, hdr_len, "*OPC?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "1");
+		} else if (emu_is(hdr, hdr_len, "*WAI")) {
+			/* done above */
+		} else if (emu_is(hdr, hdr_len, "*ESE")) {
+			e->ese = emu_arg_num(arg, arg_len, 0);
+		} else if (emu_is(hdr, hdr_len, "*ESE?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%u", e->ese);
+		} else if (emu_is(hdr, hdr_len, "*ESR?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%u", e->esr);
+			e->esr = 0;
+		} else if (emu_is(hdr, hdr_len, "*SRE")) {
+			e->sre = emu_arg_num(arg, arg_len, 0);
+		} else if (emu_is(hdr, hdr_len, "*SRE?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%u", e->sre);
+		} else if (emu_is(hdr, hdr_len, "*STB?")) {
+			n = emu_stb(e);
+			if (n & e->sre)
+				n |= STB_MSS;
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%lu", n);
+		} else if (emu_is(hdr, hdr_len, "DATA?")) {
+			n = emu_arg_num(arg, arg_len, e->payload);
+			emu_response_unit(e, &answered);
+			block = malloc(n ? n : 1);
+			if (block) {
+				snprintf(size, sizeof(size), "%lu", n);
+				emu_printf(&e->resp, "#%zu%s", strlen(size),
+					   size);
+				for (i = 0; i < n; i++)
+					block[i] = i;
+				emu_buf_append(&e->resp, block, n);
+				free(block);
+			} else {
+				/* Too large: execution error, empty answer */
+				emu_log(e, "DATA? %lu: out of memory\n", n);
+				e->esr |= ESR_EXE;
+			}
+		} else if (emu_is(hdr, hdr_len, "DATA")) {
+			emu_log(e, "DATA block, %zu bytes\n", arg_len);
+		} else if (emu_is(hdr, hdr_len, "EMU:LATENCY")) {
+			e->latency_us = emu_arg_num(arg, arg_len, 0);
+		} else if (emu_is(hdr, hdr_len, "EMU:OPDELAY")) {
+			e->op_delay_ms = emu_arg_num(arg, arg_len, 0);
+		} else if (emu_is(hdr, hdr_len, "EMU:PAYLOAD")) {
+			e->payload = emu_arg_num(arg, arg_len, e->payload);
+		} else if (emu_is(hdr, hdr_len, "EMU:MAXTRANSFER")) {
+			e->max_transfer = emu_arg_num(arg, arg_len,
+						      e->max_transfer);
+			if (!e->max_transfer)
+				e->max_transfer = 1;
+		} else if (emu_is(hdr, hdr_len, "EMU:FAULT")) {
+			emu_arm_fault(e, arg, arg_len);
+		} else if (emu_is(hdr, hdr_len, "EMU:BTAG?")) {
+			emu_response_unit(e, &answered);
+			emu_printf(&e->resp, "%u", e->bTag_out);
+		} else {
+			emu_log(e, "unknown command %.*s\n", (int)hdr_len, hdr);
+			e->esr |= ESR_CME;
+		}
+
+		emu_status_changed(e);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	/* One terminator for the whole response message */
+	if (answered) {
+		pthread_mutex_lock(&e->lock);
+		emu_buf_append(&e->resp, "\n", 1);
+		emu_status_changed(e);
+		pthread_mutex_unlock(&e->lock);
+	}
+}
+
+/* Answer a REQUEST_DEV_DEP_MSG_IN with one DEV_DEP_MSG_IN transfer */
+static void emu_send_response(struct emu *e, const unsigned char *req)
+{
+	uint32_t size = req[4] | req[5] << 8 | req[6] << 16 |
+			(uint32_t)req[7] << 24;
+	bool term_enabled = req[8] & 0x02;
+	unsigned char term = req[9];
+	unsigned char *buffer;
+	unsigned char *p;
+	enum emu_fault fault;
+	unsigned int fault_arg;
+	uint32_t announced;
+	size_t total;
+	size_t sent;
+	size_t n;
+	bool term_found = false;
+	bool eom;
+
+	pthread_mutex_lock(&e->lock);
+	fault = e->fault;
+	fault_arg = e->fault_arg;
+	e->fault = EMU_FAULT_NONE;
+	pthread_mutex_unlock(&e->lock);
+
+	if (e->latency_us)
+		usleep(e->latency_us);
+
+	/* Not answering is all it takes to NAK on the bus */
+	if (fault == EMU_FAULT_NAK) {
+		emu_log(e, "fault: NAK for %u ms\n", fault_arg);
+		emu_sleep_ms(fault_arg);
+	}
+
+	/* The response stays queued, the host has to clear it */
+	if (fault == EMU_FAULT_STALL) {
+		emu_log(e, "fault: stalling bulk in\n");
+		emu_halt(e->ep[EMU_EP_BULK_IN], true);
+		return;
+	}
+
+	pthread_mutex_lock(&e->lock);
+
+	n = e->resp.len - e->resp_pos;
+	if (n > size)
+		n = size;
+	if (n > e->max_transfer)
+		n = e->max_transfer;
+
+	if (term_enabled) {
+		p = memchr(e->resp.data + e->resp_pos, term, n);
+		if (p)
+			n = p - (e->resp.data + e->resp_pos) + 1;
+	}
+
+	/*
+	 * The transfer has to end with a short packet. Rather than sending
+	 * a zero length packet, keep back some data for the next transfer.
+	 */
+	while (n && ((12 + n + 3) & ~3) % e->mps_in == 0)
+		n--;
+
+	if (term_enabled && n && e->resp.data[e->resp_pos + n - 1] == term)
+		term_found = true;
+
+	total = (12 + n + 3) & ~3;
+	sent = total;
+	announced = n;
+	buffer = calloc(1, total);
+	buffer[0] = USBTMC_MSGID_DEV_DEP_MSG_IN;
+	buffer[1] = req[1];
+	buffer[2] = ~req[1];
+
+	switch (fault) {
+	case EMU_FAULT_TRUNCATE:
+		/* Still a short packet, so the host sees the end */
+		sent = 12 + n / 2;
+		if (sent % e->mps_in == 0)
+			sent--;
+		break;
+	case EMU_FAULT_SIZE:
+		announced += fault_arg;
+		break;
+	case EMU_FAULT_BTAG:
+		buffer[1] = req[1] + 0x80;
+		buffer[2] = ~buffer[1];
+		break;
+	default:
+		break;
+	}
+	if (fault != EMU_FAULT_NONE)
+		emu_log(e, "fault: sending %zu of %zu bytes, TransferSize %u, "
+			"bTag %u for %u\n", sent, total, announced, buffer[1],
+			req[1]);
+
+	buffer[4] = announced;
+	buffer[5] = announced >> 8;
+	buffer[6] = announced >> 16;
+	buffer[7] = announced >> 24;
+	memcpy(buffer + 12, e->resp.data + e->resp_pos, n);
+
+	e->resp_pos += n;
+	eom = e->resp_pos == e->resp.len;
+	if (eom) {
+		e->resp.len = 0;
+		e->resp_pos = 0;
+	}
+	buffer[8] = (eom ? 0x01 : 0) | (term_found ? 0x02 : 0);
+
+	e->bTag_in = req[1];
+	e->nbytes_txd = n;
+	e->in_progress = true;
+	pthread_mutex_unlock(&e->lock);
+
+	/*
+	 * Leave with one full packet on the bus, the host keeps waiting for
+	 * the rest of the transfer until the gadget goes away.
+	 */
+	if (fault == EMU_FAULT_VANISH) {
+		fprintf(stderr, "usbtmc_emu: vanishing in bulk in transfer "
+			"%u\n", req[1]);
+		if (total > e->mps_in &&
+		    write(e->ep[EMU_EP_BULK_IN], buffer, e->mps_in) < 0)
+			emu_log(e, "bulk in: %s\n", strerror(errno));
+		_exit(2);
+	}
+
+	if (write(e->ep[EMU_EP_BULK_IN], buffer, sent) < 0)
+		emu_log(e, "bulk in: %s\n", strerror(errno));
+
+	pthread_mutex_lock(&e->lock);
+	e->in_progress = false;
+	emu_status_changed(e);
+	pthread_mutex_unlock(&e->lock);
+
+	free(buffer);
+}
+
+/*
+ * Bulk out side. Transfers are read one packet at a time, so that the
+ * end of each transfer is seen even when its length is a multiple of
+ * wMaxPacketSize, and parsed as a byte stream.
+ */
+static void *emu_bulk_thread(void *arg)
+{
+	struct emu *e = arg;
+	unsigned char header[12];
+	unsigned char *packet;
+	size_t have = 0;	/* header bytes */
+	size_t payload = 0;	/* payload bytes left in this transfer */
+	size_t pad = 0;		/* alignment bytes left */
+	bool eom = false;
+	ssize_t len;
+	size_t i;
+	size_t n;
+
+	packet = malloc(e->mps_out);
+
+	for (;;) {
+		len = read(e->ep[EMU_EP_BULK_OUT], packet, e->mps_out);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Disabled or reset: start over */
+			emu_log(e, "bulk out: %s\n", strerror(errno));
+			have = payload = pad = 0;
+			if (errno != ESHUTDOWN && errno != ECONNRESET)
+				usleep(100000);
+			continue;
+		}
+
+		pthread_mutex_lock(&e->lock);
+		if (e->input_reset) {
+			have = payload = pad = 0;
+			e->msg.len = 0;
+			e->input_reset = false;
+		}
+		pthread_mutex_unlock(&e->lock);
+
+		i = 0;
+		while (i < (size_t)len) {
+			if (payload) {
+				n = len - i < payload ? len - i : payload;
+				emu_buf_append(&e->msg, packet + i, n);
+				i += n;
+				payload -= n;
+				e->nbytes_rxd += n;
+				if (!payload && eom) {
+					emu_execute(e, e->msg.data, e->msg.len);
+					e->msg.len = 0;
+				}
+				continue;
+			}
+
+			if (pad) {
+				n = len - i < pad ? len - i : pad;
+				i += n;
+				pad -= n;
+				continue;
+			}
+
+			header[have++] = packet[i++];
+			if (have < 12)
+				continue;
+			have = 0;
+
+			if (header[2] != (unsigned char)~header[1]) {
+				emu_log(e, "bad bTagInverse, halting\n");
+				emu_halt(e->ep[EMU_EP_BULK_OUT], false);
+				break;
+			}
+
+			switch (header[0]) {
+			case USBTMC_MSGID_DEV_DEP_MSG_OUT:
+				payload = header[4] | header[5] << 8 |
+					  header[6] << 16 |
+					  (size_t)header[7] << 24;
+				pad = ((12 + payload + 3) & ~3) - 12 - payload;
+				eom = header[8] & 0x01;
+				pthread_mutex_lock(&e->lock);
+				e->bTag_out = header[1];
+				e->nbytes_rxd = 0;
+				pthread_mutex_unlock(&e->lock);
+				if (!payload && eom) {
+					emu_execute(e, e->msg.data, e->msg.len);
+					e->msg.len = 0;
+				}
+				break;
+
+			case USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN:
+				emu_send_response(e, header);
+				break;
+
+			default:
+				emu_log(e, "unsupported MsgID %u, halting\n",
+					header[0]);
+				emu_halt(e->ep[EMU_EP_BULK_OUT], false);
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Sends queued notifications and completes *OPC operations */
+static void *emu_notify_thread(void *arg)
+{
+	struct emu *e = arg;
+	struct timespec now;
+	uint8_t notify[2];
+
+	pthread_mutex_lock(&e->lock);
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (e->opc_pending &&
+		    (now.tv_sec > e->opc_time.tv_sec ||
+		     (now.tv_sec == e->opc_time.tv_sec &&
+		      now.tv_nsec >= e->opc_time.tv_nsec))) {
+			e->opc_pending = false;
+			e->esr |= ESR_OPC;
+			emu_status_changed(e);
+		}
+
+		if (e->notify_count) {
+			notify[0] = e->notify[e->notify_head][0];
+			notify[1] = e->notify[e->notify_head][1];
+			e->notify_head = (e->notify_head + 1) % EMU_NOTIFY_MAX;
+			e->notify_count--;
+
+			pthread_mutex_unlock(&e->lock);
+			if (write(e->ep[EMU_EP_INT_IN], notify, 2) < 0)
+				emu_log(e, "interrupt in: %s\n",
+					strerror(errno));
+			pthread_mutex_lock(&e->lock);
+			continue;
+		}
+
+		if (e->opc_pending)
+			pthread_cond_timedwait(&e->cond, &e->lock,
+					       &e->opc_time);
+		else
+			pthread_cond_wait(&e->cond, &e->lock);
+	}
+
+	return NULL;
+}
+
+/* Class specific control requests, answered on ep0 */
+static void emu_setup(struct emu *e, const struct usb_ctrlrequest *setup)
+{
+	uint16_t value = le16toh(setup->wValue);
+	uint16_t length = le16toh(setup->wLength);
+	unsigned char reply[0x18];
+	size_t len = 0;
+	uint8_t stb;
+
+	memset(reply, 0, sizeof(reply));
+
+	if ((setup->bRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS ||
+	    !(setup->bRequestType & USB_DIR_IN))
+		goto stall;
+
+	pthread_mutex_lock(&e->lock);
+
+	switch (setup->bRequest) {
+	case USBTMC_REQUEST_INITIATE_ABORT_BULK_OUT:
+		if ((value & 0xff) == e->bTag_out) {
+			reply[0] = USBTMC_STATUS_SUCCESS;
+			e->input_reset = true;
+		} else {
+			reply[0] = USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS;
+		}
+		reply[1] = e->bTag_out;
+		len = 2;
+		break;
+
+	case USBTMC_REQUEST_CHECK_ABORT_BULK_OUT_STATUS:
+		if (e->pending_polls) {
+			e->pending_polls--;
+			reply[0] = USBTMC_STATUS_PENDING;
+			len = 8;
+			break;
+		}
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		reply[4] = e->nbytes_rxd;
+		reply[5] = e->nbytes_rxd >> 8;
+		reply[6] = e->nbytes_rxd >> 16;
+		reply[7] = e->nbytes_rxd >> 24;
+		len = 8;
+		break;
+
+	case USBTMC_REQUEST_INITIATE_ABORT_BULK_IN:
+		/*
+		 * The pending transfer ends with a short packet anyway,
+		 * only the rest of the response has to go.
+		 */
+		if (!e->in_progress) {
+			reply[0] = USBTMC_STATUS_FAILED;
+		} else if ((value & 0xff) != e->bTag_in) {
+			reply[0] = USBTMC_STATUS_TRANSFER_NOT_IN_PROGRESS;
+		} else {
+			reply[0] = USBTMC_STATUS_SUCCESS;
+			e->resp.len = 0;
+			e->resp_pos = 0;
+		}
+		reply[1] = e->bTag_in;
+		len = 2;
+		break;
+
+	case USBTMC_REQUEST_CHECK_ABORT_BULK_IN_STATUS:
+		if (e->pending_polls) {
+			e->pending_polls--;
+			reply[0] = USBTMC_STATUS_PENDING;
+			len = 8;
+			break;
+		}
+		reply[0] = e->in_progress ? USBTMC_STATUS_PENDING :
+					    USBTMC_STATUS_SUCCESS;
+		reply[1] = e->in_progress;
+		if (!e->in_progress) {
+			reply[4] = e->nbytes_txd;
+			reply[5] = e->nbytes_txd >> 8;
+			reply[6] = e->nbytes_txd >> 16;
+			reply[7] = e->nbytes_txd >> 24;
+		}
+		len = 8;
+		break;
+
+	case USBTMC_REQUEST_INITIATE_CLEAR:
+		e->input_reset = true;
+		e->resp.len = 0;
+		e->resp_pos = 0;
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		len = 1;
+		break;
+
+	case USBTMC_REQUEST_CHECK_CLEAR_STATUS:
+		if (e->pending_polls) {
+			e->pending_polls--;
+			reply[0] = USBTMC_STATUS_PENDING;
+			len = 2;
+			break;
+		}
+		reply[0] = e->in_progress ? USBTMC_STATUS_PENDING :
+					    USBTMC_STATUS_SUCCESS;
+		reply[1] = e->in_progress;
+		len = 2;
+		break;
+
+	case USBTMC_REQUEST_GET_CAPABILITIES:
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		reply[2] = 0x00;	/* bcdUSBTMC 1.00 */
+		reply[3] = 0x01;
+		reply[4] = 0x04;	/* INDICATOR_PULSE */
+		reply[5] = 0x01;	/* TermChar */
+		reply[12] = 0x00;	/* bcdUSB488 1.00 */
+		reply[13] = 0x01;
+		reply[14] = 0x06;	/* 488.2, REN/GTL/LLO */
+		reply[15] = 0x0e;	/* SCPI, SR1, RL1 */
+		len = 0x18;
+		break;
+
+	case USBTMC_REQUEST_INDICATOR_PULSE:
+		emu_log(e, "indicator pulse\n");
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		len = 1;
+		break;
+
+	case USB488_REQUEST_READ_STATUS_BYTE:
+		/* With an interrupt endpoint the status byte goes there */
+		stb = emu_stb(e) | (e->rqs ? STB_MSS : 0);
+		e->rqs = false;
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		reply[1] = value & 0x7f;
+		len = 3;
+		emu_notify(e, 0x80 | (value & 0x7f), stb);
+		break;
+
+	case USB488_REQUEST_REN_CONTROL:
+	case USB488_REQUEST_GOTO_LOCAL:
+	case USB488_REQUEST_LOCAL_LOCKOUT:
+		reply[0] = USBTMC_STATUS_SUCCESS;
+		len = 1;
+		break;
+	}
+
+	pthread_mutex_unlock(&e->lock);
+
+	if (!len)
+		goto stall;
+
+	emu_log(e, "control request %u: status %02x\n", setup->bRequest,
+		reply[0]);
+	if (len > length)
+		len = length;
+	if (write(e->ep0, reply, len) < 0)
+		emu_log(e, "ep0: %s\n", strerror(errno));
+	return;
+
+stall:
+	emu_log(e, "stalling request %02x/%u\n", setup->bRequestType,
+		setup->bRequest);
+	emu_halt(e->ep0, setup->bRequestType & USB_DIR_IN);
+}
+
+static int emu_open_ep(const char *dir, int n)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/ep%d", dir, n);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+static unsigned int emu_max_packet(int fd, unsigned int def)
+{
+	struct usb_endpoint_descriptor desc;
+
+	if (ioctl(fd, FUNCTIONFS_ENDPOINT_DESC, &desc) < 0)
+		return def;
+	return le16toh(desc.wMaxPacketSize) & 0x7ff;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <functionfs mount point>\n"
+		"  -l <us>   latency before each bulk in transfer (0)\n"
+		"  -o <ms>   duration of an operation for *OPC (0)\n"
+		"  -p <n>    default block size of DATA? (1024)\n"
+		"  -m <n>    message bytes per bulk in transfer (65536)\n"
+		"  -r <file> replay a recorded session\n"
+		"  -c <n>    channel of the session to replay (0)\n"
+		"  -v        log requests to stderr\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct usb_functionfs_event events[4];
+	pthread_condattr_t attr;
+	pthread_t bulk_thread;
+	pthread_t notify_thread;
+	static struct emu emu;
+	struct emu *e = &emu;
+	const char *trace = NULL;
+	bool started = false;
+	struct stat st;
+	void *map;
+	ssize_t len;
+	int opt;
+	int i;
+
+	e->payload = 1024;
+	e->max_transfer = 65536;
+
+	while ((opt = getopt(argc, argv, "l:o:p:m:r:c:v")) != -1) {
+		switch (opt) {
+		case 'l':
+			e->latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			e->op_delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			e->payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			e->max_transfer = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			trace = optarg;
+			break;
+		case 'c':
+			e->trace_channel = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			e->verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind + 1 != argc || !e->max_transfer)
+		usage(argv[0]);
+
+	if (trace) {
+		i = open(trace, O_RDONLY);
+		if (i < 0 || fstat(i, &st)) {
+			perror(trace);
+			return 1;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, i, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			return 1;
+		}
+		close(i);
+		e->trace_pos = usbtmc_trace_first(map, st.st_size);
+		e->trace_end = (unsigned char *)map + st.st_size;
+		if (!e->trace_pos)
+			fprintf(stderr, "usbtmc_emu: %s: empty or not a "
+				"trace\n", trace);
+	}
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&e->cond, &attr);
+
+	e->ep0 = emu_open_ep(argv[optind], 0);
+	if (write(e->ep0, &descriptors, sizeof(descriptors)) < 0) {
+		perror("writing descriptors");
+		return 1;
+	}
+	if (write(e->ep0, &strings, sizeof(strings)) < 0) {
+		perror("writing strings");
+		return 1;
+	}
+
+	for (i = EMU_EP_BULK_OUT; i <= EMU_EP_INT_IN; i++)
+		e->ep[i] = emu_open_ep(argv[optind], i);
+
+	fprintf(stderr, "usbtmc_emu: ready, bind the gadget now\n");
+
+	for (;;) {
+		len = read(e->ep0, events, sizeof(events));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ep0");
+			return 1;
+		}
+
+		for (i = 0; i < len / (ssize_t)sizeof(events[0]); i++) {
+			switch (events[i].type) {
+			case FUNCTIONFS_ENABLE:
+				emu_log(e, "enabled\n");
+				if (started)
+					break;
+				/* High speed unless the UDC says otherwise */
+				e->mps_out = emu_max_packet(
+					e->ep[EMU_EP_BULK_OUT], 512);
+				e->mps_in = emu_max_packet(
+					e->ep[EMU_EP_BULK_IN], 512);
+				pthread_create(&bulk_thread, NULL,
+					       emu_bulk_thread, e);
+				pthread_create(&notify_thread, NULL,
+					       emu_notify_thread, e);
+				started = true;
+				break;
+			case FUNCTIONFS_DISABLE:
+				emu_log(e, "disabled\n");
+				break;
+			case FUNCTIONFS_SETUP:
+				emu_setup(e, &events[i].u.setup);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
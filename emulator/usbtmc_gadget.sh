@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Set up or remove USBTMC gadgets on dummy_hcd, driven by usbtmc_emu.
+#
+#   usbtmc_gadget.sh start [usbtmc_emu options]
+#   usbtmc_gadget.sh stop
+#
+# The emulated instruments then show up on the dummy host controllers and
+# are bound by whichever usbtmc module is loaded. USBTMC_EMU_COUNT (default
+# 1) sets the number of instruments, each one gets its own dummy_hcd port
+# and its own usbtmc_emu process. Needs configfs, libcomposite, usb_f_fs and
+# dummy_hcd.
+
+COUNT=${USBTMC_EMU_COUNT:-1}
+DIR=$(dirname "$0")
+
+start() {
+	local i gadget ffs
+
+	sudo modprobe libcomposite
+	sudo modprobe usb_f_fs
+	sudo modprobe dummy_hcd num=$COUNT
+
+	for ((i = 0; i < COUNT; i++)); do
+		gadget=/sys/kernel/config/usb_gadget/usbtmc_emu$i
+		ffs=/dev/ffs-usbtmc$i
+
+		sudo mkdir -p $gadget
+		echo 0x1d6b | sudo tee $gadget/idVendor > /dev/null
+		echo 0x0104 | sudo tee $gadget/idProduct > /dev/null
+		sudo mkdir -p $gadget/strings/0x409
+		echo "usbtmc" | sudo tee $gadget/strings/0x409/manufacturer > /dev/null
+		echo "USBTMC emulator" | sudo tee $gadget/strings/0x409/product > /dev/null
+		printf "%04d\n" $((i + 1)) | sudo tee $gadget/strings/0x409/serialnumber > /dev/null
+		sudo mkdir -p $gadget/configs/c.1/strings/0x409
+		echo "USBTMC" | sudo tee $gadget/configs/c.1/strings/0x409/configuration > /dev/null
+		sudo mkdir -p $gadget/functions/ffs.usbtmc$i
+		sudo ln -sf $gadget/functions/ffs.usbtmc$i $gadget/configs/c.1/
+
+		sudo mkdir -p $ffs
+		sudo mount -t functionfs usbtmc$i $ffs
+
+		sudo "$DIR"/usbtmc_emu "$@" $ffs &
+
+		# The UDC can only be bound once the descriptors are written
+		while [ ! -e $ffs/ep3 ]; do
+			sleep 0.1
+		done
+		echo dummy_udc.$i | sudo tee $gadget/UDC > /dev/null
+	done
+
+	sleep 2
+	sudo chmod 666 /dev/usbtmc* 2> /dev/null
+}
+
+stop() {
+	local gadget ffs i
+
+	for gadget in /sys/kernel/config/usb_gadget/usbtmc_emu*; do
+		[ -d $gadget ] || continue
+		echo "" | sudo tee $gadget/UDC > /dev/null 2>&1
+	done
+	sudo pkill -x usbtmc_emu
+	sleep 0.5
+	for gadget in /sys/kernel/config/usb_gadget/usbtmc_emu*; do
+		[ -d $gadget ] || continue
+		i=${gadget##*usbtmc_emu}
+		ffs=/dev/ffs-usbtmc$i
+		sudo umount $ffs
+		sudo rm -f $gadget/configs/c.1/ffs.usbtmc$i
+		sudo rmdir $gadget/configs/c.1/strings/0x409 $gadget/configs/c.1 \
+			$gadget/functions/ffs.usbtmc$i $gadget/strings/0x409 $gadget
+	done
+	sudo rmmod dummy_hcd 2> /dev/null
+}
+
+case "$1" in
+start)
+	shift
+	start "$@"
+	;;
+stop)
+	stop
+	;;
+*)
+	echo "Usage: $0 start [usbtmc_emu options] | stop"
+	exit 1
+	;;
+esac
@@ -0,0 +1,323 @@
+/**
+ * mock_kernel.c - User space implementation of the kernel API in mock_kernel.h
+ *
+ * Memory comes from malloc(), "user" memory is plain memory and locks do
+ * nothing, as everything runs in a single thread. Functions that only
+ * matter to code paths the benchmark does not take (splice, the control
+ * node, device groups) fail or do nothing.
+ * See ../usbtmc.c for license details.
+ */
+
+#include "mock_kernel.h"
+
+int printk_ratelimit(void)
+{
+	return 1;
+}
+
+void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+void *kmemdup(const void *src, size_t len, gfp_t flags)
+{
+	void *p = malloc(len);
+
+	if (p)
+		memcpy(p, src, len);
+	return p;
+}
+
+void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+struct page *alloc_page(gfp_t flags)
+{
+	struct page *page = malloc(sizeof(*page));
+
+	if (!page)
+		return NULL;
+	page->addr = malloc(PAGE_SIZE);
+	if (!page->addr) {
+		free(page);
+		return NULL;
+	}
+	return page;
+}
+
+void __free_page(struct page *page)
+{
+	free(page->addr);
+	free(page);
+}
+
+void put_page(struct page *page)
+{
+	__free_page(page);
+}
+
+void *page_address(struct page *page)
+{
+	return page->addr;
+}
+
+unsigned long copy_to_user(void __user *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+unsigned long copy_from_user(void *to, const void __user *from,
+			     unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+void kref_init(struct kref *kref)
+{
+	kref->refcount = 1;
+}
+
+void kref_get(struct kref *kref)
+{
+	kref->refcount++;
+}
+
+int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+	if (--kref->refcount)
+		return 0;
+	release(kref);
+	return 1;
+}
+
+void mutex_init(struct mutex *m)
+{
+	m->locked = 0;
+}
+
+void mutex_lock(struct mutex *m)
+{
+	m->locked++;
+}
+
+void mutex_unlock(struct mutex *m)
+{
+	m->locked--;
+}
+
+void bitmap_fill(unsigned long *map, int bits)
+{
+	memset(map, 0xff, BITS_TO_LONGS(bits) * sizeof(long));
+}
+
+void bitmap_zero(unsigned long *map, int bits)
+{
+	memset(map, 0, BITS_TO_LONGS(bits) * sizeof(long));
+}
+
+void set_bit(int nr, volatile unsigned long *map)
+{
+	map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+void clear_bit(int nr, volatile unsigned long *map)
+{
+	map[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+int test_bit(int nr, const volatile unsigned long *map)
+{
+	return (map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1;
+}
+
+void list_add(struct list_head *entry, struct list_head *head)
+{
+	entry->next = head->next;
+	entry->prev = head;
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+	entry->next = head;
+	entry->prev = head->prev;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+void list_del(struct list_head *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = entry->prev = NULL;
+}
+
+unsigned long msecs_to_jiffies(unsigned int ms)
+{
+	return ms;
+}
+
+void getrawmonotonic(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC_RAW, ts);
+}
+
+void init_completion(struct completion *c)
+{
+	c->done = 0;
+}
+
+void complete(struct completion *c)
+{
+	c->done++;
+}
+
+void wait_for_completion(struct completion *c)
+{
+	c->done--;
+}
+
+/* Nothing can complete later, so a completion not done yet has timed out */
+unsigned long wait_for_completion_timeout(struct completion *c,
+					  unsigned long timeout)
+{
+	if (!c->done)
+		return 0;
+	c->done--;
+	return timeout ? timeout : 1;
+}
+
+struct task_struct mock_current;
+
+int signal_pending(struct task_struct *task)
+{
+	return 0;
+}
+
+int send_sig(int sig, struct task_struct *task, int priv)
+{
+	return 0;
+}
+
+int schedule_work(struct work_struct *work)
+{
+	return 1;
+}
+
+int schedule_delayed_work(struct delayed_work *work, unsigned long delay)
+{
+	return 1;
+}
+
+int cancel_delayed_work(struct delayed_work *work)
+{
+	return 0;
+}
+
+int cancel_delayed_work_sync(struct delayed_work *work)
+{
+	return 0;
+}
+
+struct file *fget(unsigned int fd)
+{
+	return NULL;
+}
+
+void fput(struct file *file)
+{
+}
+
+int anon_inode_getfd(const char *name, const struct file_operations *fops,
+		     void *priv, int flags)
+{
+	return -ENOSYS;
+}
+
+void poll_wait(struct file *file, wait_queue_head_t *q, poll_table *p)
+{
+}
+
+int misc_register(struct miscdevice *misc)
+{
+	return 0;
+}
+
+int misc_deregister(struct miscdevice *misc)
+{
+	return 0;
+}
+
+void *generic_pipe_buf_map(struct pipe_inode_info *pipe,
+			   struct pipe_buffer *buf, int atomic)
+{
+	return page_address(buf->page);
+}
+
+void generic_pipe_buf_unmap(struct pipe_inode_info *pipe,
+			    struct pipe_buffer *buf, void *addr)
+{
+}
+
+int generic_pipe_buf_confirm(struct pipe_inode_info *pipe,
+			     struct pipe_buffer *buf)
+{
+	return 0;
+}
+
+int generic_pipe_buf_steal(struct pipe_inode_info *pipe,
+			   struct pipe_buffer *buf)
+{
+	return 1;
+}
+
+void generic_pipe_buf_get(struct pipe_inode_info *pipe,
+			  struct pipe_buffer *buf)
+{
+}
+
+ssize_t splice_to_pipe(struct pipe_inode_info *pipe,
+		       struct splice_pipe_desc *spd)
+{
+	return -ENOSYS;
+}
+
+ssize_t __splice_from_pipe(struct pipe_inode_info *pipe,
+			   struct splice_desc *sd, splice_actor *actor)
+{
+	return -ENOSYS;
+}
+
+void pipe_lock(struct pipe_inode_info *pipe)
+{
+}
+
+void pipe_unlock(struct pipe_inode_info *pipe)
+{
+}
+
+void pipe_wait(struct pipe_inode_info *pipe)
+{
+}
+
+int sysfs_create_group(struct kobject *kobj,
+		       const struct attribute_group *grp)
+{
+	return 0;
+}
+
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp)
+{
+}
@@ -0,0 +1,639 @@
+/**
+ * mock_kernel.h - Just enough of the kernel API to run usbtmc.c in user space
+ *
+ * The Makefile in this directory points every <linux/...> header included
+ * by usbtmc.c, apart from the user space API ones, at this file. Most
+ * functions are implemented in mock_kernel.c, the USB core and the device
+ * behind it in mock_usb.c. Everything runs in one thread: URBs complete
+ * before usb_submit_urb() returns, locks and wait queues do nothing.
+ * See ../usbtmc.c for license details.
+ */
+
+#ifndef __MOCK_KERNEL_H
+#define __MOCK_KERNEL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Types and compiler helpers */
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+typedef __s32 s32;
+typedef __s64 s64;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __init
+#define __exit
+#define __packed		__attribute__((packed))
+#define likely(x)		(x)
+#define unlikely(x)		(x)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define roundup(x, y)		((((x) + ((y) - 1)) / (y)) * (y))
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define max(x, y)		((x) > (y) ? (x) : (y))
+#define min_t(t, x, y)		((t)(x) < (t)(y) ? (t)(x) : (t)(y))
+
+#define le16_to_cpu(x)		((u16)(x))
+#define le32_to_cpu(x)		((u32)(x))
+#define cpu_to_le16(x)		((__le16)(x))
+#define cpu_to_le32(x)		((__le32)(x))
+
+/* Modules and printing */
+#define KBUILD_MODNAME		"usbtmc"
+#define KERN_ERR		""
+#define KERN_WARNING		""
+#define KERN_INFO		""
+#define KERN_DEBUG		""
+#define THIS_MODULE		NULL
+#define MODULE_DEVICE_TABLE(type, table)
+#define MODULE_LICENSE(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_AUTHOR(x)
+#define module_init(f)
+#define module_exit(f)
+
+#define printk(...)		fprintf(stderr, __VA_ARGS__)
+int printk_ratelimit(void);
+
+struct module;
+
+struct kobject {
+	int unused;
+};
+
+struct device {
+	struct kobject kobj;
+	void *driver_data;
+};
+
+#define dev_err(dev, ...)	((void)(dev), fprintf(stderr, __VA_ARGS__))
+#define dev_warn(dev, ...)	((void)(dev), fprintf(stderr, __VA_ARGS__))
+#define dev_info(dev, ...)	((void)(dev), fprintf(stderr, __VA_ARGS__))
+#define dev_dbg(dev, ...)	((void)(dev))
+
+/* Memory */
+#define GFP_KERNEL		0u
+#define GFP_ATOMIC		1u
+#define GFP_NOIO		2u
+#define PAGE_SIZE		4096UL
+
+void *kmalloc(size_t size, gfp_t flags);
+void *kzalloc(size_t size, gfp_t flags);
+void *kmemdup(const void *src, size_t len, gfp_t flags);
+void kfree(const void *p);
+
+struct page {
+	void *addr;
+};
+
+struct page *alloc_page(gfp_t flags);
+void __free_page(struct page *page);
+void put_page(struct page *page);
+void *page_address(struct page *page);
+
+/* User space access: the "user" buffers of the benchmark are plain memory */
+unsigned long copy_to_user(void __user *to, const void *from, unsigned long n);
+unsigned long copy_from_user(void *to, const void __user *from,
+			     unsigned long n);
+#define get_user(x, p)		({ (x) = *(p); 0; })
+#define put_user(x, p)		({ *(p) = (x); 0; })
+
+/* Reference counts, locks and atomics */
+struct kref {
+	int refcount;
+};
+
+void kref_init(struct kref *kref);
+void kref_get(struct kref *kref);
+int kref_put(struct kref *kref, void (*release)(struct kref *kref));
+
+struct mutex {
+	int locked;
+};
+
+#define DEFINE_MUTEX(m)		struct mutex m
+void mutex_init(struct mutex *m);
+void mutex_lock(struct mutex *m);
+void mutex_unlock(struct mutex *m);
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(l)	spinlock_t l
+#define spin_lock_init(l)	((l)->locked = 0)
+#define spin_lock(l)		((void)(l))
+#define spin_unlock(l)		((void)(l))
+#define spin_lock_irq(l)	((void)(l))
+#define spin_unlock_irq(l)	((void)(l))
+#define spin_lock_irqsave(l, f)	((void)(l), (f) = 0)
+#define spin_unlock_irqrestore(l, f) ((void)(l), (void)(f))
+
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define atomic_read(v)		((v)->counter)
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_inc(v)		((v)->counter++)
+#define atomic_dec(v)		((v)->counter--)
+#define atomic_dec_and_test(v)	(--(v)->counter == 0)
+
+/* Bit maps */
+#define BITS_PER_LONG		(8 * sizeof(long))
+#define BITS_TO_LONGS(n)	(((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+void bitmap_fill(unsigned long *map, int bits);
+void bitmap_zero(unsigned long *map, int bits);
+void set_bit(int nr, volatile unsigned long *map);
+void clear_bit(int nr, volatile unsigned long *map);
+int test_bit(int nr, const volatile unsigned long *map);
+
+/* Lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name)	{ &(name), &(name) }
+#define LIST_HEAD(name)		struct list_head name = LIST_HEAD_INIT(name)
+#define INIT_LIST_HEAD(l)	((l)->next = (l)->prev = (l))
+#define list_empty(head)	((head)->next == (head))
+#define list_entry(p, type, member) container_of(p, type, member)
+#define list_first_entry(head, type, member) \
+	list_entry((head)->next, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, __typeof__(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, __typeof__(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, __typeof__(*pos), member),	\
+	     n = list_entry(pos->member.next, __typeof__(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, __typeof__(*n), member))
+
+void list_add(struct list_head *entry, struct list_head *head);
+void list_add_tail(struct list_head *entry, struct list_head *head);
+void list_del(struct list_head *entry);
+
+/*
+ * Time, completions and wait queues. With URBs completing synchronously
+ * the awaited condition is true by the time anyone waits for it.
+ */
+#define MAX_SCHEDULE_TIMEOUT	0x7fffffffL
+#define ERESTARTSYS		512
+
+unsigned long msecs_to_jiffies(unsigned int ms);
+void getrawmonotonic(struct timespec *ts);
+
+static inline s64 timespec_to_ns(const struct timespec *ts)
+{
+	return (s64)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+struct completion {
+	int done;
+};
+
+void init_completion(struct completion *c);
+void complete(struct completion *c);
+void wait_for_completion(struct completion *c);
+unsigned long wait_for_completion_timeout(struct completion *c,
+					  unsigned long timeout);
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(q)	((void)(q))
+#define wake_up(q)		((void)(q))
+#define wake_up_interruptible(q) ((void)(q))
+#define wait_event(q, cond)	do { (void)(q); (void)(cond); } while (0)
+#define wait_event_timeout(q, cond, t) \
+	({ (void)(q); (cond) ? (long)(t) : 0L; })
+#define wait_event_interruptible(q, cond) \
+	({ (void)(q); (cond) ? 0 : -ERESTARTSYS; })
+#define wait_event_interruptible_timeout(q, cond, t) \
+	({ (void)(q); (cond) ? (long)(t) : 0L; })
+
+/* The one task there is, which never has a signal pending */
+#define SIGPIPE			13
+
+struct task_struct {
+	int unused;
+};
+
+extern struct task_struct mock_current;
+#define current			(&mock_current)
+
+int signal_pending(struct task_struct *task);
+int send_sig(int sig, struct task_struct *task, int priv);
+
+/* Deferred work never runs: nothing in the benchmark waits for it */
+struct work_struct {
+	void (*func)(struct work_struct *work);
+};
+
+struct delayed_work {
+	struct work_struct work;
+};
+
+#define INIT_WORK(w, f)		((w)->func = (f))
+#define INIT_DELAYED_WORK(w, f)	((w)->work.func = (f))
+int schedule_work(struct work_struct *work);
+int schedule_delayed_work(struct delayed_work *work, unsigned long delay);
+int cancel_delayed_work(struct delayed_work *work);
+int cancel_delayed_work_sync(struct delayed_work *work);
+
+/* Files */
+struct inode {
+	unsigned int minor;
+};
+
+struct file {
+	void *private_data;
+	const struct file_operations *f_op;
+	unsigned int f_flags;
+};
+
+struct kiocb {
+	struct file *ki_filp;
+	long long ki_pos;
+};
+
+typedef long long loff_t_mock;
+#define loff_t			loff_t_mock
+
+struct pipe_inode_info;
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+
+struct file_operations {
+	struct module *owner;
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	ssize_t (*aio_read)(struct kiocb *, const struct iovec *,
+			    unsigned long, loff_t);
+	ssize_t (*aio_write)(struct kiocb *, const struct iovec *,
+			     unsigned long, loff_t);
+	unsigned int (*poll)(struct file *, struct poll_table_struct *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+	int (*fsync)(struct file *, loff_t, loff_t, int);
+	ssize_t (*splice_write)(struct pipe_inode_info *, struct file *,
+				loff_t *, size_t, unsigned int);
+	ssize_t (*splice_read)(struct file *, loff_t *,
+			       struct pipe_inode_info *, size_t, unsigned int);
+	loff_t (*llseek)(struct file *, loff_t, int);
+};
+
+#define no_llseek		NULL
+#define nonseekable_open(inode, file) 0
+
+static inline unsigned int iminor(const struct inode *inode)
+{
+	return inode->minor;
+}
+
+static inline size_t iov_length(const struct iovec *iov,
+				unsigned long nr_segs)
+{
+	size_t len = 0;
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs; seg++)
+		len += iov[seg].iov_len;
+	return len;
+}
+
+struct file *fget(unsigned int fd);
+void fput(struct file *file);
+int anon_inode_getfd(const char *name, const struct file_operations *fops,
+		     void *priv, int flags);
+
+void poll_wait(struct file *file, wait_queue_head_t *q, poll_table *p);
+
+#define MISC_DYNAMIC_MINOR	255
+
+struct miscdevice {
+	int minor;
+	const char *name;
+	const struct file_operations *fops;
+};
+
+int misc_register(struct miscdevice *misc);
+int misc_deregister(struct miscdevice *misc);
+
+/* Pipes and splice; splice_read and splice_write are not benchmarked */
+struct pipe_inode_info {
+	unsigned int readers;
+	unsigned int buffers;
+	unsigned int nrbufs;
+};
+
+struct pipe_buffer;
+
+struct pipe_buf_operations {
+	int can_merge;
+	void *(*map)(struct pipe_inode_info *, struct pipe_buffer *, int);
+	void (*unmap)(struct pipe_inode_info *, struct pipe_buffer *, void *);
+	int (*confirm)(struct pipe_inode_info *, struct pipe_buffer *);
+	void (*release)(struct pipe_inode_info *, struct pipe_buffer *);
+	int (*steal)(struct pipe_inode_info *, struct pipe_buffer *);
+	void (*get)(struct pipe_inode_info *, struct pipe_buffer *);
+};
+
+struct pipe_buffer {
+	struct page *page;
+	unsigned int offset, len;
+	const struct pipe_buf_operations *ops;
+};
+
+struct partial_page {
+	unsigned int offset;
+	unsigned int len;
+	unsigned long private;
+};
+
+struct splice_pipe_desc {
+	struct page **pages;
+	struct partial_page *partial;
+	int nr_pages;
+	unsigned int nr_pages_max;
+	unsigned int flags;
+	const struct pipe_buf_operations *ops;
+	void (*spd_release)(struct splice_pipe_desc *, unsigned int);
+};
+
+struct splice_desc {
+	size_t total_len;
+	unsigned int len;
+	unsigned int flags;
+	union {
+		void *userptr;
+		struct file *file;
+		void *data;
+	} u;
+	loff_t pos;
+};
+
+typedef int (splice_actor)(struct pipe_inode_info *, struct pipe_buffer *,
+			   struct splice_desc *);
+
+#define PIPE_DEF_BUFFERS	16
+#define SPLICE_F_NONBLOCK	2
+#define SPLICE_F_MORE		4
+
+void *generic_pipe_buf_map(struct pipe_inode_info *, struct pipe_buffer *,
+			   int);
+void generic_pipe_buf_unmap(struct pipe_inode_info *, struct pipe_buffer *,
+			    void *);
+int generic_pipe_buf_confirm(struct pipe_inode_info *, struct pipe_buffer *);
+int generic_pipe_buf_steal(struct pipe_inode_info *, struct pipe_buffer *);
+void generic_pipe_buf_get(struct pipe_inode_info *, struct pipe_buffer *);
+ssize_t splice_to_pipe(struct pipe_inode_info *, struct splice_pipe_desc *);
+ssize_t __splice_from_pipe(struct pipe_inode_info *, struct splice_desc *,
+			   splice_actor *);
+void pipe_lock(struct pipe_inode_info *pipe);
+void pipe_unlock(struct pipe_inode_info *pipe);
+void pipe_wait(struct pipe_inode_info *pipe);
+
+/* sysfs */
+#define S_IRUGO			(S_IRUSR | S_IRGRP | S_IROTH)
+
+struct attribute {
+	const char *name;
+	unsigned int mode;
+};
+
+struct device_attribute {
+	struct attribute attr;
+	ssize_t (*show)(struct device *, struct device_attribute *, char *);
+	ssize_t (*store)(struct device *, struct device_attribute *,
+			 const char *, size_t);
+};
+
+#define DEVICE_ATTR(_name, _mode, _show, _store)			\
+	struct device_attribute dev_attr_##_name =			\
+		{ { #_name, _mode }, _show, _store }
+
+struct attribute_group {
+	struct attribute **attrs;
+};
+
+int sysfs_create_group(struct kobject *kobj,
+		       const struct attribute_group *grp);
+void sysfs_remove_group(struct kobject *kobj,
+			const struct attribute_group *grp);
+
+/* USB core, see mock_usb.c */
+#define USB_CLASS_APP_SPEC	0xfe
+#define USB_DIR_OUT		0
+#define USB_DIR_IN		0x80
+#define USB_TYPE_STANDARD	0x00
+#define USB_TYPE_CLASS		0x20
+#define USB_RECIP_INTERFACE	0x01
+#define USB_RECIP_ENDPOINT	0x02
+#define USB_REQ_CLEAR_FEATURE	0x01
+#define USB_ENDPOINT_HALT	0
+
+struct usb_device_id {
+	u8 bInterfaceClass;
+	u8 bInterfaceSubClass;
+	u8 bInterfaceProtocol;
+};
+
+#define USB_INTERFACE_INFO(cl, sc, pr)					\
+	.bInterfaceClass = (cl), .bInterfaceSubClass = (sc),		\
+	.bInterfaceProtocol = (pr)
+
+struct usb_endpoint_descriptor {
+	u8 bLength;
+	u8 bDescriptorType;
+	u8 bEndpointAddress;
+	u8 bmAttributes;
+	__le16 wMaxPacketSize;
+	u8 bInterval;
+};
+
+struct usb_host_endpoint {
+	struct usb_endpoint_descriptor desc;
+};
+
+struct usb_interface_descriptor {
+	u8 bInterfaceNumber;
+	u8 bNumEndpoints;
+};
+
+struct usb_host_interface {
+	struct usb_interface_descriptor desc;
+	struct usb_host_endpoint *endpoint;
+};
+
+struct usb_device {
+	struct device dev;
+	char *manufacturer;
+	char *product;
+	char *serial;
+};
+
+struct usb_interface {
+	struct device dev;
+	struct usb_host_interface *cur_altsetting;
+	int minor;
+	struct usb_device *usb_dev;	/* for interface_to_usbdev() */
+};
+
+struct usb_class_driver {
+	const char *name;
+	const struct file_operations *fops;
+	int minor_base;
+};
+
+typedef struct {
+	int event;
+} pm_message_t;
+
+struct usb_driver {
+	const char *name;
+	int (*probe)(struct usb_interface *, const struct usb_device_id *);
+	void (*disconnect)(struct usb_interface *);
+	int (*suspend)(struct usb_interface *, pm_message_t);
+	int (*resume)(struct usb_interface *);
+	const struct usb_device_id *id_table;
+};
+
+#define to_usb_interface(d)	container_of(d, struct usb_interface, dev)
+
+static inline struct usb_device *interface_to_usbdev(struct usb_interface *i)
+{
+	return i->usb_dev;
+}
+
+static inline void *usb_get_intfdata(struct usb_interface *intf)
+{
+	return intf->dev.driver_data;
+}
+
+static inline void usb_set_intfdata(struct usb_interface *intf, void *data)
+{
+	intf->dev.driver_data = data;
+}
+
+static inline int usb_endpoint_type(const struct usb_endpoint_descriptor *d)
+{
+	return d->bmAttributes & 3;
+}
+
+static inline int
+usb_endpoint_is_bulk_in(const struct usb_endpoint_descriptor *d)
+{
+	return (d->bEndpointAddress & USB_DIR_IN) && usb_endpoint_type(d) == 2;
+}
+
+static inline int
+usb_endpoint_is_bulk_out(const struct usb_endpoint_descriptor *d)
+{
+	return !(d->bEndpointAddress & USB_DIR_IN) &&
+	       usb_endpoint_type(d) == 2;
+}
+
+static inline int
+usb_endpoint_is_int_in(const struct usb_endpoint_descriptor *d)
+{
+	return (d->bEndpointAddress & USB_DIR_IN) && usb_endpoint_type(d) == 3;
+}
+
+struct usb_device *usb_get_dev(struct usb_device *dev);
+void usb_put_dev(struct usb_device *dev);
+int usb_register(struct usb_driver *driver);
+void usb_deregister(struct usb_driver *driver);
+int usb_register_dev(struct usb_interface *intf,
+		     struct usb_class_driver *class_driver);
+void usb_deregister_dev(struct usb_interface *intf,
+			struct usb_class_driver *class_driver);
+struct usb_interface *usb_find_interface(struct usb_driver *driver,
+					 int minor);
+
+/* Pipes: endpoint address, with bit 30 set for bulk and 31 for interrupt */
+#define MOCK_PIPE_BULK		0x40000000u
+#define MOCK_PIPE_INT		0x80000000u
+
+#define usb_sndctrlpipe(dev, ep)	((void)(dev), (unsigned int)(ep))
+#define usb_rcvctrlpipe(dev, ep)	((void)(dev), (ep) | USB_DIR_IN)
+#define usb_sndbulkpipe(dev, ep)	((void)(dev), (ep) | MOCK_PIPE_BULK)
+#define usb_rcvbulkpipe(dev, ep) \
+	((void)(dev), (ep) | USB_DIR_IN | MOCK_PIPE_BULK)
+#define usb_rcvintpipe(dev, ep) \
+	((void)(dev), (ep) | USB_DIR_IN | MOCK_PIPE_INT)
+
+int usb_control_msg(struct usb_device *dev, unsigned int pipe, u8 request,
+		    u8 requesttype, u16 value, u16 index, void *data,
+		    u16 size, int timeout);
+int usb_bulk_msg(struct usb_device *dev, unsigned int pipe, void *data,
+		 int len, int *actual_length, int timeout);
+int usb_get_current_frame_number(struct usb_device *dev);
+
+struct urb;
+typedef void (*usb_complete_t)(struct urb *);
+
+struct urb {
+	int refcount;
+	struct list_head pending;	/* on the mock's list while posted */
+	struct usb_device *dev;
+	unsigned int pipe;
+	int status;
+	unsigned int transfer_flags;
+	void *transfer_buffer;
+	u32 transfer_buffer_length;
+	u32 actual_length;
+	void *context;
+	usb_complete_t complete;
+	int interval;
+	struct usb_anchor *anchor;
+};
+
+#define URB_FREE_BUFFER		0x0100
+
+struct usb_anchor {
+	int unused;
+};
+
+struct urb *usb_alloc_urb(int iso_packets, gfp_t flags);
+void usb_free_urb(struct urb *urb);
+int usb_submit_urb(struct urb *urb, gfp_t flags);
+void usb_kill_urb(struct urb *urb);
+void usb_fill_bulk_urb(struct urb *urb, struct usb_device *dev,
+		       unsigned int pipe, void *buffer, int length,
+		       usb_complete_t complete, void *context);
+void usb_fill_int_urb(struct urb *urb, struct usb_device *dev,
+		      unsigned int pipe, void *buffer, int length,
+		      usb_complete_t complete, void *context, int interval);
+void init_usb_anchor(struct usb_anchor *anchor);
+void usb_anchor_urb(struct urb *urb, struct usb_anchor *anchor);
+void usb_unanchor_urb(struct urb *urb);
+void usb_kill_anchored_urbs(struct usb_anchor *anchor);
+void usb_unlink_anchored_urbs(struct usb_anchor *anchor);
+int usb_wait_anchor_empty_timeout(struct usb_anchor *anchor,
+				  unsigned int timeout);
+
+#endif /* __MOCK_KERNEL_H */
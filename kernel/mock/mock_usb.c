@@ -0,0 +1,361 @@
+/**
+ * mock_usb.c - Mock USB core with a scripted USBTMC device behind it
+ *
+ * See mock_usb.h for the behaviour of the device.
+ * See ../usbtmc.c for license details.
+ */
+
+#include "mock_usb.h"
+#include <linux/usb/tmc.h>
+#include "../usbtmc_msg.h"
+
+#define MOCK_BULK_OUT		0x01
+#define MOCK_BULK_IN		0x82
+#define MOCK_INT_IN		0x83
+
+static struct usb_host_endpoint mock_endpoints[] = {
+	{ { .bEndpointAddress = MOCK_BULK_OUT, .bmAttributes = 2,
+	    .wMaxPacketSize = 512 } },
+	{ { .bEndpointAddress = MOCK_BULK_IN, .bmAttributes = 2,
+	    .wMaxPacketSize = 512 } },
+	{ { .bEndpointAddress = MOCK_INT_IN, .bmAttributes = 3,
+	    .wMaxPacketSize = 2, .bInterval = 1 } },
+};
+
+static struct usb_host_interface mock_altsetting = {
+	.endpoint = mock_endpoints,
+};
+
+static struct usb_device mock_dev;
+static struct usb_interface mock_intf;
+static bool mock_registered;
+
+/* URBs posted but not completed yet */
+static LIST_HEAD(mock_pending);
+
+/* Device state */
+static const u8 *mock_response;
+static size_t mock_response_len;
+static size_t mock_pos;			/* of the response being read */
+static size_t mock_len;			/* 0 if no response is queued */
+static bool mock_request;		/* REQUEST_DEV_DEP_MSG_IN received */
+static u32 mock_request_size;
+static u8 mock_request_bTag;
+static struct mock_usb_stats mock_stats;
+
+struct usb_interface *mock_usb_interface(bool int_in)
+{
+	mock_altsetting.desc.bNumEndpoints = int_in ? 3 : 2;
+	mock_intf.cur_altsetting = &mock_altsetting;
+	mock_intf.usb_dev = &mock_dev;
+	return &mock_intf;
+}
+
+void mock_usb_respond(const void *data, size_t len)
+{
+	mock_response = data;
+	mock_response_len = len;
+}
+
+void mock_usb_stats(struct mock_usb_stats *stats)
+{
+	*stats = mock_stats;
+}
+
+void mock_usb_reset_stats(void)
+{
+	memset(&mock_stats, 0, sizeof(mock_stats));
+}
+
+/* A bulk out transfer: the driver sends one header per URB */
+static int mock_bulk_out(const u8 *buffer, u32 len)
+{
+	const struct usbtmc_bulk_header *hdr = (const void *)buffer;
+
+	mock_stats.bulk_out++;
+	mock_stats.bytes_out += len;
+
+	if (len < USBTMC_HEADER_SIZE || hdr->bTagInverse != (u8)~hdr->bTag)
+		return -EPIPE;
+
+	switch (hdr->MsgID) {
+	case USBTMC_MSGID_DEV_DEP_MSG_OUT:
+		if (hdr->bmTransferAttributes & USBTMC_ATTR_EOM) {
+			mock_stats.messages++;
+			mock_pos = 0;
+			mock_len = mock_response_len;
+		}
+		return 0;
+	case USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN:
+		mock_request = true;
+		mock_request_size = le32_to_cpu(hdr->TransferSize);
+		mock_request_bTag = hdr->bTag;
+		return 0;
+	default:
+		return -EPIPE;
+	}
+}
+
+/*
+ * A bulk in transfer, possible only after a REQUEST_DEV_DEP_MSG_IN.
+ * Without a queued response the device sends an empty message.
+ */
+static int mock_bulk_in(u8 *buffer, u32 size, u32 *actual)
+{
+	struct usbtmc_bulk_header *hdr = (void *)buffer;
+	size_t n;
+
+	if (!mock_request)
+		return -EAGAIN;
+	mock_request = false;
+
+	n = min(mock_len - mock_pos, (size_t)mock_request_size);
+	n = min(n, (size_t)size - USBTMC_HEADER_SIZE);
+
+	usbtmc_msg_header(hdr, USBTMC_MSGID_DEV_DEP_MSG_IN, mock_request_bTag,
+			  n);
+	memcpy(buffer + USBTMC_HEADER_SIZE, mock_response + mock_pos, n);
+	mock_pos += n;
+	if (mock_pos == mock_len) {
+		hdr->bmTransferAttributes = USBTMC_ATTR_EOM;
+		mock_len = 0;
+	}
+
+	*actual = min((size_t)size, usbtmc_msg_transfer_size(n));
+	mock_stats.bulk_in++;
+	mock_stats.bytes_in += *actual;
+	return 0;
+}
+
+static void mock_urb_put(struct urb *urb)
+{
+	if (--urb->refcount)
+		return;
+	if (urb->transfer_flags & URB_FREE_BUFFER)
+		free(urb->transfer_buffer);
+	free(urb);
+}
+
+static void mock_giveback(struct urb *urb, int status)
+{
+	urb->status = status;
+	usb_unanchor_urb(urb);
+	urb->complete(urb);
+	mock_urb_put(urb);
+}
+
+struct urb *usb_alloc_urb(int iso_packets, gfp_t flags)
+{
+	struct urb *urb = calloc(1, sizeof(*urb));
+
+	if (urb)
+		urb->refcount = 1;
+	return urb;
+}
+
+void usb_free_urb(struct urb *urb)
+{
+	if (urb)
+		mock_urb_put(urb);
+}
+
+void usb_fill_bulk_urb(struct urb *urb, struct usb_device *dev,
+		       unsigned int pipe, void *buffer, int length,
+		       usb_complete_t complete, void *context)
+{
+	urb->dev = dev;
+	urb->pipe = pipe;
+	urb->transfer_buffer = buffer;
+	urb->transfer_buffer_length = length;
+	urb->complete = complete;
+	urb->context = context;
+}
+
+void usb_fill_int_urb(struct urb *urb, struct usb_device *dev,
+		      unsigned int pipe, void *buffer, int length,
+		      usb_complete_t complete, void *context, int interval)
+{
+	usb_fill_bulk_urb(urb, dev, pipe, buffer, length, complete, context);
+	urb->interval = interval;
+}
+
+int usb_submit_urb(struct urb *urb, gfp_t flags)
+{
+	int status;
+
+	urb->refcount++;
+	urb->actual_length = 0;
+
+	if (urb->pipe & MOCK_PIPE_INT) {
+		status = -EAGAIN;
+	} else if (urb->pipe & USB_DIR_IN) {
+		status = mock_bulk_in(urb->transfer_buffer,
+				      urb->transfer_buffer_length,
+				      &urb->actual_length);
+	} else {
+		status = mock_bulk_out(urb->transfer_buffer,
+				       urb->transfer_buffer_length);
+		if (!status)
+			urb->actual_length = urb->transfer_buffer_length;
+	}
+
+	/* Nothing to send yet: the URB stays posted, like on a NAK */
+	if (status == -EAGAIN) {
+		urb->status = -EINPROGRESS;
+		list_add_tail(&urb->pending, &mock_pending);
+		return 0;
+	}
+
+	mock_giveback(urb, status);
+	return 0;
+}
+
+void usb_kill_urb(struct urb *urb)
+{
+	struct urb *p;
+
+	list_for_each_entry(p, &mock_pending, pending) {
+		if (p == urb) {
+			list_del(&urb->pending);
+			mock_giveback(urb, -ENOENT);
+			return;
+		}
+	}
+}
+
+void init_usb_anchor(struct usb_anchor *anchor)
+{
+}
+
+void usb_anchor_urb(struct urb *urb, struct usb_anchor *anchor)
+{
+	urb->refcount++;
+	urb->anchor = anchor;
+}
+
+void usb_unanchor_urb(struct urb *urb)
+{
+	if (!urb->anchor)
+		return;
+	urb->anchor = NULL;
+	mock_urb_put(urb);
+}
+
+void usb_kill_anchored_urbs(struct usb_anchor *anchor)
+{
+	struct urb *urb;
+	struct urb *n;
+
+	list_for_each_entry_safe(urb, n, &mock_pending, pending) {
+		if (urb->anchor == anchor) {
+			list_del(&urb->pending);
+			mock_giveback(urb, -ENOENT);
+		}
+	}
+}
+
+/* Nothing completes asynchronously here, unlinking is killing */
+void usb_unlink_anchored_urbs(struct usb_anchor *anchor)
+{
+	struct urb *urb;
+	struct urb *n;
+
+	list_for_each_entry_safe(urb, n, &mock_pending, pending) {
+		if (urb->anchor == anchor) {
+			list_del(&urb->pending);
+			mock_giveback(urb, -ECONNRESET);
+		}
+	}
+}
+
+int usb_wait_anchor_empty_timeout(struct usb_anchor *anchor,
+				  unsigned int timeout)
+{
+	struct urb *urb;
+
+	list_for_each_entry(urb, &mock_pending, pending)
+		if (urb->anchor == anchor)
+			return 0;
+	return 1;
+}
+
+int usb_bulk_msg(struct usb_device *dev, unsigned int pipe, void *data,
+		 int len, int *actual_length, int timeout)
+{
+	u32 actual = 0;
+	int status;
+
+	if (pipe & USB_DIR_IN) {
+		status = mock_bulk_in(data, len, &actual);
+		if (status == -EAGAIN)
+			status = -ETIMEDOUT;
+	} else {
+		status = mock_bulk_out(data, len);
+		if (!status)
+			actual = len;
+	}
+
+	*actual_length = actual;
+	return status;
+}
+
+/* Every class request succeeds, with nothing else to report */
+int usb_control_msg(struct usb_device *dev, unsigned int pipe, u8 request,
+		    u8 requesttype, u16 value, u16 index, void *data,
+		    u16 size, int timeout)
+{
+	mock_stats.control++;
+	if (!(requesttype & USB_DIR_IN))
+		return 0;
+
+	memset(data, 0, size);
+	if (size)
+		((u8 *)data)[0] = USBTMC_STATUS_SUCCESS;
+	if (request == USBTMC_REQUEST_INITIATE_CLEAR ||
+	    request == USBTMC_REQUEST_CHECK_CLEAR_STATUS)
+		mock_len = 0;
+	return size;
+}
+
+int usb_get_current_frame_number(struct usb_device *dev)
+{
+	return -1;
+}
+
+struct usb_device *usb_get_dev(struct usb_device *dev)
+{
+	return dev;
+}
+
+void usb_put_dev(struct usb_device *dev)
+{
+}
+
+int usb_register(struct usb_driver *driver)
+{
+	return 0;
+}
+
+void usb_deregister(struct usb_driver *driver)
+{
+}
+
+int usb_register_dev(struct usb_interface *intf,
+		     struct usb_class_driver *class_driver)
+{
+	intf->minor = 0;
+	mock_registered = true;
+	return 0;
+}
+
+void usb_deregister_dev(struct usb_interface *intf,
+			struct usb_class_driver *class_driver)
+{
+	mock_registered = false;
+}
+
+struct usb_interface *usb_find_interface(struct usb_driver *driver,
+					 int minor)
+{
+	return mock_registered && minor == mock_intf.minor ? &mock_intf : NULL;
+}
@@ -0,0 +1,35 @@
+/**
+ * mock_usb.h - Scripted USBTMC device behind the mock USB core
+ *
+ * Bulk and control transfers complete before usb_submit_urb() returns.
+ * The device answers every command message (a DEV_DEP_MSG_OUT transfer
+ * with EOM) with the response set by mock_usb_respond(), delivered in
+ * DEV_DEP_MSG_IN transfers of the sizes the driver requests. Control
+ * requests succeed. The interrupt in URB stays posted until it is killed.
+ * See ../usbtmc.c for license details.
+ */
+
+#ifndef __MOCK_USB_H
+#define __MOCK_USB_H
+
+#include "mock_kernel.h"
+
+struct mock_usb_stats {
+	unsigned long bulk_out;		/* transfers */
+	unsigned long bulk_in;
+	unsigned long control;
+	unsigned long bytes_out;	/* headers included */
+	unsigned long bytes_in;
+	unsigned long messages;		/* commands with EOM */
+};
+
+/* The single device, with an interrupt in endpoint if int_in is set */
+struct usb_interface *mock_usb_interface(bool int_in);
+
+/* Response to every following command; data is not copied */
+void mock_usb_respond(const void *data, size_t len);
+
+void mock_usb_stats(struct mock_usb_stats *stats);
+void mock_usb_reset_stats(void);
+
+#endif /* __MOCK_USB_H */
@@ -0,0 +1,199 @@
+/**
+ * usbtmc_hotpath.c - Time the read and write paths of usbtmc.c without a bus
+ *
+ * Builds the driver in user space against the mock USB core of mock_usb.c,
+ * where every transfer completes before usb_submit_urb() returns, probes
+ * the mock device and calls the file operations directly. What is left is
+ * the cost of the driver itself per read() and write(): header building,
+ * chunking, copying, URB setup and completion. Measured:
+ *
+ *	query		write() of a short command plus read() of its answer
+ *	write		write() throughput for a range of sizes
+ *	write_behind	the same with USBTMC_IOCTL_WRITE_BEHIND set
+ *	read		read() throughput for a range of response sizes
+ *
+ * Results are written to stdout as JSON, in the format of
+ * ../../bench/usbtmc_bench, with the bulk transfers made per call.
+ * See ../usbtmc.c for license details.
+ */
+
+#include "../usbtmc.c"
+#include "mock_usb.h"
+
+#include <unistd.h>
+
+#define HOTPATH_MAX_SIZE	(1024 * 1024)
+
+static const size_t hotpath_sizes[] = { 64, 4096, 65536, 1024 * 1024 };
+
+static struct inode hotpath_inode;
+static struct file hotpath_file;
+static loff_t hotpath_pos;
+static unsigned int results;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void result(const char *test, size_t size, unsigned long calls,
+		   double ns)
+{
+	struct mock_usb_stats stats;
+
+	mock_usb_stats(&stats);
+	printf("%s\n    {\"test\": \"%s\", \"size\": %zu, \"calls\": %lu, "
+	       "\"ns_per_call\": %.1f, \"ns_per_byte\": %.4f, "
+	       "\"bulk_out_per_call\": %.2f, \"bulk_in_per_call\": %.2f}",
+	       results++ ? "," : "", test, size, calls, ns / calls,
+	       size ? ns / calls / size : 0.0,
+	       (double)stats.bulk_out / calls, (double)stats.bulk_in / calls);
+}
+
+static void fail(const char *what, ssize_t retval)
+{
+	fprintf(stderr, "%s: %zd\n", what, retval);
+	exit(1);
+}
+
+static void hotpath_write(const void *buf, size_t len)
+{
+	ssize_t retval = fops.write(&hotpath_file, buf, len,
+				     &hotpath_pos);
+
+	if (retval != (ssize_t)len)
+		fail("write", retval);
+}
+
+static void hotpath_read(void *buf, size_t len)
+{
+	ssize_t retval = fops.read(&hotpath_file, buf, len,
+				    &hotpath_pos);
+
+	if (retval != (ssize_t)len)
+		fail("read", retval);
+}
+
+static void test_query(unsigned long iterations)
+{
+	static const char query[] = "*IDN?\n";
+	static const char answer[] = "MOCK,USBTMC,0,1.0\n";
+	char buf[64];
+	unsigned long i;
+	double start;
+
+	mock_usb_respond(answer, sizeof(answer) - 1);
+	mock_usb_reset_stats();
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		hotpath_write(query, sizeof(query) - 1);
+		hotpath_read(buf, sizeof(answer) - 1);
+	}
+	result("query", sizeof(answer) - 1, iterations, now() - start);
+}
+
+static void test_write(const char *test, u8 *buf, unsigned long iterations)
+{
+	unsigned long calls;
+	unsigned long i;
+	unsigned int n;
+	double start;
+
+	mock_usb_respond(NULL, 0);
+	for (n = 0; n < ARRAY_SIZE(hotpath_sizes); n++) {
+		/* Same amount of data for every size */
+		calls = max(1UL, iterations * 64 / hotpath_sizes[n]);
+		mock_usb_reset_stats();
+		start = now();
+		for (i = 0; i < calls; i++)
+			hotpath_write(buf, hotpath_sizes[n]);
+		result(test, hotpath_sizes[n], calls, now() - start);
+	}
+}
+
+/* Only read() is timed, the command asking for the data is not */
+static void test_read(u8 *buf, unsigned long iterations)
+{
+	static const char query[] = "DATA?\n";
+	unsigned long calls;
+	unsigned long i;
+	unsigned int n;
+	double start;
+	double ns;
+
+	for (n = 0; n < ARRAY_SIZE(hotpath_sizes); n++) {
+		mock_usb_respond(buf, hotpath_sizes[n]);
+		calls = max(1UL, iterations * 64 / hotpath_sizes[n]);
+		ns = 0;
+		mock_usb_reset_stats();
+		for (i = 0; i < calls; i++) {
+			hotpath_write(query, sizeof(query) - 1);
+			start = now();
+			hotpath_read(buf + HOTPATH_MAX_SIZE, hotpath_sizes[n]);
+			ns += now() - start;
+		}
+		/* bulk_out_per_call includes the command */
+		result("read", hotpath_sizes[n], calls, ns);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 100000;
+	u8 enable = 1;
+	u8 *buf;
+	int retval;
+	int c;
+
+	while ((c = getopt(argc, argv, "i:")) != -1) {
+		switch (c) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			iterations = 0;
+			break;
+		}
+	}
+	if (!iterations || optind != argc) {
+		fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+		return 1;
+	}
+
+	/* Response data, then room to read it back */
+	buf = malloc(2 * HOTPATH_MAX_SIZE);
+	if (!buf)
+		return 1;
+	memset(buf, 'x', 2 * HOTPATH_MAX_SIZE);
+
+	retval = usbtmc_init();
+	if (retval)
+		fail("init", retval);
+	retval = usbtmc_probe(mock_usb_interface(true), &usbtmc_devices[0]);
+	if (retval)
+		fail("probe", retval);
+	retval = fops.open(&hotpath_inode, &hotpath_file);
+	if (retval)
+		fail("open", retval);
+
+	printf("{\n  \"results\": [");
+	test_query(iterations);
+	test_write("write", buf, iterations);
+	test_read(buf, iterations);
+
+	retval = fops.unlocked_ioctl(&hotpath_file, USBTMC_IOCTL_WRITE_BEHIND,
+				     (unsigned long)&enable);
+	if (retval)
+		fail("write behind", retval);
+	test_write("write_behind", buf, iterations);
+	printf("\n  ]\n}\n");
+
+	fops.release(&hotpath_inode, &hotpath_file);
+	usbtmc_disconnect(mock_usb_interface(true));
+	usbtmc_exit();
+	free(buf);
+	return 0;
+}
@@ -26,8 +26,26 @@
 #include <linux/uaccess.h>
 #include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
+#include <linux/list.h>
+#include <linux/bitmap.h>
+#include <linux/poll.h>
+#include <linux/miscdevice.h>
+#include <linux/anon_inodes.h>
+#include <linux/file.h>
 #include <linux/usb.h>
 #include <linux/usb/tmc.h>
+#include "usbtmc.h"
+#include "usbtmc_msg.h"
 
 
 #define USBTMC_MINOR_BASE	176
@@ -48,6 +66,30 @@
  */
 #define USBTMC_MAX_READS_TO_CLEAR_BULK_IN	100
 
+/* Number of bulk in URBs kept posted while streaming from a talk-only device */
+#define USBTMC_STREAM_URBS	4
+
+/* Size of the ring buffer holding streamed data until it is read */
+#define USBTMC_STREAM_RING_SIZE	65536
+
+/*
+ * Longest time (in milliseconds) that corked data is held back before it
+ * is sent anyway, as with TCP_CORK.
+ */
+#define USBTMC_CORK_DELAY	200
+
+/* Number of bulk out transfers that may be queued in write-behind mode */
+#define USBTMC_WRITE_BEHIND_URBS	16
+
+/* Number of SRQ events each open control node can hold */
+#define USBTMC_CTL_QUEUE_SIZE	256
+
+/* Number of minor numbers of the USB major, for the control node */
+#define USBTMC_CTL_MINORS	256
+
+/* Limits of device groups, see usbtmc_group_write() */
+#define USBTMC_GROUP_MAX_WRITE	65536
+
 static struct usb_device_id usbtmc_devices[] = {
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 0), },
 	{ USB_INTERFACE_INFO(USB_CLASS_APP_SPEC, 3, 1), },
@@ -68,6 +110,21 @@ struct usbtmc_dev_capabilities {
 	__u8 usb488_device_capabilities;
 };
 
+/* Bits of interface_capabilities, see table 37 of the USBTMC specification */
+#define USBTMC_CAP_LISTEN_ONLY		0x01
+#define USBTMC_CAP_TALK_ONLY		0x02
+#define USBTMC_CAP_INDICATOR_PULSE	0x04
+
+/*
+ * Bulk out transfers sent without waiting for them, see usbtmc_out_submit().
+ * The error is protected by out_lock.
+ */
+struct usbtmc_out_queue {
+	struct usb_anchor anchor;
+	atomic_t pending;		/* submitted, not completed URBs */
+	int error;			/* first error since it was taken */
+};
+
 /* This structure holds private data for each USBTMC device. One copy is
  * allocated for each USBTMC device in the driver's probe function.
  */
@@ -79,6 +136,13 @@ struct usbtmc_device_data {
 	unsigned int bulk_in;
 	unsigned int bulk_out;
 
+	/* interrupt in endpoint of USB488 devices, for SRQ notifications */
+	unsigned int iin_ep;		/* 0 if there is none */
+	u16 iin_wMaxPacketSize;
+	u8 iin_interval;
+	struct urb *iin_urb;
+	u8 *iin_buffer;
+
 	u8 bTag;
 	u8 bTag_last_write;	/* needed for abort */
 	u8 bTag_last_read;	/* needed for abort */
@@ -90,6 +154,52 @@ struct usbtmc_device_data {
 
 	bool zombie; /* fd of disconnected device */
 
+	/* URB completion times of the last command and its response */
+	struct usbtmc_msg_timestamps timestamps;
+
+	/* streaming from talk-only devices, see usbtmc_stream_start() */
+	struct file *stream_owner;	/* NULL if not streaming */
+	struct urb *stream_urbs[USBTMC_STREAM_URBS];
+	struct usb_anchor stream_anchor;
+	wait_queue_head_t stream_wait;
+	spinlock_t stream_lock;		/* protects the ring buffer state */
+	u8 *stream_ring;
+	size_t stream_head;
+	size_t stream_tail;
+	size_t stream_count;
+	u32 stream_remaining;		/* payload left in current transfer */
+	int stream_error;
+	int stream_posted;		/* URBs submitted */
+	int stream_n_idle;		/* URBs waiting for room in the ring */
+	struct urb *stream_idle[USBTMC_STREAM_URBS];
+	bool stream_stopping;		/* no URB may be posted again */
+
+	/* write coalescing, see usbtmc_cork() */
+	struct file *cork_owner;	/* NULL if not corked */
+	u8 *cork_buffer;		/* header room + pending payload */
+	int cork_fill;
+	int cork_error;			/* from a delayed flush */
+	struct delayed_work cork_work;
+
+	/* write-behind mode, see usbtmc_write_behind() */
+	struct file *write_behind_owner;	/* NULL if off */
+	struct usbtmc_out_queue out_queue;
+	struct usbtmc_out_queue group_queue;	/* of group writes */
+	wait_queue_head_t out_wait;
+	spinlock_t out_lock;		/* protects queue errors, timestamps */
+
+	/* message being spliced in, see usbtmc_splice_write() */
+	struct file *splice_owner;	/* NULL if none */
+	bool splice_running;		/* a splice_write() call is */
+
+	/* last SRQ notification, see usbtmc_interrupt() */
+	wait_queue_head_t srq_wait;
+	spinlock_t srq_lock;
+	u32 srq_seq;			/* number of SRQs received */
+	u8 srq_stb;
+	u8 stb;				/* last status byte of any notification */
+	u64 stb_ns;			/* and its arrival, 0 if none yet */
+
 	struct usbtmc_dev_capabilities	capabilities;
 	struct kref kref;
 	struct mutex io_mutex;	/* only one i/o function running at a time */
@@ -98,11 +208,21 @@ struct usbtmc_device_data {
 
 /* Forward declarations */
 static struct usb_driver usbtmc_driver;
+static void usbtmc_stream_stop(struct usbtmc_device_data *data);
+static int usbtmc_cork_flush(struct usbtmc_device_data *data);
+static int usbtmc_uncork(struct usbtmc_device_data *data);
+static int usbtmc_write_behind_drain(struct usbtmc_device_data *data);
+static int usbtmc_splice_busy(struct usbtmc_device_data *data);
+static int usbtmc_group_create(void __user *arg);
 
 static void usbtmc_delete(struct kref *kref)
 {
 	struct usbtmc_device_data *data = to_usbtmc_data(kref);
 
+	cancel_delayed_work_sync(&data->cork_work);
+	kfree(data->cork_buffer);
+	usb_free_urb(data->iin_urb);
+	kfree(data->iin_buffer);
 	usb_put_dev(data->usb_dev);
 	kfree(data);
 }
@@ -135,10 +255,83 @@ static int usbtmc_release(struct inode *inode, struct file *file)
 {
 	struct usbtmc_device_data *data = file->private_data;
 
+	mutex_lock(&data->io_mutex);
+	if (data->stream_owner == file)
+		usbtmc_stream_stop(data);
+	if (data->cork_owner == file)
+		usbtmc_uncork(data);
+	if (data->write_behind_owner == file)
+		data->write_behind_owner = NULL;
+	if (data->splice_owner == file)
+		data->splice_owner = NULL;
+	/* Queued URBs must not outlive the last reference to data */
+	if (!data->zombie)
+		usbtmc_write_behind_drain(data);
+	mutex_unlock(&data->io_mutex);
+
 	kref_put(&data->kref, usbtmc_delete);
 	return 0;
 }
 
+/* Context of a bulk URB submitted by usbtmc_bulk_msg() */
+struct usbtmc_urb_context {
+	struct completion done;
+	struct usbtmc_stamp stamp;
+};
+
+static void usbtmc_bulk_complete(struct urb *urb)
+{
+	struct usbtmc_urb_context *ctx = urb->context;
+	struct timespec ts;
+
+	/* Take the time here, before the waiting task is rescheduled */
+	getrawmonotonic(&ts);
+	ctx->stamp.ns = timespec_to_ns(&ts);
+	ctx->stamp.frame = usb_get_current_frame_number(urb->dev);
+	complete(&ctx->done);
+}
+
+/*
+ * Same as usb_bulk_msg(), but records the completion time of the URB in
+ * *stamp (if not NULL) when the transfer succeeds.
+ */
+static int usbtmc_bulk_msg(struct usbtmc_device_data *data, unsigned int pipe,
+			   void *buffer, int len, int *actual,
+			   struct usbtmc_stamp *stamp)
+{
+	struct usbtmc_urb_context ctx;
+	struct urb *urb;
+	int retval;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb)
+		return -ENOMEM;
+
+	init_completion(&ctx.done);
+	usb_fill_bulk_urb(urb, data->usb_dev, pipe, buffer, len,
+			  usbtmc_bulk_complete, &ctx);
+
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval)
+		goto exit;
+
+	if (!wait_for_completion_timeout(&ctx.done,
+					 msecs_to_jiffies(USBTMC_TIMEOUT))) {
+		usb_kill_urb(urb);
+		retval = urb->status == -ENOENT ? -ETIMEDOUT : urb->status;
+	} else {
+		retval = urb->status;
+	}
+
+	*actual = urb->actual_length;
+	if (stamp && !retval)
+		*stamp = ctx.stamp;
+
+exit:
+	usb_free_urb(urb);
+	return retval;
+}
+
 static int usbtmc_ioctl_abort_bulk_in(struct usbtmc_device_data *data)
 {
 	u8 *buffer;
@@ -366,156 +559,514 @@ exit:
 	return rv;
 }
 
-static ssize_t usbtmc_read(struct file *filp, char __user *buf,
-			   size_t count, loff_t *f_pos)
+/*
+ * Talk-only devices send DEV_DEP_MSG_IN transfers without being asked for
+ * them. Instead of a REQUEST_DEV_DEP_MSG_IN round trip per chunk, the
+ * driver keeps USBTMC_STREAM_URBS bulk in URBs posted while streaming and
+ * collects the payload in a ring buffer which is drained by read().
+ *
+ * A URB is only posted while the ring has room for the data of all posted
+ * URBs, so nothing is ever dropped. When the reader falls behind, the URBs
+ * stay idle, the device's packets are NAKed and it has to wait; read()
+ * posts them again once it has made room.
+ */
+
+/* Whether one more URB may be posted. Called with stream_lock held. */
+static bool usbtmc_stream_room(struct usbtmc_device_data *data)
 {
-	struct usbtmc_device_data *data;
-	struct device *dev;
-	u32 n_characters;
+	return data->stream_count +
+	       (data->stream_posted + 1) * USBTMC_SIZE_IOBUFFER <=
+	       USBTMC_STREAM_RING_SIZE;
+}
+
+/*
+ * Append data to the stream ring buffer, which has room for it. Called
+ * with stream_lock held.
+ */
+static void usbtmc_stream_put(struct usbtmc_device_data *data,
+			      const u8 *src, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = min_t(size_t, len,
+			  USBTMC_STREAM_RING_SIZE - data->stream_head);
+		memcpy(data->stream_ring + data->stream_head, src, n);
+		data->stream_head = (data->stream_head + n) %
+				    USBTMC_STREAM_RING_SIZE;
+		data->stream_count += n;
+		src += n;
+		len -= n;
+	}
+}
+
+static void usbtmc_stream_complete(struct urb *urb)
+{
+	struct usbtmc_device_data *data = urb->context;
+	u8 *buffer = urb->transfer_buffer;
+	struct usbtmc_bulk_header *hdr;
+	u32 actual = urb->actual_length;
+	unsigned long flags;
+	bool resubmit;
+	u32 n;
+	int status = urb->status;
+
+	switch (status) {
+	case 0:
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* killed by usbtmc_stream_stop() or by a disconnect */
+		return;
+	default:
+		dev_err(&data->intf->dev, "Stream URB failed, error %d\n",
+			status);
+		/* Left idle, read() posts it again after the error */
+		spin_lock_irqsave(&data->stream_lock, flags);
+		data->stream_posted--;
+		data->stream_idle[data->stream_n_idle++] = urb;
+		data->stream_error = status;
+		spin_unlock_irqrestore(&data->stream_lock, flags);
+		wake_up_interruptible(&data->stream_wait);
+		return;
+	}
+
+	spin_lock_irqsave(&data->stream_lock, flags);
+	data->stream_posted--;
+
+	if (!data->stream_remaining) {
+		/* Start of a new transfer, strip the bulk in header */
+		hdr = (struct usbtmc_bulk_header *)buffer;
+		if (actual >= USBTMC_HEADER_SIZE &&
+		    hdr->MsgID == USBTMC_MSGID_DEV_DEP_MSG_IN) {
+			data->stream_remaining = le32_to_cpu(hdr->TransferSize);
+			buffer += USBTMC_HEADER_SIZE;
+			actual -= USBTMC_HEADER_SIZE;
+		} else {
+			/* Not a DEV_DEP_MSG_IN header, drop the packet */
+			actual = 0;
+		}
+	}
+
+	n = min(actual, data->stream_remaining);
+	usbtmc_stream_put(data, buffer, n);
+	data->stream_remaining -= n;
+
+	/* A short packet ends the transfer, alignment bytes included */
+	if (urb->actual_length < urb->transfer_buffer_length)
+		data->stream_remaining = 0;
+
+	/*
+	 * Without room the URB waits for read(), the device is NAKed. It is
+	 * anchored under the lock, so that usbtmc_stream_kill() either finds
+	 * it on the anchor or keeps it from being posted again.
+	 */
+	resubmit = !data->stream_stopping && usbtmc_stream_room(data);
+	if (resubmit) {
+		data->stream_posted++;
+		usb_anchor_urb(urb, &data->stream_anchor);
+	} else {
+		data->stream_idle[data->stream_n_idle++] = urb;
+	}
+
+	spin_unlock_irqrestore(&data->stream_lock, flags);
+	wake_up_interruptible(&data->stream_wait);
+
+	if (!resubmit)
+		return;
+
+	status = usb_submit_urb(urb, GFP_ATOMIC);
+	if (!status)
+		return;
+	usb_unanchor_urb(urb);
+
+	spin_lock_irqsave(&data->stream_lock, flags);
+	data->stream_posted--;
+	data->stream_idle[data->stream_n_idle++] = urb;
+	/* Refused while being killed is no error */
+	if (!data->stream_stopping) {
+		dev_err(&data->intf->dev, "Stream URB failed, error %d\n",
+			status);
+		data->stream_error = status;
+	}
+	spin_unlock_irqrestore(&data->stream_lock, flags);
+	wake_up_interruptible(&data->stream_wait);
+}
+
+/*
+ * Kill the posted URBs for good: completions that race with the kill do
+ * not post theirs again. usbtmc_stream_submit() lifts this.
+ */
+static void usbtmc_stream_kill(struct usbtmc_device_data *data)
+{
+	spin_lock_irq(&data->stream_lock);
+	data->stream_stopping = true;
+	spin_unlock_irq(&data->stream_lock);
+
+	usb_kill_anchored_urbs(&data->stream_anchor);
+}
+
+/* Post idle URBs while the ring has room for their data */
+static int usbtmc_stream_refill(struct usbtmc_device_data *data,
+				gfp_t mem_flags)
+{
+	struct urb *urb;
+	int rv;
+
+	for (;;) {
+		spin_lock_irq(&data->stream_lock);
+		if (!data->stream_n_idle || !usbtmc_stream_room(data)) {
+			spin_unlock_irq(&data->stream_lock);
+			return 0;
+		}
+		urb = data->stream_idle[--data->stream_n_idle];
+		data->stream_posted++;
+		spin_unlock_irq(&data->stream_lock);
+
+		usb_anchor_urb(urb, &data->stream_anchor);
+		rv = usb_submit_urb(urb, mem_flags);
+		if (rv) {
+			dev_err(&data->intf->dev,
+				"usb_submit_urb returned %d\n", rv);
+			usb_unanchor_urb(urb);
+			spin_lock_irq(&data->stream_lock);
+			data->stream_posted--;
+			data->stream_idle[data->stream_n_idle++] = urb;
+			spin_unlock_irq(&data->stream_lock);
+			return rv;
+		}
+	}
+}
+
+/* Post all URBs, none of which may be pending. Called with io_mutex held. */
+static int usbtmc_stream_submit(struct usbtmc_device_data *data,
+				gfp_t mem_flags)
+{
+	int n;
+
+	spin_lock_irq(&data->stream_lock);
+	for (n = 0; n < USBTMC_STREAM_URBS; n++)
+		data->stream_idle[n] = data->stream_urbs[n];
+	data->stream_n_idle = USBTMC_STREAM_URBS;
+	data->stream_posted = 0;
+	data->stream_stopping = false;
+	spin_unlock_irq(&data->stream_lock);
+
+	return usbtmc_stream_refill(data, mem_flags);
+}
+
+/* Called with io_mutex held */
+static int usbtmc_stream_start(struct usbtmc_device_data *data,
+			       struct file *filp)
+{
+	struct urb *urb;
 	u8 *buffer;
-	int actual;
-	size_t done;
-	size_t remaining;
-	int retval;
-	size_t this_part;
+	int rv;
+	int n;
 
-	/* Get pointer to private data structure */
-	data = filp->private_data;
-	dev = &data->intf->dev;
+	if (!(data->capabilities.interface_capabilities &
+	      USBTMC_CAP_TALK_ONLY))
+		return -EPERM;
 
-	buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
-	if (!buffer)
+	if (data->stream_owner || data->splice_owner)
+		return -EBUSY;
+
+	data->stream_ring = kmalloc(USBTMC_STREAM_RING_SIZE, GFP_KERNEL);
+	if (!data->stream_ring)
 		return -ENOMEM;
 
+	data->stream_head = 0;
+	data->stream_tail = 0;
+	data->stream_count = 0;
+	data->stream_remaining = 0;
+	data->stream_error = 0;
+	data->stream_posted = 0;
+	data->stream_n_idle = 0;
+	memset(data->stream_urbs, 0, sizeof(data->stream_urbs));
+	data->stream_owner = filp;
+
+	for (n = 0; n < USBTMC_STREAM_URBS; n++) {
+		urb = usb_alloc_urb(0, GFP_KERNEL);
+		buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+		if (!urb || !buffer) {
+			usb_free_urb(urb);
+			kfree(buffer);
+			rv = -ENOMEM;
+			goto error;
+		}
+
+		usb_fill_bulk_urb(urb, data->usb_dev,
+				  usb_rcvbulkpipe(data->usb_dev,
+						  data->bulk_in),
+				  buffer, USBTMC_SIZE_IOBUFFER,
+				  usbtmc_stream_complete, data);
+		urb->transfer_flags |= URB_FREE_BUFFER;
+		data->stream_urbs[n] = urb;
+	}
+
+	rv = usbtmc_stream_submit(data, GFP_KERNEL);
+	if (rv)
+		goto error;
+
+	return 0;
+
+error:
+	usbtmc_stream_stop(data);
+	return rv;
+}
+
+/* Called with io_mutex held */
+static void usbtmc_stream_stop(struct usbtmc_device_data *data)
+{
+	int n;
+
+	if (!data->stream_owner)
+		return;
+
+	usbtmc_stream_kill(data);
+	for (n = 0; n < USBTMC_STREAM_URBS; n++) {
+		usb_free_urb(data->stream_urbs[n]);
+		data->stream_urbs[n] = NULL;
+	}
+
+	spin_lock_irq(&data->stream_lock);
+	kfree(data->stream_ring);
+	data->stream_ring = NULL;
+	data->stream_owner = NULL;
+	spin_unlock_irq(&data->stream_lock);
+
+	wake_up_interruptible(&data->stream_wait);
+}
+
+static ssize_t usbtmc_stream_read(struct usbtmc_device_data *data,
+				  struct file *filp, char __user *buf,
+				  size_t count)
+{
+	size_t avail;
+	size_t done;
+	size_t n;
+	int retval;
+	int rv;
+
+	/* Wait without io_mutex, so that the stream can still be stopped */
+	if (filp->f_flags & O_NONBLOCK) {
+		if (!data->stream_count && !data->stream_error)
+			return -EAGAIN;
+	} else {
+		retval = wait_event_interruptible(data->stream_wait,
+						  data->stream_count ||
+						  data->stream_error ||
+						  !data->stream_owner);
+		if (retval)
+			return retval;
+	}
+
 	mutex_lock(&data->io_mutex);
 	if (data->zombie) {
 		retval = -ENODEV;
 		goto exit;
 	}
 
-	remaining = count;
+	/* Stream stopped while waiting */
+	if (!data->stream_owner) {
+		retval = 0;
+		goto exit;
+	}
+
+	spin_lock_irq(&data->stream_lock);
+	avail = min(count, data->stream_count);
+	retval = 0;
+	if (!avail) {
+		/* Report errors once all data before them has been read */
+		retval = data->stream_error;
+		data->stream_error = 0;
+	}
+	spin_unlock_irq(&data->stream_lock);
+
+	if (!avail)
+		goto refill;
+
+	/* Only the reader moves stream_tail, so copy without the lock */
 	done = 0;
+	while (done < avail) {
+		n = min_t(size_t, avail - done,
+			  USBTMC_STREAM_RING_SIZE - data->stream_tail);
+		if (copy_to_user(buf + done,
+				 data->stream_ring + data->stream_tail, n))
+			break;
+		data->stream_tail = (data->stream_tail + n) %
+				    USBTMC_STREAM_RING_SIZE;
+		done += n;
+	}
 
-	while (remaining > 0) {
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12 - 3)
-			this_part = USBTMC_SIZE_IOBUFFER - 12 - 3;
-		else
-			this_part = remaining;
+	spin_lock_irq(&data->stream_lock);
+	data->stream_count -= done;
+	spin_unlock_irq(&data->stream_lock);
 
-		/* Setup IO buffer for DEV_DEP_MSG_IN message
-		 * Refer to class specs for details
-		 */
-		buffer[0] = 2;
-		buffer[1] = data->bTag;
-		buffer[2] = ~(data->bTag);
-		buffer[3] = 0; /* Reserved */
-		buffer[4] = (this_part) & 255;
-		buffer[5] = ((this_part) >> 8) & 255;
-		buffer[6] = ((this_part) >> 16) & 255;
-		buffer[7] = ((this_part) >> 24) & 255;
-		buffer[8] = data->TermCharEnabled * 2;
-		/* Use term character? */
-		buffer[9] = data->TermChar;
-		buffer[10] = 0; /* Reserved */
-		buffer[11] = 0; /* Reserved */
-
-		/* Send bulk URB */
-		retval = usb_bulk_msg(data->usb_dev,
-				      usb_sndbulkpipe(data->usb_dev,
-						      data->bulk_out),
-				      buffer, 12, &actual, USBTMC_TIMEOUT);
-
-		/* Store bTag (in case we need to abort) */
-		data->bTag_last_write = data->bTag;
-
-		/* Increment bTag -- and increment again if zero */
-		data->bTag++;
-		if (!data->bTag)
-			(data->bTag)++;
-
-		if (retval < 0) {
-			dev_err(dev, "usb_bulk_msg returned %d\n", retval);
-			if (data->auto_abort)
-				usbtmc_ioctl_abort_bulk_out(data);
-			goto exit;
-		}
+	retval = done ? done : -EFAULT;
 
-		/* Send bulk URB */
-		retval = usb_bulk_msg(data->usb_dev,
-				      usb_rcvbulkpipe(data->usb_dev,
-						      data->bulk_in),
-				      buffer, USBTMC_SIZE_IOBUFFER, &actual,
-				      USBTMC_TIMEOUT);
+refill:
+	/* Post the URBs that waited for room or failed, errors come next */
+	rv = usbtmc_stream_refill(data, GFP_KERNEL);
+	if (rv) {
+		spin_lock_irq(&data->stream_lock);
+		data->stream_error = rv;
+		spin_unlock_irq(&data->stream_lock);
+	}
 
-		/* Store bTag (in case we need to abort) */
-		data->bTag_last_read = data->bTag;
+exit:
+	mutex_unlock(&data->io_mutex);
+	return retval;
+}
 
-		if (retval < 0) {
-			dev_err(dev, "Unable to read data, error %d\n", retval);
-			if (data->auto_abort)
-				usbtmc_ioctl_abort_bulk_in(data);
-			goto exit;
-		}
+/*
+ * Request up to size bytes with a REQUEST_DEV_DEP_MSG_IN message and read
+ * the response into buffer. On success the payload starts at buffer + 12,
+ * its validated length is stored in *n_characters and *eom tells whether
+ * the device ended the message. Called with io_mutex held.
+ */
+static int usbtmc_read_transfer(struct usbtmc_device_data *data, u8 *buffer,
+				int buffer_size, size_t size,
+				u32 *n_characters, bool *eom)
+{
+	struct usbtmc_bulk_header *hdr = (struct usbtmc_bulk_header *)buffer;
+	struct device *dev = &data->intf->dev;
+	struct usbtmc_stamp stamp;
+	int actual;
+	int retval;
+	int problems;
+
+	usbtmc_msg_request_in(hdr, data->bTag, size, data->TermCharEnabled,
+			      data->TermChar);
+
+	/* Send bulk URB */
+	retval = usbtmc_bulk_msg(data,
+				 usb_sndbulkpipe(data->usb_dev,
+						 data->bulk_out),
+				 buffer, USBTMC_HEADER_SIZE, &actual, NULL);
+
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_write = data->bTag;
+	data->bTag = usbtmc_msg_next_btag(data->bTag);
+
+	if (retval < 0) {
+		dev_err(dev, "usb_bulk_msg returned %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_out(data);
+		return retval;
+	}
 
-		/* How many characters did the instrument send? */
-		n_characters = buffer[4] +
-			       (buffer[5] << 8) +
-			       (buffer[6] << 16) +
-			       (buffer[7] << 24);
+	/* Send bulk URB */
+	retval = usbtmc_bulk_msg(data,
+				 usb_rcvbulkpipe(data->usb_dev,
+						 data->bulk_in),
+				 buffer, buffer_size, &actual, &stamp);
 
-		/* Ensure the instrument doesn't lie about it */
-		if(n_characters > actual - 12) {
-			dev_err(dev, "Device lies about message size: %u > %d\n", n_characters, actual - 12);
-			n_characters = actual - 12;
-		}
+	/* Store bTag (in case we need to abort) */
+	data->bTag_last_read = data->bTag;
 
-		/* Ensure the instrument doesn't send more back than requested */
-		if(n_characters > this_part) {
-			dev_err(dev, "Device returns more than requested: %zu > %zu\n", done + n_characters, done + this_part);
-			n_characters = this_part;
-		}
+	if (retval < 0) {
+		dev_err(dev, "Unable to read data, error %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_in(data);
+		return retval;
+	}
 
-		/* Bound amount of data received by amount of data requested */
-		if (n_characters > this_part)
-			n_characters = this_part;
+	/* Remember when the response arrived */
+	if (!(data->timestamps.valid & USBTMC_STAMP_IN_FIRST))
+		data->timestamps.in_first = stamp;
+	data->timestamps.in_last = stamp;
+	data->timestamps.valid |= USBTMC_STAMP_IN_FIRST |
+				  USBTMC_STAMP_IN_LAST;
+	data->timestamps.bTag_in = hdr->bTag;
+	data->timestamps.in_transfers++;
+
+	if (actual < USBTMC_HEADER_SIZE) {
+		dev_err(dev, "Response too short for a header: %d\n", actual);
+		return -EPROTO;
+	}
 
-		/* Copy buffer to user space */
-		if (copy_to_user(buf + done, &buffer[12], n_characters)) {
-			/* There must have been an addressing problem */
-			retval = -EFAULT;
-			goto exit;
+	problems = usbtmc_msg_check_in(hdr, actual, size, n_characters, eom);
+	if (problems & USBTMC_MSG_SIZE_LIE)
+		dev_err(dev, "Device lies about message size: %u > %d\n",
+			le32_to_cpu(hdr->TransferSize),
+			actual - USBTMC_HEADER_SIZE);
+	if (problems & USBTMC_MSG_TOO_LONG)
+		dev_err(dev, "Device returns more than requested: %u > %zu\n",
+			le32_to_cpu(hdr->TransferSize), size);
+	return 0;
+}
+
+/*
+ * Copy len bytes between buffer and a user iovec array, starting offset
+ * bytes into the array. The caller makes sure that the array is large
+ * enough. This lets readv() and writev() treat all of their segments as
+ * one message.
+ */
+static int usbtmc_copy_to_iov(const struct iovec *iov, size_t offset,
+			      const u8 *buffer, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (offset >= iov->iov_len) {
+			offset -= iov->iov_len;
+			iov++;
+			continue;
 		}
 
-		done += n_characters;
-		/* Terminate if end-of-message bit recieved from device */
-		if ((buffer[8] &  0x01) && (actual >= n_characters + 12))
-			remaining = 0;
-		else
-			remaining -= n_characters;
+		n = min(len, iov->iov_len - offset);
+		if (copy_to_user(iov->iov_base + offset, buffer, n))
+			return -EFAULT;
+
+		buffer += n;
+		len -= n;
+		offset = 0;
+		iov++;
 	}
 
-	/* Update file position value */
-	*f_pos = *f_pos + done;
-	retval = done;
+	return 0;
+}
 
-exit:
-	mutex_unlock(&data->io_mutex);
-	kfree(buffer);
-	return retval;
+static int usbtmc_copy_from_iov(u8 *buffer, const struct iovec *iov,
+				size_t offset, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		if (offset >= iov->iov_len) {
+			offset -= iov->iov_len;
+			iov++;
+			continue;
+		}
+
+		n = min(len, iov->iov_len - offset);
+		if (copy_from_user(buffer, iov->iov_base + offset, n))
+			return -EFAULT;
+
+		buffer += n;
+		len -= n;
+		offset = 0;
+		iov++;
+	}
+
+	return 0;
 }
 
-static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
-			    size_t count, loff_t *f_pos)
+static ssize_t usbtmc_read_iov(struct file *filp, const struct iovec *iov,
+			       size_t count, loff_t *f_pos)
 {
 	struct usbtmc_device_data *data;
+	u32 n_characters;
 	u8 *buffer;
+	size_t done;
+	size_t remaining;
 	int retval;
-	int actual;
-	unsigned long int n_bytes;
-	int remaining;
-	int done;
-	int this_part;
+	size_t this_part;
+	bool eom;
 
+	/* Get pointer to private data structure */
 	data = filp->private_data;
 
 	buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
@@ -528,87 +1079,922 @@ static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
 		goto exit;
 	}
 
+	retval = usbtmc_splice_busy(data);
+	if (retval < 0)
+		goto exit;
+
+	/* Corked commands have to reach the device before it can answer */
+	retval = usbtmc_cork_flush(data);
+	if (retval < 0)
+		goto exit;
+
+	/* Report errors of queued writes before reading the response */
+	retval = usbtmc_write_behind_drain(data);
+	if (retval < 0)
+		goto exit;
+
 	remaining = count;
 	done = 0;
 
 	while (remaining > 0) {
-		if (remaining > USBTMC_SIZE_IOBUFFER - 12) {
-			this_part = USBTMC_SIZE_IOBUFFER - 12;
-			buffer[8] = 0;
-		} else {
-			this_part = remaining;
-			buffer[8] = 1;
-		}
+		this_part = usbtmc_msg_in_chunk(remaining,
+						USBTMC_SIZE_IOBUFFER);
 
-		/* Setup IO buffer for DEV_DEP_MSG_OUT message */
-		buffer[0] = 1;
-		buffer[1] = data->bTag;
-		buffer[2] = ~(data->bTag);
-		buffer[3] = 0; /* Reserved */
-		buffer[4] = this_part & 255;
-		buffer[5] = (this_part >> 8) & 255;
-		buffer[6] = (this_part >> 16) & 255;
-		buffer[7] = (this_part >> 24) & 255;
-		/* buffer[8] is set above... */
-		buffer[9] = 0; /* Reserved */
-		buffer[10] = 0; /* Reserved */
-		buffer[11] = 0; /* Reserved */
-
-		if (copy_from_user(&buffer[12], buf + done, this_part)) {
-			retval = -EFAULT;
+		retval = usbtmc_read_transfer(data, buffer,
+					      USBTMC_SIZE_IOBUFFER, this_part,
+					      &n_characters, &eom);
+		if (retval < 0)
 			goto exit;
-		}
-
-		n_bytes = roundup(12 + this_part, 4);
-		memset(buffer + 12 + this_part, 0, n_bytes - (12 + this_part));
-
-		retval = usb_bulk_msg(data->usb_dev,
-				      usb_sndbulkpipe(data->usb_dev,
-						      data->bulk_out),
-				      buffer, n_bytes, &actual, USBTMC_TIMEOUT);
-
-		data->bTag_last_write = data->bTag;
-		data->bTag++;
 
-		if (!data->bTag)
-			data->bTag++;
-
-		if (retval < 0) {
-			dev_err(&data->intf->dev,
-				"Unable to send data, error %d\n", retval);
-			if (data->auto_abort)
-				usbtmc_ioctl_abort_bulk_out(data);
+		/* Copy buffer to user space */
+		if (usbtmc_copy_to_iov(iov, done, &buffer[USBTMC_HEADER_SIZE],
+				       n_characters)) {
+			/* There must have been an addressing problem */
+			retval = -EFAULT;
 			goto exit;
 		}
 
-		remaining -= this_part;
-		done += this_part;
+		done += n_characters;
+		if (eom)
+			remaining = 0;
+		else
+			remaining -= n_characters;
 	}
 
-	retval = count;
+	/* Update file position value */
+	*f_pos = *f_pos + done;
+	retval = done;
+
 exit:
 	mutex_unlock(&data->io_mutex);
 	kfree(buffer);
 	return retval;
 }
 
-static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
+static ssize_t usbtmc_read(struct file *filp, char __user *buf,
+			   size_t count, loff_t *f_pos)
 {
-	struct usb_host_interface *current_setting;
-	struct usb_endpoint_descriptor *desc;
-	struct device *dev;
-	u8 *buffer;
-	int rv;
-	int n;
-	int actual;
-	int max_size;
+	struct usbtmc_device_data *data = filp->private_data;
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-	dev = &data->intf->dev;
+	/* The bulk in pipe belongs to the stream, not to other openers */
+	if (data->stream_owner)
+		return data->stream_owner == filp ?
+		       usbtmc_stream_read(data, filp, buf, count) : -EBUSY;
 
-	dev_dbg(dev, "Sending INITIATE_CLEAR request\n");
+	return usbtmc_read_iov(filp, &iov, count, f_pos);
+}
 
-	buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
-	if (!buffer)
+/* readv(): the response is spread over all segments */
+static ssize_t usbtmc_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			       unsigned long nr_segs, loff_t pos)
+{
+	struct usbtmc_device_data *data = iocb->ki_filp->private_data;
+
+	if (data->stream_owner)
+		return -EINVAL;
+
+	return usbtmc_read_iov(iocb->ki_filp, iov, iov_length(iov, nr_segs),
+			       &iocb->ki_pos);
+}
+
+/*
+ * Write-behind mode. write() only copies the data into bulk out URBs and
+ * queues them; errors are collected in out_queue and reported by the next
+ * read(), write(), fsync() or USBTMC_IOCTL_DRAIN, like with buffered file
+ * I/O. Up to USBTMC_WRITE_BEHIND_URBS transfers may be in flight. The mode
+ * belongs to the file that switched it on, writes of other openers wait
+ * for the queue and are sent directly.
+ *
+ * When a transfer fails, the ones queued behind it are unlinked: the
+ * device must not see the rest of a message without the part before.
+ * Group writes have a queue of their own, so a failure of either leaves
+ * the other alone.
+ * Only the failure is reported, not the unlinked or killed transfers.
+ */
+
+/* Completion of a transfer queued on queue */
+static void usbtmc_out_complete(struct urb *urb,
+				struct usbtmc_out_queue *queue)
+{
+	struct usbtmc_device_data *data = urb->context;
+	struct usbtmc_bulk_header *hdr = urb->transfer_buffer;
+	struct timespec ts;
+	unsigned long flags;
+	bool failed = false;
+
+	getrawmonotonic(&ts);
+
+	spin_lock_irqsave(&data->out_lock, flags);
+	if (urb->status == -ENOENT || urb->status == -ECONNRESET) {
+		/* Killed or unlinked on purpose, the cause is reported */
+	} else if (urb->status) {
+		if (!queue->error) {
+			queue->error = urb->status;
+			failed = true;
+		}
+	} else if (hdr->bmTransferAttributes & USBTMC_ATTR_EOM) {
+		/* A new command starts a new set of timestamps */
+		data->timestamps.bTag_out = hdr->bTag;
+		data->timestamps.out_done.ns = timespec_to_ns(&ts);
+		data->timestamps.out_done.frame =
+			usb_get_current_frame_number(urb->dev);
+		data->timestamps.valid = USBTMC_STAMP_OUT_DONE;
+		data->timestamps.in_transfers = 0;
+	}
+	spin_unlock_irqrestore(&data->out_lock, flags);
+
+	/* Cannot sleep here, so no usb_kill_anchored_urbs() */
+	if (failed)
+		usb_unlink_anchored_urbs(&queue->anchor);
+
+	atomic_dec(&queue->pending);
+	wake_up(&data->out_wait);
+}
+
+static void usbtmc_write_behind_complete(struct urb *urb)
+{
+	struct usbtmc_device_data *data = urb->context;
+
+	usbtmc_out_complete(urb, &data->out_queue);
+}
+
+/* Errors of group writes are kept apart, see usbtmc_group_wait() */
+static void usbtmc_group_complete(struct urb *urb)
+{
+	struct usbtmc_device_data *data = urb->context;
+
+	usbtmc_out_complete(urb, &data->group_queue);
+}
+
+/* Take the first error of queued transfers. Called with io_mutex held */
+static int usbtmc_out_error(struct usbtmc_device_data *data)
+{
+	int retval;
+
+	spin_lock_irq(&data->out_lock);
+	retval = data->out_queue.error;
+	data->out_queue.error = 0;
+	spin_unlock_irq(&data->out_lock);
+
+	return retval;
+}
+
+/*
+ * Wait until no more than limit transfers are in flight on queue. Each
+ * transfer gets USBTMC_TIMEOUT, however many are queued: only when none
+ * completes for that long is everything still queued killed. The timeout
+ * is also kept as the queue's error, for the owner of the queue to find
+ * even when another file's write ran into it.
+ */
+static int usbtmc_out_wait(struct usbtmc_device_data *data,
+			   struct usbtmc_out_queue *queue, int limit)
+{
+	int pending;
+
+	while ((pending = atomic_read(&queue->pending)) > limit) {
+		if (!wait_event_timeout(data->out_wait,
+					atomic_read(&queue->pending) <
+					pending,
+					msecs_to_jiffies(USBTMC_TIMEOUT))) {
+			dev_err(&data->intf->dev, "Queued writes timed out\n");
+			spin_lock_irq(&data->out_lock);
+			if (!queue->error)
+				queue->error = -ETIMEDOUT;
+			spin_unlock_irq(&data->out_lock);
+			usb_kill_anchored_urbs(&queue->anchor);
+			return -ETIMEDOUT;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for all queued transfers and return the first error seen since
+ * the last call. Called with io_mutex held.
+ */
+static int usbtmc_write_behind_drain(struct usbtmc_device_data *data)
+{
+	int retval;
+	int rv;
+
+	retval = usbtmc_out_wait(data, &data->out_queue, 0);
+	rv = usbtmc_out_error(data);
+	if (rv)
+		retval = rv;
+
+	if (retval < 0) {
+		dev_err(&data->intf->dev,
+			"Unable to send queued data, error %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_out(data);
+	}
+
+	return retval;
+}
+
+/*
+ * Queue the complete transfer in buffer on queue. The buffer must come
+ * from kmalloc() and is freed with the URB. Called with io_mutex held.
+ */
+static int usbtmc_out_submit(struct usbtmc_device_data *data,
+			     struct usbtmc_out_queue *queue, u8 *buffer,
+			     int n_bytes, usb_complete_t complete)
+{
+	struct urb *urb;
+	int retval;
+
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		kfree(buffer);
+		return -ENOMEM;
+	}
+
+	usb_fill_bulk_urb(urb, data->usb_dev,
+			  usb_sndbulkpipe(data->usb_dev, data->bulk_out),
+			  buffer, n_bytes, complete, data);
+	urb->transfer_flags |= URB_FREE_BUFFER;
+
+	usb_anchor_urb(urb, &queue->anchor);
+	atomic_inc(&queue->pending);
+	retval = usb_submit_urb(urb, GFP_KERNEL);
+	if (retval) {
+		atomic_dec(&queue->pending);
+		usb_unanchor_urb(urb);
+	}
+
+	/* The anchor holds its own reference */
+	usb_free_urb(urb);
+	return retval;
+}
+
+/* Queue a copy of the complete transfer in buffer. Called with io_mutex held */
+static int usbtmc_write_behind(struct usbtmc_device_data *data,
+			       const u8 *buffer, int n_bytes)
+{
+	u8 *copy;
+	int retval;
+
+	/* An earlier failure is reported before anything else is queued */
+	retval = usbtmc_out_error(data);
+	if (retval)
+		return retval;
+
+	retval = usbtmc_out_wait(data, &data->out_queue,
+				 USBTMC_WRITE_BEHIND_URBS - 1);
+	if (retval)
+		return retval;
+
+	copy = kmemdup(buffer, n_bytes, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	return usbtmc_out_submit(data, &data->out_queue, copy, n_bytes,
+				 usbtmc_write_behind_complete);
+}
+
+/* Called with io_mutex held */
+static int usbtmc_set_write_behind(struct usbtmc_device_data *data,
+				   struct file *filp, void __user *arg)
+{
+	u8 enable;
+	int retval;
+
+	if (get_user(enable, (u8 __user *)arg))
+		return -EFAULT;
+
+	if (enable) {
+		if (data->write_behind_owner)
+			return data->write_behind_owner == filp ? 0 : -EBUSY;
+		data->write_behind_owner = filp;
+		return 0;
+	}
+
+	if (data->write_behind_owner != filp)
+		return 0;
+
+	/* Leaving the mode, data queued so far must be sent */
+	retval = usbtmc_write_behind_drain(data);
+	if (retval < 0)
+		return retval;
+
+	data->write_behind_owner = NULL;
+	return 0;
+}
+
+static int usbtmc_fsync(struct file *filp, loff_t start, loff_t end,
+			int datasync)
+{
+	struct usbtmc_device_data *data = filp->private_data;
+	int retval;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	retval = usbtmc_cork_flush(data);
+	if (retval == 0)
+		retval = usbtmc_write_behind_drain(data);
+
+exit:
+	mutex_unlock(&data->io_mutex);
+	return retval;
+}
+
+/*
+ * Put the DEV_DEP_MSG_OUT header in front of this_part bytes of payload
+ * at buffer + 12 and the alignment bytes after it, using up one bTag.
+ * Returns the length of the transfer. Called with io_mutex held.
+ */
+static int usbtmc_fill_out_header(struct usbtmc_device_data *data,
+				  u8 *buffer, int this_part, bool eom)
+{
+	int n_bytes;
+
+	usbtmc_msg_out((struct usbtmc_bulk_header *)buffer, data->bTag,
+		       this_part, eom);
+
+	n_bytes = usbtmc_msg_transfer_size(this_part);
+	memset(buffer + USBTMC_HEADER_SIZE + this_part, 0,
+	       n_bytes - (USBTMC_HEADER_SIZE + this_part));
+
+	data->bTag_last_write = data->bTag;
+	data->bTag = usbtmc_msg_next_btag(data->bTag);
+
+	return n_bytes;
+}
+
+/*
+ * Send this_part bytes of payload, already placed at buffer + 12, as one
+ * DEV_DEP_MSG_OUT transfer. buffer must have room for the alignment
+ * bytes. In write-behind mode the transfer is only queued. Called with
+ * io_mutex held.
+ */
+static int usbtmc_write_transfer(struct usbtmc_device_data *data,
+				 struct file *filp, u8 *buffer, int this_part,
+				 bool eom)
+{
+	struct usbtmc_stamp stamp;
+	int n_bytes;
+	int actual;
+	int retval;
+
+	if (filp && data->write_behind_owner == filp) {
+		n_bytes = usbtmc_fill_out_header(data, buffer, this_part, eom);
+		return usbtmc_write_behind(data, buffer, n_bytes);
+	}
+
+	/* Queued data of the write-behind file and of groups goes first */
+	retval = usbtmc_out_wait(data, &data->out_queue, 0);
+	if (retval == 0)
+		retval = usbtmc_out_wait(data, &data->group_queue, 0);
+	if (retval < 0)
+		return retval;
+
+	n_bytes = usbtmc_fill_out_header(data, buffer, this_part, eom);
+
+	retval = usbtmc_bulk_msg(data,
+				 usb_sndbulkpipe(data->usb_dev,
+						 data->bulk_out),
+				 buffer, n_bytes, &actual, &stamp);
+
+	if (retval < 0) {
+		dev_err(&data->intf->dev,
+			"Unable to send data, error %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_out(data);
+		return retval;
+	}
+
+	/* A new command starts a new set of timestamps */
+	if (eom) {
+		data->timestamps.bTag_out = data->bTag_last_write;
+		data->timestamps.out_done = stamp;
+		data->timestamps.valid = USBTMC_STAMP_OUT_DONE;
+		data->timestamps.in_transfers = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Write coalescing. While corked, write() only appends to cork_buffer.
+ * The collected commands are sent as one DEV_DEP_MSG_OUT message with a
+ * single EOM on uncork, before the next read, or USBTMC_CORK_DELAY after
+ * the first pending write. A full buffer is sent without EOM as soon as
+ * more data arrives, so the message simply grows over several transfers.
+ */
+
+/* Called with io_mutex held */
+static int usbtmc_cork_flush(struct usbtmc_device_data *data)
+{
+	int retval = data->cork_error;
+	int rv;
+
+	data->cork_error = 0;
+	if (data->cork_fill) {
+		rv = usbtmc_write_transfer(data, data->cork_owner,
+					   data->cork_buffer, data->cork_fill,
+					   true);
+		data->cork_fill = 0;
+		if (rv < 0)
+			retval = rv;
+	}
+
+	return retval;
+}
+
+static void usbtmc_cork_work(struct work_struct *work)
+{
+	struct usbtmc_device_data *data =
+		container_of(work, struct usbtmc_device_data, cork_work.work);
+
+	mutex_lock(&data->io_mutex);
+	if (data->cork_owner && !data->zombie)
+		data->cork_error = usbtmc_cork_flush(data);
+	mutex_unlock(&data->io_mutex);
+}
+
+/* Called with io_mutex held */
+static int usbtmc_cork_append(struct usbtmc_device_data *data,
+			      const char __user *buf, size_t count)
+{
+	size_t done = 0;
+	int retval;
+	int n;
+
+	/* Report the failure of a delayed flush */
+	retval = data->cork_error;
+	data->cork_error = 0;
+	if (retval < 0)
+		return retval;
+
+	while (done < count) {
+		if (data->cork_fill ==
+		    USBTMC_SIZE_IOBUFFER - USBTMC_HEADER_SIZE) {
+			retval = usbtmc_write_transfer(data, data->cork_owner,
+						       data->cork_buffer,
+						       data->cork_fill, false);
+			data->cork_fill = 0;
+			if (retval < 0)
+				return retval;
+		}
+
+		n = usbtmc_msg_out_chunk(count - done, USBTMC_SIZE_IOBUFFER -
+						       data->cork_fill);
+		if (copy_from_user(data->cork_buffer + USBTMC_HEADER_SIZE +
+				   data->cork_fill, buf + done, n))
+			return -EFAULT;
+
+		data->cork_fill += n;
+		done += n;
+	}
+
+	/* Does nothing if the flush is already scheduled */
+	schedule_delayed_work(&data->cork_work,
+			      msecs_to_jiffies(USBTMC_CORK_DELAY));
+	return count;
+}
+
+/* Called with io_mutex held */
+static int usbtmc_cork(struct usbtmc_device_data *data, struct file *filp)
+{
+	if (data->cork_owner)
+		return data->cork_owner == filp ? 0 : -EBUSY;
+
+	data->cork_buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+	if (!data->cork_buffer)
+		return -ENOMEM;
+
+	data->cork_fill = 0;
+	data->cork_error = 0;
+	data->cork_owner = filp;
+	return 0;
+}
+
+/* Called with io_mutex held */
+static int usbtmc_uncork(struct usbtmc_device_data *data)
+{
+	int retval = 0;
+
+	if (!data->cork_owner)
+		return 0;
+
+	if (!data->zombie)
+		retval = usbtmc_cork_flush(data);
+
+	/* The work may be waiting for io_mutex, it finds nothing to do */
+	cancel_delayed_work(&data->cork_work);
+	kfree(data->cork_buffer);
+	data->cork_buffer = NULL;
+	data->cork_fill = 0;
+	data->cork_error = 0;
+	data->cork_owner = NULL;
+	return retval;
+}
+
+static ssize_t usbtmc_write_iov(struct file *filp, const struct iovec *iov,
+				unsigned long nr_segs, size_t count)
+{
+	struct usbtmc_device_data *data;
+	unsigned long seg;
+	u8 *buffer;
+	int retval;
+	int remaining;
+	int done;
+	int this_part;
+
+	data = filp->private_data;
+
+	buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	retval = usbtmc_splice_busy(data);
+	if (retval < 0)
+		goto exit;
+
+	if (data->cork_owner) {
+		for (seg = 0; seg < nr_segs; seg++) {
+			retval = usbtmc_cork_append(data, iov[seg].iov_base,
+						    iov[seg].iov_len);
+			if (retval < 0)
+				goto exit;
+		}
+		retval = count;
+		goto exit;
+	}
+
+	remaining = count;
+	done = 0;
+
+	while (remaining > 0) {
+		this_part = usbtmc_msg_out_chunk(remaining,
+						 USBTMC_SIZE_IOBUFFER);
+
+		if (usbtmc_copy_from_iov(&buffer[USBTMC_HEADER_SIZE], iov, done,
+					 this_part)) {
+			retval = -EFAULT;
+			goto exit;
+		}
+
+		retval = usbtmc_write_transfer(data, filp, buffer, this_part,
+					       this_part == remaining);
+		if (retval < 0)
+			goto exit;
+
+		remaining -= this_part;
+		done += this_part;
+	}
+
+	retval = count;
+exit:
+	mutex_unlock(&data->io_mutex);
+	kfree(buffer);
+	return retval;
+}
+
+static ssize_t usbtmc_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *f_pos)
+{
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
+
+	return usbtmc_write_iov(filp, &iov, 1, count);
+}
+
+/* writev(): all segments together form one message with a single EOM */
+static ssize_t usbtmc_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				unsigned long nr_segs, loff_t pos)
+{
+	return usbtmc_write_iov(iocb->ki_filp, iov, nr_segs,
+				iov_length(iov, nr_segs));
+}
+
+/*
+ * splice() support. Data moves between the pipe's pages and the bulk
+ * endpoints without passing through user space; the USBTMC headers and
+ * alignment bytes are still added and removed here.
+ */
+
+static void usbtmc_pipe_buf_release(struct pipe_inode_info *pipe,
+				    struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations usbtmc_pipe_buf_ops = {
+	.can_merge	= 0,
+	.map		= generic_pipe_buf_map,
+	.unmap		= generic_pipe_buf_unmap,
+	.confirm	= generic_pipe_buf_confirm,
+	.release	= usbtmc_pipe_buf_release,
+	.steal		= generic_pipe_buf_steal,
+	.get		= generic_pipe_buf_get,
+};
+
+static void usbtmc_spd_release_page(struct splice_pipe_desc *spd,
+				    unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * Called with io_mutex held. A message spliced into the device owns it
+ * from its first transfer to the one with the EOM, which may come several
+ * splice_write() calls later, see there. Any other i/o gets EBUSY meanwhile
+ * instead of putting its transfers into the middle of the message.
+ */
+static int usbtmc_splice_busy(struct usbtmc_device_data *data)
+{
+	return data->splice_owner ? -EBUSY : 0;
+}
+
+/*
+ * Number of free buffers of the pipe, waiting for one unless
+ * SPLICE_F_NONBLOCK is set.
+ */
+static int usbtmc_splice_room(struct pipe_inode_info *pipe, unsigned int flags)
+{
+	int room;
+
+	pipe_lock(pipe);
+	for (;;) {
+		if (!pipe->readers) {
+			send_sig(SIGPIPE, current, 0);
+			room = -EPIPE;
+			break;
+		}
+		room = pipe->buffers - pipe->nrbufs;
+		if (room)
+			break;
+		if (flags & SPLICE_F_NONBLOCK) {
+			room = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			room = -ERESTARTSYS;
+			break;
+		}
+		pipe_wait(pipe);
+	}
+	pipe_unlock(pipe);
+
+	return min(room, PIPE_DEF_BUFFERS);
+}
+
+/*
+ * Read the response into freshly allocated pages, one bulk in transfer per
+ * page, and hand them to the pipe with the header skipped by the offset.
+ * Data read from the device cannot be put back, so no more is read than
+ * the pipe has room for, and nothing at all before there is room. (A
+ * second writer on the same pipe can still take that room in between.)
+ */
+static ssize_t usbtmc_splice_read(struct file *filp, loff_t *ppos,
+				  struct pipe_inode_info *pipe, size_t len,
+				  unsigned int flags)
+{
+	struct usbtmc_device_data *data = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.flags		= flags,
+		.ops		= &usbtmc_pipe_buf_ops,
+		.spd_release	= usbtmc_spd_release_page,
+	};
+	struct page *page;
+	u32 n_characters;
+	size_t this_part;
+	size_t done = 0;
+	ssize_t retval = 0;
+	bool eom = false;
+	int room;
+
+	if (data->stream_owner)
+		return -EINVAL;
+
+	/* Wait for room without io_mutex, a slow reader blocks nobody else */
+	room = usbtmc_splice_room(pipe, flags);
+	if (room < 0)
+		return room;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		mutex_unlock(&data->io_mutex);
+		return -ENODEV;
+	}
+
+	retval = usbtmc_splice_busy(data);
+	if (retval == 0)
+		retval = usbtmc_cork_flush(data);
+	if (retval == 0)
+		retval = usbtmc_write_behind_drain(data);
+
+	while (retval == 0 && done < len && !eom && spd.nr_pages < room) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			retval = -ENOMEM;
+			break;
+		}
+
+		this_part = usbtmc_msg_in_chunk(len - done, PAGE_SIZE);
+		retval = usbtmc_read_transfer(data, page_address(page),
+					      PAGE_SIZE, this_part,
+					      &n_characters, &eom);
+		if (retval < 0 || !n_characters) {
+			__free_page(page);
+			break;
+		}
+
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = USBTMC_HEADER_SIZE;
+		partial[spd.nr_pages].len = n_characters;
+		spd.nr_pages++;
+		done += n_characters;
+	}
+
+	mutex_unlock(&data->io_mutex);
+
+	if (!spd.nr_pages)
+		return retval;
+
+	retval = splice_to_pipe(pipe, &spd);
+	if (retval > 0)
+		*ppos += retval;
+	return retval;
+}
+
+/* State of a splice_write() while the pipe is drained into bulk out */
+struct usbtmc_splice_out {
+	struct usbtmc_device_data *data;
+	struct file *filp;
+	u8 *buffer;
+	int fill;	/* payload bytes at buffer + 12 */
+};
+
+/*
+ * Send the buffered payload. io_mutex is only held for the transfer, not
+ * while __splice_from_pipe() waits for the pipe's writer, so that clear
+ * and abort are not held up by a slow pipe; splice_owner keeps other i/o
+ * out of the message.
+ */
+static int usbtmc_splice_transfer(struct usbtmc_splice_out *out, bool eom)
+{
+	struct usbtmc_device_data *data = out->data;
+	int retval;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie)
+		retval = -ENODEV;
+	else
+		retval = usbtmc_write_transfer(data, out->filp, out->buffer,
+					       out->fill, eom);
+	mutex_unlock(&data->io_mutex);
+
+	return retval;
+}
+
+static int usbtmc_splice_write_actor(struct pipe_inode_info *pipe,
+				     struct pipe_buffer *buf,
+				     struct splice_desc *sd)
+{
+	struct usbtmc_splice_out *out = sd->u.data;
+	unsigned int done = 0;
+	unsigned int n;
+	char *src;
+	int retval;
+
+	retval = buf->ops->confirm(pipe, buf);
+	if (retval)
+		return retval;
+
+	src = buf->ops->map(pipe, buf, 0);
+
+	while (done < sd->len) {
+		/*
+		 * Only send a full buffer once more data follows, so that
+		 * the last transfer of the splice can carry the EOM.
+		 */
+		if (out->fill == USBTMC_SIZE_IOBUFFER - USBTMC_HEADER_SIZE) {
+			retval = usbtmc_splice_transfer(out, false);
+			if (retval < 0)
+				break;
+			out->fill = 0;
+		}
+
+		n = usbtmc_msg_out_chunk(sd->len - done,
+					 USBTMC_SIZE_IOBUFFER - out->fill);
+		memcpy(out->buffer + USBTMC_HEADER_SIZE + out->fill,
+		       src + buf->offset + done, n);
+		out->fill += n;
+		done += n;
+	}
+
+	buf->ops->unmap(pipe, buf, src);
+
+	/* Data already copied is lost with the failed transfer anyway */
+	return retval < 0 ? retval : done;
+}
+
+/*
+ * All data of one splice_write() call forms one message. With
+ * SPLICE_F_MORE (set by sendfile() while more data follows) the EOM is
+ * held back, so that a whole file still makes up one message. The file
+ * owns the device until the call that sends the EOM, or fails; other
+ * files, and a second splice of the same one, get EBUSY until then.
+ */
+static ssize_t usbtmc_splice_write(struct pipe_inode_info *pipe,
+				   struct file *filp, loff_t *ppos,
+				   size_t len, unsigned int flags)
+{
+	struct usbtmc_device_data *data = filp->private_data;
+	struct usbtmc_splice_out out;
+	struct splice_desc sd = {
+		.total_len	= len,
+		.flags		= flags,
+		.pos		= *ppos,
+		.u.data		= &out,
+	};
+	ssize_t retval;
+	int rv;
+
+	out.data = data;
+	out.filp = filp;
+	out.fill = 0;
+	out.buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+	if (!out.buffer)
+		return -ENOMEM;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+	} else if (data->splice_running ||
+		   (data->splice_owner && data->splice_owner != filp)) {
+		retval = -EBUSY;
+	} else {
+		/* Pending corked data goes first, as a message of its own */
+		retval = usbtmc_cork_flush(data);
+		if (retval == 0) {
+			data->splice_owner = filp;
+			data->splice_running = true;
+		}
+	}
+	mutex_unlock(&data->io_mutex);
+	if (retval < 0)
+		goto exit;
+
+	pipe_lock(pipe);
+	retval = __splice_from_pipe(pipe, &sd, usbtmc_splice_write_actor);
+	pipe_unlock(pipe);
+
+	if (retval > 0 && out.fill) {
+		rv = usbtmc_splice_transfer(&out, !(flags & SPLICE_F_MORE));
+		if (rv < 0)
+			retval = rv;
+	}
+
+	if (retval > 0)
+		*ppos += retval;
+
+	mutex_lock(&data->io_mutex);
+	data->splice_running = false;
+	if (retval <= 0 || !(flags & SPLICE_F_MORE))
+		data->splice_owner = NULL;
+	mutex_unlock(&data->io_mutex);
+
+exit:
+	kfree(out.buffer);
+	return retval;
+}
+
+static int usbtmc_ioctl_clear(struct usbtmc_device_data *data)
+{
+	struct usb_host_interface *current_setting;
+	struct usb_endpoint_descriptor *desc;
+	struct device *dev;
+	u8 *buffer;
+	int rv;
+	int n;
+	int actual;
+	int max_size;
+
+	dev = &data->intf->dev;
+
+	dev_dbg(dev, "Sending INITIATE_CLEAR request\n");
+
+	buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+	if (!buffer)
 		return -ENOMEM;
 
 	rv = usb_control_msg(data->usb_dev,
@@ -870,84 +2256,490 @@ static ssize_t store_TermChar(struct device *dev,
 }
 static DEVICE_ATTR(TermChar, S_IRUGO, show_TermChar, store_TermChar);
 
-#define data_attribute(name)						\
-static ssize_t show_##name(struct device *dev,				\
-			   struct device_attribute *attr, char *buf)	\
-{									\
-	struct usb_interface *intf = to_usb_interface(dev);		\
-	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
-									\
-	return sprintf(buf, "%d\n", data->name);			\
-}									\
-static ssize_t store_##name(struct device *dev,				\
-			    struct device_attribute *attr,		\
-			    const char *buf, size_t count)		\
-{									\
-	struct usb_interface *intf = to_usb_interface(dev);		\
-	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
-	ssize_t result;							\
-	unsigned val;							\
-									\
-	result = sscanf(buf, "%u\n", &val);				\
-	if (result != 1)						\
-		result = -EINVAL;					\
-	data->name = val;						\
-	if (result < 0)							\
-		return result;						\
-	else								\
-		return count;						\
-}									\
-static DEVICE_ATTR(name, S_IRUGO, show_##name, store_##name)
+#define data_attribute(name)						\
+static ssize_t show_##name(struct device *dev,				\
+			   struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+									\
+	return sprintf(buf, "%d\n", data->name);			\
+}									\
+static ssize_t store_##name(struct device *dev,				\
+			    struct device_attribute *attr,		\
+			    const char *buf, size_t count)		\
+{									\
+	struct usb_interface *intf = to_usb_interface(dev);		\
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);	\
+	ssize_t result;							\
+	unsigned val;							\
+									\
+	result = sscanf(buf, "%u\n", &val);				\
+	if (result != 1)						\
+		result = -EINVAL;					\
+	data->name = val;						\
+	if (result < 0)							\
+		return result;						\
+	else								\
+		return count;						\
+}									\
+static DEVICE_ATTR(name, S_IRUGO, show_##name, store_##name)
+
+data_attribute(TermCharEnabled);
+data_attribute(auto_abort);
+
+static struct attribute *data_attrs[] = {
+	&dev_attr_TermChar.attr,
+	&dev_attr_TermCharEnabled.attr,
+	&dev_attr_auto_abort.attr,
+	NULL,
+};
+
+static struct attribute_group data_attr_grp = {
+	.attrs = data_attrs,
+};
+
+/*
+ * Status byte of the last notification on the interrupt in endpoint and
+ * its arrival time in nanoseconds on CLOCK_MONOTONIC_RAW. Reading them
+ * causes no bus traffic. Only present on devices with that endpoint.
+ */
+static ssize_t show_status_byte(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	u8 stb;
+
+	spin_lock_irq(&data->srq_lock);
+	stb = data->stb;
+	spin_unlock_irq(&data->srq_lock);
+
+	return sprintf(buf, "%d\n", stb);
+}
+static DEVICE_ATTR(status_byte, S_IRUGO, show_status_byte, NULL);
+
+static ssize_t show_status_byte_time(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	u64 ns;
+
+	spin_lock_irq(&data->srq_lock);
+	ns = data->stb_ns;
+	spin_unlock_irq(&data->srq_lock);
+
+	return sprintf(buf, "%llu\n", (unsigned long long)ns);
+}
+static DEVICE_ATTR(status_byte_time, S_IRUGO, show_status_byte_time, NULL);
+
+static struct attribute *status_attrs[] = {
+	&dev_attr_status_byte.attr,
+	&dev_attr_status_byte_time.attr,
+	NULL,
+};
+
+static struct attribute_group status_attr_grp = {
+	.attrs = status_attrs,
+};
+
+static int usbtmc_ioctl_indicator_pulse(struct usbtmc_device_data *data)
+{
+	struct device *dev;
+	u8 *buffer;
+	int rv;
+
+	dev = &data->intf->dev;
+
+	buffer = kmalloc(2, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	rv = usb_control_msg(data->usb_dev,
+			     usb_rcvctrlpipe(data->usb_dev, 0),
+			     USBTMC_REQUEST_INDICATOR_PULSE,
+			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+			     0, 0, buffer, 0x01, USBTMC_TIMEOUT);
+
+	if (rv < 0) {
+		dev_err(dev, "usb_control_msg returned %d\n", rv);
+		goto exit;
+	}
+
+	dev_dbg(dev, "INDICATOR_PULSE returned %x\n", buffer[0]);
+
+	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
+		dev_err(dev, "INDICATOR_PULSE returned %x\n", buffer[0]);
+		rv = -EPERM;
+		goto exit;
+	}
+	rv = 0;
+
+exit:
+	kfree(buffer);
+	return rv;
+}
+
+static int usbtmc_ioctl_get_timestamps(struct usbtmc_device_data *data,
+				       void __user *arg)
+{
+	struct usbtmc_msg_timestamps timestamps;
+
+	/* out_done may be updated by a write-behind completion */
+	spin_lock_irq(&data->out_lock);
+	timestamps = data->timestamps;
+	spin_unlock_irq(&data->out_lock);
+
+	if (copy_to_user(arg, &timestamps, sizeof(timestamps)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * The control node ("usbtmc_ctl", a misc device) collects the SRQs of
+ * all USBTMC devices. Each open file has its own queue of SRQ events and
+ * its own selection of minor numbers it is interested in, all of them
+ * to begin with. read() returns as many whole events as fit into the
+ * buffer; the file is pollable.
+ */
+struct usbtmc_ctl_queue {
+	struct list_head list;		/* in usbtmc_ctl_queues */
+	wait_queue_head_t wait;
+	DECLARE_BITMAP(minors, USBTMC_CTL_MINORS);
+	struct usbtmc_srq_event events[USBTMC_CTL_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int count;
+	bool overrun;			/* events were dropped */
+};
+
+static LIST_HEAD(usbtmc_ctl_queues);
+/* protects usbtmc_ctl_queues and the queues, taken in interrupt context */
+static DEFINE_SPINLOCK(usbtmc_ctl_lock);
+
+/* Called in interrupt context */
+static void usbtmc_ctl_post(int minor, u8 stb, u64 ns)
+{
+	struct usbtmc_ctl_queue *q;
+	struct usbtmc_srq_event *event;
+	unsigned long flags;
+
+	if (minor < 0 || minor >= USBTMC_CTL_MINORS)
+		return;
+
+	spin_lock_irqsave(&usbtmc_ctl_lock, flags);
+	list_for_each_entry(q, &usbtmc_ctl_queues, list) {
+		if (!test_bit(minor, q->minors))
+			continue;
+
+		/* Drop the new event, the reader learns from the flag */
+		if (q->count == USBTMC_CTL_QUEUE_SIZE) {
+			q->overrun = true;
+			continue;
+		}
+
+		event = &q->events[(q->head + q->count) %
+				   USBTMC_CTL_QUEUE_SIZE];
+		event->ns = ns;
+		event->minor = minor;
+		event->stb = stb;
+		event->flags = q->overrun ? USBTMC_SRQ_EVENT_OVERRUN : 0;
+		event->reserved = 0;
+		q->overrun = false;
+		q->count++;
+		wake_up_interruptible(&q->wait);
+	}
+	spin_unlock_irqrestore(&usbtmc_ctl_lock, flags);
+}
+
+static int usbtmc_ctl_open(struct inode *inode, struct file *filp)
+{
+	struct usbtmc_ctl_queue *q;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return -ENOMEM;
+
+	init_waitqueue_head(&q->wait);
+	bitmap_fill(q->minors, USBTMC_CTL_MINORS);
+
+	spin_lock_irq(&usbtmc_ctl_lock);
+	list_add_tail(&q->list, &usbtmc_ctl_queues);
+	spin_unlock_irq(&usbtmc_ctl_lock);
+
+	filp->private_data = q;
+	return 0;
+}
+
+static int usbtmc_ctl_release(struct inode *inode, struct file *filp)
+{
+	struct usbtmc_ctl_queue *q = filp->private_data;
+
+	spin_lock_irq(&usbtmc_ctl_lock);
+	list_del(&q->list);
+	spin_unlock_irq(&usbtmc_ctl_lock);
+
+	kfree(q);
+	return 0;
+}
+
+/* Put back events a read could not copy, in front of the queue */
+static void usbtmc_ctl_unread(struct usbtmc_ctl_queue *q,
+			      const struct usbtmc_srq_event *events,
+			      unsigned int n)
+{
+	spin_lock_irq(&usbtmc_ctl_lock);
+	while (n--) {
+		/* Newer events came in meanwhile, the oldest are dropped */
+		if (q->count == USBTMC_CTL_QUEUE_SIZE) {
+			q->overrun = true;
+			break;
+		}
+		q->head = (q->head + USBTMC_CTL_QUEUE_SIZE - 1) %
+			  USBTMC_CTL_QUEUE_SIZE;
+		q->events[q->head] = events[n];
+		q->count++;
+	}
+	spin_unlock_irq(&usbtmc_ctl_lock);
+}
+
+static ssize_t usbtmc_ctl_read(struct file *filp, char __user *buf,
+			       size_t count, loff_t *f_pos)
+{
+	struct usbtmc_ctl_queue *q = filp->private_data;
+	struct usbtmc_srq_event events[16];
+	size_t done = 0;
+	unsigned long left;
+	unsigned int copied;
+	unsigned int n;
+	unsigned int i;
+	int retval;
+
+	if (count < sizeof(events[0]))
+		return -EINVAL;
+
+	for (;;) {
+		if (filp->f_flags & O_NONBLOCK) {
+			if (!q->count)
+				return -EAGAIN;
+		} else {
+			retval = wait_event_interruptible(q->wait, q->count);
+			if (retval)
+				return retval;
+		}
+
+		/*
+		 * Copy in chunks, the lock must not be held while touching
+		 * user memory. What cannot be copied goes back to the queue.
+		 */
+		do {
+			n = min_t(size_t, (count - done) / sizeof(events[0]),
+				  ARRAY_SIZE(events));
+
+			spin_lock_irq(&usbtmc_ctl_lock);
+			n = min(n, q->count);
+			for (i = 0; i < n; i++) {
+				events[i] = q->events[q->head];
+				q->head = (q->head + 1) % USBTMC_CTL_QUEUE_SIZE;
+			}
+			q->count -= n;
+			spin_unlock_irq(&usbtmc_ctl_lock);
+
+			left = copy_to_user(buf + done, events,
+					    n * sizeof(events[0]));
+			copied = (n * sizeof(events[0]) - left) /
+				 sizeof(events[0]);
+			done += copied * sizeof(events[0]);
+			if (copied < n) {
+				usbtmc_ctl_unread(q, events + copied,
+						  n - copied);
+				return done ? done : -EFAULT;
+			}
+		} while (n);
+
+		if (done)
+			return done;
+		/* Another reader of the file took the events first */
+	}
+}
+
+static unsigned int usbtmc_ctl_poll(struct file *filp, poll_table *wait)
+{
+	struct usbtmc_ctl_queue *q = filp->private_data;
+
+	poll_wait(filp, &q->wait, wait);
+	return q->count ? POLLIN | POLLRDNORM : 0;
+}
+
+static long usbtmc_ctl_ioctl(struct file *filp, unsigned int cmd,
+			     unsigned long arg)
+{
+	struct usbtmc_ctl_queue *q = filp->private_data;
+	u32 minor;
+
+	if (cmd == USBTMC_IOCTL_CTL_GROUP)
+		return usbtmc_group_create((void __user *)arg);
+
+	if (cmd != USBTMC_IOCTL_CTL_SELECT && cmd != USBTMC_IOCTL_CTL_DESELECT)
+		return -EBADRQC;
+
+	if (get_user(minor, (u32 __user *)arg))
+		return -EFAULT;
+
+	if (minor != USBTMC_CTL_ALL_MINORS && minor >= USBTMC_CTL_MINORS)
+		return -EINVAL;
+
+	spin_lock_irq(&usbtmc_ctl_lock);
+	if (cmd == USBTMC_IOCTL_CTL_SELECT) {
+		if (minor == USBTMC_CTL_ALL_MINORS)
+			bitmap_fill(q->minors, USBTMC_CTL_MINORS);
+		else
+			set_bit(minor, q->minors);
+	} else {
+		if (minor == USBTMC_CTL_ALL_MINORS)
+			bitmap_zero(q->minors, USBTMC_CTL_MINORS);
+		else
+			clear_bit(minor, q->minors);
+	}
+	spin_unlock_irq(&usbtmc_ctl_lock);
 
-data_attribute(TermCharEnabled);
-data_attribute(auto_abort);
+	return 0;
+}
 
-static struct attribute *data_attrs[] = {
-	&dev_attr_TermChar.attr,
-	&dev_attr_TermCharEnabled.attr,
-	&dev_attr_auto_abort.attr,
-	NULL,
+static const struct file_operations usbtmc_ctl_fops = {
+	.owner		= THIS_MODULE,
+	.read		= usbtmc_ctl_read,
+	.poll		= usbtmc_ctl_poll,
+	.open		= usbtmc_ctl_open,
+	.release	= usbtmc_ctl_release,
+	.unlocked_ioctl	= usbtmc_ctl_ioctl,
 };
 
-static struct attribute_group data_attr_grp = {
-	.attrs = data_attrs,
+static struct miscdevice usbtmc_ctl_misc = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "usbtmc_ctl",
+	.fops		= &usbtmc_ctl_fops,
 };
 
-static int usbtmc_ioctl_indicator_pulse(struct usbtmc_device_data *data)
+/*
+ * Completion handler of the interrupt in URB. USB488 devices send a two
+ * byte notification: 0x81 and the status byte for an SRQ, or 0x80|bTag
+ * and the status byte as the answer to READ_STATUS_BYTE.
+ */
+static void usbtmc_interrupt(struct urb *urb)
 {
-	struct device *dev;
-	u8 *buffer;
+	struct usbtmc_device_data *data = urb->context;
+	struct device *dev = &data->intf->dev;
+	struct timespec ts;
+	unsigned long flags;
+	bool srq;
+	u64 ns;
 	int rv;
 
-	dev = &data->intf->dev;
+	switch (urb->status) {
+	case 0:
+		break;
+	case -ENOENT:
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+		/* URB killed, or device gone */
+		return;
+	default:
+		/* -EPROTO and friends: a bus glitch, SRQs must keep coming */
+		if (printk_ratelimit())
+			dev_err(dev, "interrupt in URB failed, status %d\n",
+				urb->status);
+		goto resubmit;
+	}
 
-	buffer = kmalloc(2, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	if (urb->actual_length >= 2 && (data->iin_buffer[0] & 0x80)) {
+		getrawmonotonic(&ts);
+		ns = timespec_to_ns(&ts);
+		srq = data->iin_buffer[0] == 0x81;
+
+		spin_lock_irqsave(&data->srq_lock, flags);
+		data->stb = data->iin_buffer[1];
+		data->stb_ns = ns;
+		if (srq) {
+			data->srq_stb = data->iin_buffer[1];
+			data->srq_seq++;
+		}
+		spin_unlock_irqrestore(&data->srq_lock, flags);
+
+		if (srq) {
+			dev_dbg(dev, "SRQ, status byte %x\n",
+				data->iin_buffer[1]);
+			wake_up_interruptible(&data->srq_wait);
+			usbtmc_ctl_post(data->intf->minor, data->iin_buffer[1],
+					ns);
+		}
+	}
 
-	rv = usb_control_msg(data->usb_dev,
-			     usb_rcvctrlpipe(data->usb_dev, 0),
-			     USBTMC_REQUEST_INDICATOR_PULSE,
-			     USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			     0, 0, buffer, 0x01, USBTMC_TIMEOUT);
+resubmit:
+	rv = usb_submit_urb(urb, GFP_ATOMIC);
+	if (rv)
+		dev_err(dev, "can't resubmit interrupt in URB: %d\n", rv);
+}
 
-	if (rv < 0) {
-		dev_err(dev, "usb_control_msg returned %d\n", rv);
-		goto exit;
+/* Called without io_mutex, to be usable while others do i/o */
+static bool usbtmc_srq_match(struct usbtmc_device_data *data, u32 *seq,
+			     u8 mask, u8 *stb)
+{
+	bool match = false;
+
+	spin_lock_irq(&data->srq_lock);
+	if (data->srq_seq != *seq) {
+		*seq = data->srq_seq;
+		*stb = data->srq_stb;
+		match = !mask || (*stb & mask);
 	}
+	spin_unlock_irq(&data->srq_lock);
 
-	dev_dbg(dev, "INDICATOR_PULSE returned %x\n", buffer[0]);
+	return match || data->zombie;
+}
 
-	if (buffer[0] != USBTMC_STATUS_SUCCESS) {
-		dev_err(dev, "INDICATOR_PULSE returned %x\n", buffer[0]);
-		rv = -EPERM;
-		goto exit;
-	}
-	rv = 0;
+static int usbtmc_ioctl_wait_srq(struct usbtmc_device_data *data,
+				 void __user *arg)
+{
+	struct usbtmc_srq_wait req;
+	long timeout;
+	long rv;
+	u32 seq;
+	u8 stb = 0;
 
-exit:
-	kfree(buffer);
-	return rv;
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (data->zombie)
+		return -ENODEV;
+
+	if (!data->iin_ep)
+		return -EOPNOTSUPP;
+
+	/* Only SRQs after this point count */
+	spin_lock_irq(&data->srq_lock);
+	seq = data->srq_seq;
+	spin_unlock_irq(&data->srq_lock);
+
+	if (req.timeout)
+		timeout = msecs_to_jiffies(req.timeout);
+	else
+		timeout = MAX_SCHEDULE_TIMEOUT;
+
+	rv = wait_event_interruptible_timeout(data->srq_wait,
+				usbtmc_srq_match(data, &seq, req.mask, &stb),
+				timeout);
+	if (rv < 0)
+		return rv;
+	if (data->zombie)
+		return -ENODEV;
+	if (rv == 0)
+		return -ETIMEDOUT;
+
+	req.stb = stb;
+	if (copy_to_user(arg, &req, sizeof(req)))
+		return -EFAULT;
+	return 0;
 }
 
 static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -956,6 +2748,11 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	int retval = -EBADRQC;
 
 	data = file->private_data;
+
+	/* Waiting for an SRQ must not hold up other i/o on the device */
+	if (cmd == USBTMC_IOCTL_WAIT_SRQ)
+		return usbtmc_ioctl_wait_srq(data, (void __user *)arg);
+
 	mutex_lock(&data->io_mutex);
 	if (data->zombie) {
 		retval = -ENODEV;
@@ -986,6 +2783,38 @@ static long usbtmc_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case USBTMC_IOCTL_ABORT_BULK_IN:
 		retval = usbtmc_ioctl_abort_bulk_in(data);
 		break;
+
+	case USBTMC_IOCTL_GET_TIMESTAMPS:
+		retval = usbtmc_ioctl_get_timestamps(data, (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_STREAM_START:
+		retval = usbtmc_stream_start(data, file);
+		break;
+
+	case USBTMC_IOCTL_STREAM_STOP:
+		usbtmc_stream_stop(data);
+		retval = 0;
+		break;
+
+	case USBTMC_IOCTL_CORK:
+		retval = usbtmc_cork(data, file);
+		break;
+
+	case USBTMC_IOCTL_UNCORK:
+		retval = usbtmc_uncork(data);
+		break;
+
+	case USBTMC_IOCTL_WRITE_BEHIND:
+		retval = usbtmc_set_write_behind(data, file,
+						 (void __user *)arg);
+		break;
+
+	case USBTMC_IOCTL_DRAIN:
+		retval = usbtmc_cork_flush(data);
+		if (retval == 0)
+			retval = usbtmc_write_behind_drain(data);
+		break;
 	}
 
 skip_io_on_zombie:
@@ -997,11 +2826,284 @@ static struct file_operations fops = {
 	.owner		= THIS_MODULE,
 	.read		= usbtmc_read,
 	.write		= usbtmc_write,
+	.aio_read	= usbtmc_aio_read,
+	.aio_write	= usbtmc_aio_write,
+	.splice_read	= usbtmc_splice_read,
+	.splice_write	= usbtmc_splice_write,
+	.fsync		= usbtmc_fsync,
 	.open		= usbtmc_open,
 	.release	= usbtmc_release,
 	.unlocked_ioctl	= usbtmc_ioctl,
 };
 
+/*
+ * A device group sends the same message to several devices at once. It
+ * is created on the control node from a list of usbtmc file descriptors
+ * and lives in an anonymous file. write() queues the message on every
+ * member in turn and then waits for all of them, so the transfers to
+ * different devices overlap. At most USBTMC_WRITE_BEHIND_URBS transfers
+ * are queued per member, beyond that (about 32 KiB) queueing waits for
+ * the member's earlier transfers. The result for each member is kept for
+ * USBTMC_IOCTL_GROUP_STATUS.
+ */
+struct usbtmc_group {
+	struct mutex lock;		/* one write() at a time */
+	unsigned int count;
+	struct file *files[USBTMC_GROUP_MAX];	/* referenced members */
+	int status[USBTMC_GROUP_MAX];	/* result of the last write() */
+};
+
+/*
+ * Queue the whole message on one member. Only a message of more than
+ * USBTMC_WRITE_BEHIND_URBS transfers waits, for room in the queue.
+ */
+static int usbtmc_group_submit(struct usbtmc_device_data *data,
+			       const u8 *payload, size_t count)
+{
+	u8 *buffer;
+	size_t done = 0;
+	int this_part;
+	int n_bytes;
+	int retval;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	retval = usbtmc_splice_busy(data);
+	if (retval < 0)
+		goto exit;
+
+	/*
+	 * Keep the order with what was written to the member before. The
+	 * group's transfers go on a queue of their own, the member's
+	 * write-behind queue and its errors stay for its owner.
+	 */
+	retval = usbtmc_cork_flush(data);
+
+	spin_lock_irq(&data->out_lock);
+	data->group_queue.error = 0;
+	spin_unlock_irq(&data->out_lock);
+
+	while (retval == 0 && done < count) {
+		this_part = usbtmc_msg_out_chunk(count - done,
+						 USBTMC_SIZE_IOBUFFER);
+
+		retval = usbtmc_out_wait(data, &data->group_queue,
+					 USBTMC_WRITE_BEHIND_URBS - 1);
+		if (retval)
+			break;
+
+		buffer = kmalloc(USBTMC_SIZE_IOBUFFER, GFP_KERNEL);
+		if (!buffer) {
+			retval = -ENOMEM;
+			break;
+		}
+
+		memcpy(buffer + USBTMC_HEADER_SIZE, payload + done, this_part);
+		done += this_part;
+		n_bytes = usbtmc_fill_out_header(data, buffer, this_part,
+						 done == count);
+		retval = usbtmc_out_submit(data, &data->group_queue, buffer,
+					   n_bytes, usbtmc_group_complete);
+	}
+
+exit:
+	mutex_unlock(&data->io_mutex);
+	return retval;
+}
+
+/*
+ * Wait until one member has sent everything the group queued on it, and
+ * return the first error of the group's transfers only.
+ */
+static int usbtmc_group_wait(struct usbtmc_device_data *data)
+{
+	int retval;
+
+	mutex_lock(&data->io_mutex);
+	if (data->zombie) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	retval = usbtmc_out_wait(data, &data->group_queue, 0);
+	spin_lock_irq(&data->out_lock);
+	if (data->group_queue.error)
+		retval = data->group_queue.error;
+	data->group_queue.error = 0;
+	spin_unlock_irq(&data->out_lock);
+
+	if (retval < 0) {
+		dev_err(&data->intf->dev,
+			"Unable to send group message, error %d\n", retval);
+		if (data->auto_abort)
+			usbtmc_ioctl_abort_bulk_out(data);
+	}
+
+exit:
+	mutex_unlock(&data->io_mutex);
+	return retval;
+}
+
+/*
+ * The message is queued on all members before waiting for any of them.
+ * A member's io_mutex is only held while its part is queued, so the
+ * message stays in one piece on each bus. Returns -EIO if any member
+ * failed; USBTMC_IOCTL_GROUP_STATUS tells which.
+ */
+static ssize_t usbtmc_group_write(struct file *filp, const char __user *buf,
+				  size_t count, loff_t *f_pos)
+{
+	struct usbtmc_group *group = filp->private_data;
+	struct usbtmc_device_data *data;
+	unsigned int failed = 0;
+	unsigned int n;
+	u8 *payload;
+
+	if (!count)
+		return 0;
+
+	if (count > USBTMC_GROUP_MAX_WRITE)
+		return -EINVAL;
+
+	payload = kmalloc(count, GFP_KERNEL);
+	if (!payload)
+		return -ENOMEM;
+
+	if (copy_from_user(payload, buf, count)) {
+		kfree(payload);
+		return -EFAULT;
+	}
+
+	mutex_lock(&group->lock);
+
+	for (n = 0; n < group->count; n++) {
+		data = group->files[n]->private_data;
+		group->status[n] = usbtmc_group_submit(data, payload, count);
+	}
+
+	for (n = 0; n < group->count; n++) {
+		data = group->files[n]->private_data;
+		if (group->status[n] == 0)
+			group->status[n] = usbtmc_group_wait(data);
+		if (group->status[n])
+			failed++;
+	}
+
+	mutex_unlock(&group->lock);
+	kfree(payload);
+
+	return failed ? -EIO : count;
+}
+
+static long usbtmc_group_ioctl(struct file *filp, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct usbtmc_group *group = filp->private_data;
+	struct usbtmc_group_status req;
+	int retval = 0;
+
+	if (cmd != USBTMC_IOCTL_GROUP_STATUS)
+		return -EBADRQC;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+
+	mutex_lock(&group->lock);
+	if (req.count < group->count) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	req.count = group->count;
+	if (copy_to_user((void __user *)(unsigned long)req.status,
+			 group->status, group->count * sizeof(int)) ||
+	    copy_to_user((void __user *)arg, &req, sizeof(req)))
+		retval = -EFAULT;
+
+exit:
+	mutex_unlock(&group->lock);
+	return retval;
+}
+
+static int usbtmc_group_release(struct inode *inode, struct file *filp)
+{
+	struct usbtmc_group *group = filp->private_data;
+	unsigned int n;
+
+	for (n = 0; n < group->count; n++)
+		fput(group->files[n]);
+	kfree(group);
+	return 0;
+}
+
+static const struct file_operations usbtmc_group_fops = {
+	.owner		= THIS_MODULE,
+	.write		= usbtmc_group_write,
+	.release	= usbtmc_group_release,
+	.unlocked_ioctl	= usbtmc_group_ioctl,
+};
+
+/* Returns the file descriptor of the new group */
+static int usbtmc_group_create(void __user *arg)
+{
+	struct usbtmc_group_create req;
+	struct usbtmc_group *group;
+	struct file *file;
+	s32 fds[USBTMC_GROUP_MAX];
+	unsigned int n;
+	int retval;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	if (!req.count || req.count > USBTMC_GROUP_MAX)
+		return -EINVAL;
+
+	if (copy_from_user(fds, (void __user *)(unsigned long)req.fds,
+			   req.count * sizeof(fds[0])))
+		return -EFAULT;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (!group)
+		return -ENOMEM;
+
+	mutex_init(&group->lock);
+
+	for (n = 0; n < req.count; n++) {
+		file = fget(fds[n]);
+		if (!file) {
+			retval = -EBADF;
+			goto error;
+		}
+
+		/* Only usbtmc devices can be members */
+		if (file->f_op != &fops) {
+			fput(file);
+			retval = -EINVAL;
+			goto error;
+		}
+
+		group->files[group->count++] = file;
+	}
+
+	retval = anon_inode_getfd("[usbtmc_group]", &usbtmc_group_fops,
+				  group, O_RDWR | O_CLOEXEC);
+	if (retval < 0)
+		goto error;
+
+	return retval;
+
+error:
+	for (n = 0; n < group->count; n++)
+		fput(group->files[n]);
+	kfree(group);
+	return retval;
+}
+
 static struct usb_class_driver usbtmc_class = {
 	.name =		"usbtmc%d",
 	.fops =		&fops,
@@ -1009,6 +3111,24 @@ static struct usb_class_driver usbtmc_class = {
 };
 
 
+static int usbtmc_interrupt_start(struct usbtmc_device_data *data)
+{
+	data->iin_buffer = kmalloc(data->iin_wMaxPacketSize, GFP_KERNEL);
+	if (!data->iin_buffer)
+		return -ENOMEM;
+
+	data->iin_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!data->iin_urb)
+		return -ENOMEM;
+
+	usb_fill_int_urb(data->iin_urb, data->usb_dev,
+			 usb_rcvintpipe(data->usb_dev, data->iin_ep),
+			 data->iin_buffer, data->iin_wMaxPacketSize,
+			 usbtmc_interrupt, data, data->iin_interval);
+
+	return usb_submit_urb(data->iin_urb, GFP_KERNEL);
+}
+
 static int usbtmc_probe(struct usb_interface *intf,
 			const struct usb_device_id *id)
 {
@@ -1038,6 +3158,38 @@ static int usbtmc_probe(struct usb_interface *intf,
 	data->bTag	= 1;
 	data->TermCharEnabled = 0;
 	data->TermChar = '\n';
+	memset(&data->timestamps, 0, sizeof(data->timestamps));
+	data->stream_owner = NULL;
+	data->stream_ring = NULL;
+	data->stream_stopping = false;
+	init_usb_anchor(&data->stream_anchor);
+	init_waitqueue_head(&data->stream_wait);
+	spin_lock_init(&data->stream_lock);
+	data->cork_owner = NULL;
+	data->cork_buffer = NULL;
+	data->cork_fill = 0;
+	data->cork_error = 0;
+	INIT_DELAYED_WORK(&data->cork_work, usbtmc_cork_work);
+	data->write_behind_owner = NULL;
+	data->splice_owner = NULL;
+	data->splice_running = false;
+	init_usb_anchor(&data->out_queue.anchor);
+	atomic_set(&data->out_queue.pending, 0);
+	data->out_queue.error = 0;
+	init_usb_anchor(&data->group_queue.anchor);
+	atomic_set(&data->group_queue.pending, 0);
+	data->group_queue.error = 0;
+	init_waitqueue_head(&data->out_wait);
+	spin_lock_init(&data->out_lock);
+	data->iin_ep = 0;
+	data->iin_urb = NULL;
+	data->iin_buffer = NULL;
+	init_waitqueue_head(&data->srq_wait);
+	spin_lock_init(&data->srq_lock);
+	data->srq_seq = 0;
+	data->srq_stb = 0;
+	data->stb = 0;
+	data->stb_ns = 0;
 
 	/* USBTMC devices have only one setting, so use that */
 	iface_desc = data->intf->cur_altsetting;
@@ -1066,6 +3218,31 @@ static int usbtmc_probe(struct usb_interface *intf,
 		}
 	}
 
+	/* Find int in endpoint, only present on USB488 devices */
+	for (n = 0; n < iface_desc->desc.bNumEndpoints; n++) {
+		endpoint = &iface_desc->endpoint[n].desc;
+
+		if (usb_endpoint_is_int_in(endpoint)) {
+			data->iin_ep = endpoint->bEndpointAddress;
+			data->iin_wMaxPacketSize =
+				le16_to_cpu(endpoint->wMaxPacketSize);
+			data->iin_interval = endpoint->bInterval;
+			dev_dbg(&intf->dev, "Found Int in endpoint at %u\n",
+				data->iin_ep);
+			break;
+		}
+	}
+
+	if (data->iin_ep) {
+		retcode = usbtmc_interrupt_start(data);
+		if (retcode) {
+			dev_err(&intf->dev,
+				"Unable to set up interrupt in endpoint: %d\n",
+				retcode);
+			goto error_interrupt;
+		}
+	}
+
 	retcode = get_capabilities(data);
 	if (retcode)
 		dev_err(&intf->dev, "can't read capabilities\n");
@@ -1075,6 +3252,10 @@ static int usbtmc_probe(struct usb_interface *intf,
 
 	retcode = sysfs_create_group(&intf->dev.kobj, &data_attr_grp);
 
+	if (data->iin_ep)
+		retcode = sysfs_create_group(&intf->dev.kobj,
+					     &status_attr_grp);
+
 	retcode = usb_register_dev(intf, &usbtmc_class);
 	if (retcode) {
 		dev_err(&intf->dev, "Not able to get a minor"
@@ -1089,6 +3270,11 @@ static int usbtmc_probe(struct usb_interface *intf,
 error_register:
 	sysfs_remove_group(&intf->dev.kobj, &capability_attr_grp);
 	sysfs_remove_group(&intf->dev.kobj, &data_attr_grp);
+	if (data->iin_ep)
+		sysfs_remove_group(&intf->dev.kobj, &status_attr_grp);
+	if (data->iin_urb)
+		usb_kill_urb(data->iin_urb);
+error_interrupt:
 	kref_put(&data->kref, usbtmc_delete);
 	return retcode;
 }
@@ -1103,21 +3289,51 @@ static void usbtmc_disconnect(struct usb_interface *intf)
 	usb_deregister_dev(intf, &usbtmc_class);
 	sysfs_remove_group(&intf->dev.kobj, &capability_attr_grp);
 	sysfs_remove_group(&intf->dev.kobj, &data_attr_grp);
+	if (data->iin_ep)
+		sysfs_remove_group(&intf->dev.kobj, &status_attr_grp);
 	mutex_lock(&data->io_mutex);
+	usbtmc_stream_stop(data);
 	data->zombie = 1;
+	usbtmc_uncork(data);
+	usb_kill_anchored_urbs(&data->out_queue.anchor);
+	usb_kill_anchored_urbs(&data->group_queue.anchor);
+	if (data->iin_urb)
+		usb_kill_urb(data->iin_urb);
 	mutex_unlock(&data->io_mutex);
+	wake_up_interruptible(&data->srq_wait);
 	kref_put(&data->kref, usbtmc_delete);
 }
 
 static int usbtmc_suspend (struct usb_interface *intf, pm_message_t message)
 {
-	/* this driver does not have pending URBs */
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+
+	/*
+	 * Queued writes are allowed to finish. Apart from those, only the
+	 * URBs of a talk-only stream stay pending between calls.
+	 */
+	mutex_lock(&data->io_mutex);
+	usbtmc_out_wait(data, &data->out_queue, 0);
+	usbtmc_out_wait(data, &data->group_queue, 0);
+	usbtmc_stream_kill(data);
+	if (data->iin_urb)
+		usb_kill_urb(data->iin_urb);
+	mutex_unlock(&data->io_mutex);
 	return 0;
 }
 
 static int usbtmc_resume (struct usb_interface *intf)
 {
-	return 0;
+	struct usbtmc_device_data *data = usb_get_intfdata(intf);
+	int rv = 0;
+
+	mutex_lock(&data->io_mutex);
+	if (data->iin_urb)
+		rv = usb_submit_urb(data->iin_urb, GFP_NOIO);
+	if (!rv && data->stream_owner)
+		rv = usbtmc_stream_submit(data, GFP_NOIO);
+	mutex_unlock(&data->io_mutex);
+	return rv;
 }
 
 static struct usb_driver usbtmc_driver = {
@@ -1133,9 +3349,18 @@ static int __init usbtmc_init(void)
 {
 	int retcode;
 
+	retcode = misc_register(&usbtmc_ctl_misc);
+	if (retcode) {
+		printk(KERN_ERR KBUILD_MODNAME
+		       ": Unable to register control device\n");
+		return retcode;
+	}
+
 	retcode = usb_register(&usbtmc_driver);
-	if (retcode)
+	if (retcode) {
 		printk(KERN_ERR KBUILD_MODNAME": Unable to register driver\n");
+		misc_deregister(&usbtmc_ctl_misc);
+	}
 	return retcode;
 }
 module_init(usbtmc_init);
@@ -1143,6 +3368,7 @@ module_init(usbtmc_init);
 static void __exit usbtmc_exit(void)
 {
 	usb_deregister(&usbtmc_driver);
+	misc_deregister(&usbtmc_ctl_misc);
 }
 module_exit(usbtmc_exit);
 
@@ -0,0 +1,174 @@
+/**
+ * usbtmc.h - Driver specific extensions of the USBTMC ioctl interface
+ *
+ * These definitions complement the ones in <linux/usb/tmc.h> and are meant
+ * to be included by user space programs as well as by the driver itself.
+ * See usbtmc.c for license details.
+ */
+
+#ifndef __USBTMC_H
+#define __USBTMC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#ifndef USBTMC_IOC_NR
+#define USBTMC_IOC_NR			91
+#endif
+
+/*
+ * Request numbers from 64 upwards are used for the extensions below, to
+ * stay clear of the requests defined in <linux/usb/tmc.h>.
+ */
+
+/*
+ * Point in time at which a bulk URB completed. The time is taken from
+ * CLOCK_MONOTONIC_RAW inside the URB completion handler, frame is the
+ * USB frame number at that moment (negative if the host controller
+ * could not report it).
+ */
+struct usbtmc_stamp {
+	__u64 ns;
+	__s32 frame;
+	__u32 reserved;
+};
+
+/* Bits in usbtmc_msg_timestamps.valid */
+#define USBTMC_STAMP_OUT_DONE		0x01
+#define USBTMC_STAMP_IN_FIRST		0x02
+#define USBTMC_STAMP_IN_LAST		0x04
+
+/*
+ * This structure is used with USBTMC_IOCTL_GET_TIMESTAMPS. It describes
+ * the last command sent by write() and the response read back since then:
+ * out_done is the completion of the bulk out transfer carrying the EOM of
+ * the command, in_first and in_last are the completions of the first and
+ * last bulk in transfer of the response.
+ */
+struct usbtmc_msg_timestamps {
+	__u8 bTag_out;		/* bTag of the command's last transfer */
+	__u8 bTag_in;		/* bTag of the response's last transfer */
+	__u16 valid;		/* USBTMC_STAMP_* bits */
+	__u32 in_transfers;	/* number of bulk in transfers so far */
+	struct usbtmc_stamp out_done;
+	struct usbtmc_stamp in_first;
+	struct usbtmc_stamp in_last;
+};
+
+#define USBTMC_IOCTL_GET_TIMESTAMPS	_IOR(USBTMC_IOC_NR, 64, \
+					     struct usbtmc_msg_timestamps)
+
+/*
+ * Start and stop streaming from a talk-only device. While streaming, the
+ * driver keeps bulk in URBs posted and read() returns the payload of the
+ * DEV_DEP_MSG_IN transfers sent by the device, without their headers.
+ * Only the file descriptor that started the stream reads it, read() on
+ * others fails with EBUSY. No data is dropped: while the driver's buffer
+ * is full, the device is held off until the reader catches up.
+ * Streaming stops when the file descriptor that started it is closed.
+ */
+#define USBTMC_IOCTL_STREAM_START	_IO(USBTMC_IOC_NR, 65)
+#define USBTMC_IOCTL_STREAM_STOP	_IO(USBTMC_IOC_NR, 66)
+
+/*
+ * Cork and uncork the device, in the spirit of TCP_CORK. While corked,
+ * write() collects data in the driver. It is sent as one DEV_DEP_MSG_OUT
+ * message with a single EOM on uncork, before the next read, or 200 ms
+ * after the first pending write. The driver does not add separators, so
+ * each command has to end with its own terminator (e.g. ';' or newline).
+ * An error of a delayed flush is returned by the next write().
+ */
+#define USBTMC_IOCTL_CORK		_IO(USBTMC_IOC_NR, 67)
+#define USBTMC_IOCTL_UNCORK		_IO(USBTMC_IOC_NR, 68)
+
+/*
+ * Switch write-behind mode on (argument points to a non-zero __u8) or off.
+ * In write-behind mode write() returns as soon as the data is queued for
+ * the bulk out endpoint. fsync() or USBTMC_IOCTL_DRAIN wait until all of
+ * it is sent. An error of a queued transfer is returned by the next
+ * read(), write(), fsync() or USBTMC_IOCTL_DRAIN, and the transfers
+ * queued after the failed one are dropped. The mode is set for the file
+ * descriptor, only one of a device can have it (EBUSY for the others).
+ */
+#define USBTMC_IOCTL_WRITE_BEHIND	_IOW(USBTMC_IOC_NR, 69, __u8)
+#define USBTMC_IOCTL_DRAIN		_IO(USBTMC_IOC_NR, 70)
+
+/*
+ * This structure is used with USBTMC_IOCTL_WAIT_SRQ. The call sleeps
+ * until the interrupt in endpoint delivers a service request whose status
+ * byte has one of the bits in mask set (any SRQ if mask is 0), and
+ * returns that status byte in stb. timeout is in milliseconds, 0 waits
+ * forever; -ETIMEDOUT is returned when it expires. Nothing is sent to the
+ * device, it has to be set up to request service (e.g. with *SRE and
+ * *ESE) by the caller. Only devices with an interrupt in endpoint
+ * support this, others fail with -EOPNOTSUPP.
+ */
+struct usbtmc_srq_wait {
+	__u8 mask;
+	__u8 stb;
+	__u16 reserved;
+	__u32 timeout;
+};
+
+#define USBTMC_IOCTL_WAIT_SRQ		_IOWR(USBTMC_IOC_NR, 71, \
+					      struct usbtmc_srq_wait)
+
+/*
+ * SRQ event, as read from the control node /dev/usbtmc_ctl. minor is the
+ * minor number of the device that requested service, ns the time of the
+ * notification on CLOCK_MONOTONIC_RAW.
+ */
+struct usbtmc_srq_event {
+	__u64 ns;
+	__u32 minor;
+	__u8 stb;
+	__u8 flags;		/* USBTMC_SRQ_EVENT_* bits */
+	__u16 reserved;
+};
+
+/* Events were dropped before this one because the queue was full */
+#define USBTMC_SRQ_EVENT_OVERRUN	0x01
+
+/*
+ * Add a device to or remove it from the set whose SRQs are queued for
+ * this file of the control node. The argument points to a __u32 minor
+ * number, or to USBTMC_CTL_ALL_MINORS. All devices are selected after
+ * open().
+ */
+#define USBTMC_CTL_ALL_MINORS		0xffffffff
+
+#define USBTMC_IOCTL_CTL_SELECT		_IOW(USBTMC_IOC_NR, 72, __u32)
+#define USBTMC_IOCTL_CTL_DESELECT	_IOW(USBTMC_IOC_NR, 73, __u32)
+
+/*
+ * Create a device group on the control node. fds points to an array of
+ * count file descriptors of usbtmc devices (at most USBTMC_GROUP_MAX).
+ * The ioctl returns a new file descriptor for the group. Data written to
+ * it is sent to all members in parallel as one message each; write()
+ * fails with EIO if any member failed, USBTMC_IOCTL_GROUP_STATUS on the
+ * group fills the __s32 array at status with 0 or a negative error code
+ * per member, in the order of creation. Its count must be at least the
+ * number of members and is set to that number. One write() to a group
+ * may carry up to 64 KiB.
+ */
+#define USBTMC_GROUP_MAX		64
+
+struct usbtmc_group_create {
+	__u32 count;
+	__u32 reserved;
+	__u64 fds;		/* user pointer to __s32[count] */
+};
+
+struct usbtmc_group_status {
+	__u32 count;
+	__u32 reserved;
+	__u64 status;		/* user pointer to __s32[count] */
+};
+
+/* Only the argument goes in (_IOW), the group's fd is the return value */
+#define USBTMC_IOCTL_CTL_GROUP		_IOW(USBTMC_IOC_NR, 74, \
+					     struct usbtmc_group_create)
+#define USBTMC_IOCTL_GROUP_STATUS	_IOWR(USBTMC_IOC_NR, 75, \
+					      struct usbtmc_group_status)
+
+#endif /* __USBTMC_H */
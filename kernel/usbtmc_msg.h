@@ -0,0 +1,143 @@
+/**
+ * usbtmc_msg.h - Encoding and decoding of USBTMC bulk transfer headers
+ *
+ * Every bulk transfer starts with the 12 byte header of section 3.2 of the
+ * USBTMC specification. The helpers below build the headers of the
+ * DEV_DEP_MSG_OUT and REQUEST_DEV_DEP_MSG_IN messages, validate the
+ * headers of DEV_DEP_MSG_IN responses and size the transfers. They only
+ * depend on the types and byte order macros of the kernel, so that
+ * ../bench/usbtmc_msg_bench.c can run them in user space.
+ * See usbtmc.c for license details.
+ */
+
+#ifndef __USBTMC_MSG_H
+#define __USBTMC_MSG_H
+
+/* Bulk transfer header, tables 1, 3 and 9 of the USBTMC specification */
+struct usbtmc_bulk_header {
+	u8 MsgID;
+	u8 bTag;
+	u8 bTagInverse;
+	u8 reserved;
+	__le32 TransferSize;
+	u8 bmTransferAttributes;
+	u8 TermChar;		/* REQUEST_DEV_DEP_MSG_IN only */
+	u8 reserved2[2];
+} __packed;
+
+#define USBTMC_HEADER_SIZE			12
+
+#define USBTMC_MSGID_DEV_DEP_MSG_OUT		1
+#define USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN	2
+#define USBTMC_MSGID_DEV_DEP_MSG_IN		2
+
+/* Bits of bmTransferAttributes */
+#define USBTMC_ATTR_EOM				0x01
+#define USBTMC_ATTR_TERM_CHAR			0x02
+
+/* Problems found by usbtmc_msg_check_in() */
+#define USBTMC_MSG_SIZE_LIE			0x01
+#define USBTMC_MSG_TOO_LONG			0x02
+
+static inline void usbtmc_msg_header(struct usbtmc_bulk_header *hdr,
+				     u8 MsgID, u8 bTag, u32 size)
+{
+	hdr->MsgID = MsgID;
+	hdr->bTag = bTag;
+	hdr->bTagInverse = ~bTag;
+	hdr->reserved = 0;
+	hdr->TransferSize = cpu_to_le32(size);
+	hdr->bmTransferAttributes = 0;
+	hdr->TermChar = 0;
+	hdr->reserved2[0] = 0;
+	hdr->reserved2[1] = 0;
+}
+
+/* DEV_DEP_MSG_OUT header for size bytes of payload */
+static inline void usbtmc_msg_out(struct usbtmc_bulk_header *hdr, u8 bTag,
+				  u32 size, bool eom)
+{
+	usbtmc_msg_header(hdr, USBTMC_MSGID_DEV_DEP_MSG_OUT, bTag, size);
+	if (eom)
+		hdr->bmTransferAttributes = USBTMC_ATTR_EOM;
+}
+
+/* REQUEST_DEV_DEP_MSG_IN header asking for at most size bytes */
+static inline void usbtmc_msg_request_in(struct usbtmc_bulk_header *hdr,
+					 u8 bTag, u32 size,
+					 bool term_char_enabled, u8 term_char)
+{
+	usbtmc_msg_header(hdr, USBTMC_MSGID_REQUEST_DEV_DEP_MSG_IN, bTag,
+			  size);
+	if (term_char_enabled)
+		hdr->bmTransferAttributes = USBTMC_ATTR_TERM_CHAR;
+	hdr->TermChar = term_char;
+}
+
+/* Next bTag after bTag; 0 is not a valid bTag */
+static inline u8 usbtmc_msg_next_btag(u8 bTag)
+{
+	bTag++;
+	return bTag ? bTag : 1;
+}
+
+/* Length of a transfer with size bytes of payload, alignment included */
+static inline size_t usbtmc_msg_transfer_size(size_t size)
+{
+	return roundup(USBTMC_HEADER_SIZE + size, 4);
+}
+
+/*
+ * Payload bytes of the next DEV_DEP_MSG_OUT transfer from a buffer of
+ * buffer_size bytes, which has to be a multiple of 4 so that the
+ * alignment bytes fit as well.
+ */
+static inline size_t usbtmc_msg_out_chunk(size_t remaining,
+					  size_t buffer_size)
+{
+	return min(remaining, buffer_size - USBTMC_HEADER_SIZE);
+}
+
+/*
+ * Bytes to ask for with REQUEST_DEV_DEP_MSG_IN so that the response,
+ * alignment bytes included, fits into a buffer of buffer_size bytes.
+ */
+static inline size_t usbtmc_msg_in_chunk(size_t remaining,
+					 size_t buffer_size)
+{
+	return min(remaining, buffer_size - USBTMC_HEADER_SIZE - 3);
+}
+
+/*
+ * Validate the DEV_DEP_MSG_IN header of a response of actual bytes to a
+ * request for size bytes. The payload length is stored in *n_characters,
+ * limited to what was received and requested, and *eom tells whether the
+ * device ended the message with this transfer. Returns the
+ * USBTMC_MSG_* problems found, 0 for a good header. actual must be at
+ * least USBTMC_HEADER_SIZE.
+ */
+static inline int usbtmc_msg_check_in(const struct usbtmc_bulk_header *hdr,
+				      u32 actual, u32 size,
+				      u32 *n_characters, bool *eom)
+{
+	u32 n = le32_to_cpu(hdr->TransferSize);
+	int problems = 0;
+
+	/* The instrument must not lie about the message size... */
+	if (n > actual - USBTMC_HEADER_SIZE) {
+		n = actual - USBTMC_HEADER_SIZE;
+		problems |= USBTMC_MSG_SIZE_LIE;
+	}
+
+	/* ...nor send more back than requested */
+	if (n > size) {
+		n = size;
+		problems |= USBTMC_MSG_TOO_LONG;
+	}
+
+	*n_characters = n;
+	*eom = hdr->bmTransferAttributes & USBTMC_ATTR_EOM;
+	return problems;
+}
+
+#endif /* __USBTMC_MSG_H */